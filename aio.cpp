@@ -0,0 +1,506 @@
+
+#include "aio.h"
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#endif
+#endif
+
+// Largest single request
+const static size_t k_max_request = 1 << 30;
+
+#ifdef HAVE_IO_URING
+// io_uring through raw syscalls, one submitter and one reaper
+class uring_engine : public aio_engine
+{
+public:
+	static unique_ptr<aio_engine> create(size_t depth)
+	{
+		struct io_uring_params p;
+		memset(&p, 0, sizeof(p));
+		int ring = int(syscall(__NR_io_uring_setup, unsigned(depth), &p));
+		if (ring < 0)
+			return unique_ptr<aio_engine>();
+		// Need a single ring mapping (5.4) and plain read/write ops (5.6)
+		if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_RW_CUR_POS)) {
+			::close(ring);
+			return unique_ptr<aio_engine>();
+		}
+		unique_ptr<uring_engine> r(new uring_engine(ring));
+		if (!r->map(p))
+			return unique_ptr<aio_engine>();
+		return unique_ptr<aio_engine>(r.release());
+	}
+
+	~uring_engine()
+	{
+		if (m_ring_ptr != MAP_FAILED) munmap(m_ring_ptr, m_ring_len);
+		if (m_sqe_ptr != MAP_FAILED) munmap(m_sqe_ptr, m_sqe_len);
+		::close(m_ring);
+	}
+
+	void submit(bool write, int fd, char* buf, size_t len, uint64_t offset, size_t tag)
+	{
+		assert(len <= k_max_request);
+		unsigned tail = *m_sq_tail;
+		unsigned idx = tail & *m_sq_mask;
+		struct io_uring_sqe* sqe = &m_sqes[idx];
+		memset(sqe, 0, sizeof(*sqe));
+		sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t) (uintptr_t) buf;
+		sqe->len = uint32_t(len);
+		sqe->off = offset;
+		sqe->user_data = tag;
+		m_sq_array[idx] = idx;
+		__atomic_store_n(m_sq_tail, tail + 1, __ATOMIC_RELEASE);
+		enter(1, 0, 0);
+	}
+
+	void wait(size_t& tag, int64_t& result)
+	{
+		while(true) {
+			unsigned head = *m_cq_head;
+			if (head != __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE)) {
+				struct io_uring_cqe* cqe = &m_cqes[head & *m_cq_mask];
+				tag = size_t(cqe->user_data);
+				result = cqe->res;
+				__atomic_store_n(m_cq_head, head + 1, __ATOMIC_RELEASE);
+				return;
+			}
+			enter(0, 1, IORING_ENTER_GETEVENTS);
+		}
+	}
+
+private:
+	uring_engine(int ring) : m_ring(ring), m_ring_ptr(MAP_FAILED), m_sqe_ptr(MAP_FAILED) {}
+
+	bool map(const struct io_uring_params& p)
+	{
+		size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+		size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+		m_ring_len = max(sq_len, cq_len);
+		m_ring_ptr = mmap(0, m_ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			m_ring, IORING_OFF_SQ_RING);
+		m_sqe_len = p.sq_entries * sizeof(struct io_uring_sqe);
+		m_sqe_ptr = mmap(0, m_sqe_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			m_ring, IORING_OFF_SQES);
+		if (m_ring_ptr == MAP_FAILED || m_sqe_ptr == MAP_FAILED)
+			return false;
+		char* base = (char*) m_ring_ptr;
+		m_sq_tail = (unsigned*) (base + p.sq_off.tail);
+		m_sq_mask = (unsigned*) (base + p.sq_off.ring_mask);
+		m_sq_array = (unsigned*) (base + p.sq_off.array);
+		m_sqes = (struct io_uring_sqe*) m_sqe_ptr;
+		m_cq_head = (unsigned*) (base + p.cq_off.head);
+		m_cq_tail = (unsigned*) (base + p.cq_off.tail);
+		m_cq_mask = (unsigned*) (base + p.cq_off.ring_mask);
+		m_cqes = (struct io_uring_cqe*) (base + p.cq_off.cqes);
+		return true;
+	}
+
+	void enter(unsigned to_submit, unsigned min_complete, unsigned flags)
+	{
+		while(syscall(__NR_io_uring_enter, m_ring, to_submit, min_complete, flags, nullptr, 0) < 0) {
+			if (errno != EINTR)
+				throw io_exception("io_uring_enter failed");
+		}
+	}
+
+	int m_ring;
+	void* m_ring_ptr;
+	size_t m_ring_len;
+	void* m_sqe_ptr;
+	size_t m_sqe_len;
+	unsigned* m_sq_tail;
+	unsigned* m_sq_mask;
+	unsigned* m_sq_array;
+	struct io_uring_sqe* m_sqes;
+	unsigned* m_cq_head;
+	unsigned* m_cq_tail;
+	unsigned* m_cq_mask;
+	struct io_uring_cqe* m_cqes;
+};
+#endif
+
+// Fallback, a few threads doing blocking pread/pwrite
+class thread_engine : public aio_engine
+{
+public:
+	thread_engine(size_t depth) : m_stop(false)
+	{
+		size_t count = max(size_t(1), min(depth, size_t(4)));
+		for(size_t i = 0; i < count; i++)
+			m_threads.emplace_back([this]() { run(); });
+	}
+
+	~thread_engine()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_work.notify_all();
+		for(auto& t : m_threads)
+			t.join();
+	}
+
+	void submit(bool write, int fd, char* buf, size_t len, uint64_t offset, size_t tag)
+	{
+		assert(len <= k_max_request);
+		request r = { write, fd, buf, len, offset, tag };
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_queue.push_back(r);
+		}
+		m_work.notify_one();
+	}
+
+	void wait(size_t& tag, int64_t& result)
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while(m_results.empty())
+			m_done.wait(lock);
+		tag = m_results.front().first;
+		result = m_results.front().second;
+		m_results.pop_front();
+	}
+
+private:
+	struct request {
+		bool write;
+		int fd;
+		char* buf;
+		size_t len;
+		uint64_t offset;
+		size_t tag;
+	};
+
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		while(true) {
+			while(!m_stop && m_queue.empty())
+				m_work.wait(lock);
+			if (m_stop)
+				return;
+			request r = m_queue.front();
+			m_queue.pop_front();
+			lock.unlock();
+			ssize_t n;
+			do {
+				n = r.write ? pwrite(r.fd, r.buf, r.len, off_t(r.offset))
+					: pread(r.fd, r.buf, r.len, off_t(r.offset));
+			} while(n < 0 && errno == EINTR);
+			int64_t result = n < 0 ? -errno : n;
+			lock.lock();
+			m_results.emplace_back(r.tag, result);
+			m_done.notify_one();
+		}
+	}
+
+	std::mutex m_mutex;
+	std::condition_variable m_work;
+	std::condition_variable m_done;
+	std::deque<request> m_queue;
+	std::deque<pair<size_t, int64_t>> m_results;
+	vector<std::thread> m_threads;
+	bool m_stop;
+};
+
+unique_ptr<aio_engine> aio_engine::create(size_t depth, kind k)
+{
+#ifdef HAVE_IO_URING
+	if (k != threads) {
+		unique_ptr<aio_engine> r = uring_engine::create(depth);
+		if (r || k == uring)
+			return r;
+	}
+#else
+	if (k == uring)
+		return unique_ptr<aio_engine>();
+#endif
+	return unique_ptr<aio_engine>(new thread_engine(depth));
+}
+
+static char* alloc_aligned(size_t len)
+{
+	void* p;
+	if (posix_memalign(&p, async_writer::k_align, len) != 0)
+		throw std::bad_alloc();
+	return (char*) p;
+}
+
+static uint64_t current_offset(int fd)
+{
+	off_t r = lseek(fd, 0, SEEK_CUR);
+	return r < 0 ? 0 : uint64_t(r);
+}
+
+// Where a regular file ends right now, UINT64_MAX for anything else
+static uint64_t file_end(int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode))
+		return uint64_t(st.st_size);
+	return UINT64_MAX;
+}
+
+static unique_ptr<aio_engine> make_engine(size_t depth, aio_engine::kind k)
+{
+	unique_ptr<aio_engine> r = aio_engine::create(depth, k);
+	if (!r)
+		throw io_exception("Requested async IO engine is unavailable");
+	return r;
+}
+
+async_writer::async_writer(int fd, bool owned, size_t block_size, size_t depth, aio_engine::kind k)
+	: m_engine(make_engine(depth, k))
+	, m_fd(fd)
+	, m_owned(owned)
+	, m_direct((fcntl(fd, F_GETFL) & O_DIRECT) != 0)
+	, m_block_size(block_size)
+	, m_cur(0)
+	, m_used(0)
+	, m_in_flight(0)
+	, m_offset(current_offset(fd))
+	, m_failed(false)
+{
+	assert(block_size % k_align == 0 && block_size <= k_max_request && depth > 0);
+	assert(!m_direct || m_offset % k_align == 0);
+	// One block to fill while 'depth' are in flight
+	for(size_t i = 0; i <= depth; i++) {
+		block b = { alloc_aligned(block_size), 0, 0, 0 };
+		m_blocks.push_back(b);
+		if (i) m_free.push_back(i);
+	}
+}
+
+async_writer::~async_writer()
+{
+	try {
+		if (!m_failed && m_fd >= 0)
+			drain();
+	} catch(const io_exception&) {}
+	while(m_in_flight) {
+		try { reap(); } catch(const io_exception&) {}
+	}
+	for(block& b : m_blocks)
+		free(b.data);
+	if (m_owned && m_fd >= 0)
+		::close(m_fd);
+}
+
+void async_writer::write(const char* buf, size_t len)
+{
+	if (m_failed)
+		throw io_exception("Earlier async write failed");
+	while(len) {
+		size_t n = min(len, m_block_size - m_used);
+		memcpy(m_blocks[m_cur].data + m_used, buf, n);
+		m_used += n;
+		buf += n;
+		len -= n;
+		if (m_used == m_block_size)
+			submit(m_cur, true);
+	}
+}
+
+// Start writing block i.  With advance, move on to a fresh block,
+// otherwise i stays current, as for a partial tail block.
+void async_writer::submit(size_t i, bool advance)
+{
+	block& b = m_blocks[i];
+	b.offset = m_offset;
+	b.len = m_used;
+	b.done = 0;
+	if (m_direct && b.len % k_align) {
+		size_t padded = (b.len + k_align - 1) / k_align * k_align;
+		memset(b.data + b.len, 0, padded - b.len);
+		b.len = padded;
+	}
+	m_engine->submit(true, m_fd, b.data, b.len, b.offset, i);
+	m_in_flight++;
+	if (!advance)
+		return;
+	m_offset += m_used;
+	m_used = 0;
+	while(m_free.empty())
+		reap();
+	m_cur = m_free.back();
+	m_free.pop_back();
+}
+
+void async_writer::reap()
+{
+	size_t tag;
+	int64_t result;
+	m_engine->wait(tag, result);
+	block& b = m_blocks[tag];
+	if (result <= 0) {
+		m_in_flight--;
+		if (tag != m_cur)
+			m_free.push_back(tag);
+		m_failed = true;
+		throw io_exception("IO error during async write");
+	}
+	b.done += size_t(result);
+	if (b.done < b.len) {
+		// Short write, send the rest
+		m_engine->submit(true, m_fd, b.data + b.done, b.len - b.done, b.offset + b.done, tag);
+		return;
+	}
+	m_in_flight--;
+	if (tag != m_cur)
+		m_free.push_back(tag);
+}
+
+void async_writer::wait_all()
+{
+	while(m_in_flight)
+		reap();
+}
+
+// Get everything written, without syncing
+void async_writer::drain()
+{
+	if (m_failed)
+		throw io_exception("Earlier async write failed");
+	if (m_used && m_direct && m_used % k_align) {
+		// Write the tail padded to a whole block but keep filling it, then
+		// cut the padding off the file
+		submit(m_cur, false);
+		wait_all();
+		if (ftruncate(m_fd, off_t(m_offset + m_used)) < 0)
+			throw io_exception("Error trimming file");
+		return;
+	}
+	if (m_used)
+		submit(m_cur, true);
+	wait_all();
+}
+
+void async_writer::flush()
+{
+	drain();
+	if (sync_fd(m_fd) < 0)
+		throw io_exception("Error during flush");
+}
+
+void async_writer::close()
+{
+	flush();
+	if (!m_owned) return;
+	int fd = m_fd;
+	m_fd = -1;
+	if (::close(fd) < 0)
+		throw io_exception("Error during close");
+}
+
+async_reader::async_reader(int fd, bool owned, size_t block_size, size_t depth, aio_engine::kind k)
+	: m_engine(make_engine(depth, k))
+	, m_fd(fd)
+	, m_owned(owned)
+	, m_block_size(block_size)
+	, m_cur(0)
+	, m_in_flight(0)
+	, m_offset(current_offset(fd))
+	, m_eof(false)
+{
+	assert(block_size % async_writer::k_align == 0 && block_size <= k_max_request && depth > 0);
+	for(size_t i = 0; i < depth; i++) {
+		block b = { alloc_aligned(block_size), 0, 0, 0 };
+		m_blocks.push_back(b);
+		submit(i);
+	}
+}
+
+async_reader::~async_reader()
+{
+	while(m_in_flight) {
+		try { reap(); } catch(const io_exception&) {}
+	}
+	for(block& b : m_blocks)
+		free(b.data);
+	if (m_owned)
+		::close(m_fd);
+}
+
+void async_reader::submit(size_t i)
+{
+	block& b = m_blocks[i];
+	b.pos = 0;
+	if (m_eof) {
+		// Nothing more to read
+		b.result = 0;
+		return;
+	}
+	b.result = k_pending;
+	b.offset = m_offset;
+	m_engine->submit(false, m_fd, b.data, m_block_size, m_offset, i);
+	m_offset += m_block_size;
+	m_in_flight++;
+}
+
+void async_reader::reap()
+{
+	size_t tag;
+	int64_t result;
+	m_engine->wait(tag, result);
+	m_in_flight--;
+	block& b = m_blocks[tag];
+	if (result > 0 && size_t(result) < m_block_size) {
+		// Devices only read short at their end
+		uint64_t end = file_end(m_fd);
+		if (end != UINT64_MAX && b.offset + uint64_t(result) < end) {
+			// Cut short before the end, read the whole block again so
+			// the request stays aligned
+			m_engine->submit(false, m_fd, b.data, m_block_size, b.offset, tag);
+			m_in_flight++;
+			return;
+		}
+		m_eof = true;
+	}
+	if (result == 0)
+		m_eof = true;
+	b.result = result;
+}
+
+size_t async_reader::read(char* buf, size_t len)
+{
+	size_t tot_read = 0;
+	while(len) {
+		block& b = m_blocks[m_cur];
+		while(b.result == k_pending)
+			reap();
+		if (b.result < 0)
+			throw io_exception("IO error during async read");
+		size_t avail = size_t(b.result) - b.pos;
+		if (avail == 0) {
+			if (size_t(b.result) < m_block_size)
+				return tot_read;  // End of file
+			// Reuse the block for the next read ahead
+			submit(m_cur);
+			m_cur = (m_cur + 1) % m_blocks.size();
+			continue;
+		}
+		size_t n = min(len, avail);
+		memcpy(buf, b.data + b.pos, n);
+		b.pos += n;
+		tot_read += n;
+		buf += n;
+		len -= n;
+	}
+	return tot_read;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "io.h"
+
+// Asynchronous positioned IO.  Uses io_uring when the kernel has it, and a
+// small pool of threads doing pread/pwrite otherwise.  Callers keep at
+// most 'depth' requests in flight.
+class aio_engine
+{
+public:
+	enum kind { any, uring, threads };
+	virtual ~aio_engine() {}
+
+	// Queue a read or write of len bytes at offset, tag identifies it later
+	virtual void submit(bool write, int fd, char* buf, size_t len, uint64_t offset, size_t tag) = 0;
+	// Wait for some request to finish, result is bytes done or -errno
+	virtual void wait(size_t& tag, int64_t& result) = 0;
+
+	// Make an engine, returns null if the requested kind is unavailable
+	static unique_ptr<aio_engine> create(size_t depth, kind k = any);
+};
+
+// Writes through a ring of aligned blocks, so the caller only waits when
+// every block is in flight.  If fd was opened with O_DIRECT the file is
+// written in whole aligned blocks and trimmed to size on flush.
+// flush() waits for every write to finish and then syncs the file.
+class async_writer : public writable
+{
+public:
+	const static size_t k_align = 4096;
+
+	// block_size must be a multiple of k_align.  Writes start at the
+	// current file offset, which must be aligned when using O_DIRECT.
+	async_writer(int fd, bool owned = true, size_t block_size = 1 << 20, size_t depth = 4,
+		aio_engine::kind k = aio_engine::any);
+	~async_writer();
+	void write(const char* buf, size_t len);
+	void flush();
+	void close();
+
+private:
+	struct block {
+		char* data;
+		size_t len;  // Bytes to write
+		size_t done;  // Bytes written so far
+		uint64_t offset;
+	};
+	void submit(size_t i, bool advance);
+	void reap();
+	void wait_all();
+	void drain();
+
+	unique_ptr<aio_engine> m_engine;
+	int m_fd;
+	bool m_owned;
+	bool m_direct;
+	size_t m_block_size;
+	vector<block> m_blocks;
+	vector<size_t> m_free;  // Blocks not in flight, besides m_cur
+	size_t m_cur;  // Block being filled
+	size_t m_used;  // Bytes in m_cur
+	size_t m_in_flight;
+	uint64_t m_offset;  // File offset of m_cur
+	bool m_failed;
+};
+
+// Reads sequentially with up to 'depth' blocks read ahead in flight.  Reads
+// are positioned, so fd must be a file or block device, not a pipe.  A
+// read that comes back short before the end of the file is retried.
+class async_reader : public readable
+{
+public:
+	async_reader(int fd, bool owned = true, size_t block_size = 1 << 20, size_t depth = 4,
+		aio_engine::kind k = aio_engine::any);
+	~async_reader();
+	size_t read(char* buf, size_t len);
+
+private:
+	const static int64_t k_pending = INT64_MIN;
+	struct block {
+		char* data;
+		int64_t result;  // Bytes read, -errno, or k_pending while in flight
+		size_t pos;  // Bytes consumed
+		uint64_t offset;  // File offset it was read from
+	};
+	void submit(size_t i);
+	void reap();
+
+	unique_ptr<aio_engine> m_engine;
+	int m_fd;
+	bool m_owned;
+	size_t m_block_size;
+	vector<block> m_blocks;
+	size_t m_cur;  // Block being consumed, the rest follow in ring order
+	size_t m_in_flight;
+	uint64_t m_offset;  // File offset of the next block to request
+	bool m_eof;  // Reached the end of the file, request no more
+};
@@ -0,0 +1,590 @@
+
+#include "merkle_cow.h"
+#include "ptree.h"
+#include "txn.h"
+#include <chrono>
+#include <random>
+#include <math.h>
+#include <stdio.h>
+
+// Benchmarks merkle_cow and ptree under a few workload shapes, reporting
+// throughput and per operation latency percentiles.
+// Usage: bench [--sizes=1000,100000] [--dist=seq,random,zipf] [--ops=N]
+//              [--value=N] [--theta=0.99] [--tree=merkle_cow,ptree]
+//              [--filter=bits_per_key] [--format=text|csv|json]
+//              [--reclaim=inline|deferred|background]
+//
+// Keys are loaded in distribution order: sorted for seq, shuffled for
+// random and zipf.  Measured operations then pick keys in order (seq),
+// uniformly (random) or with a Zipfian skew whose hot keys are scattered
+// over the key space (zipf).  Point operations are timed one at a time, so
+// latencies include ~20ns of clock overhead, scans are timed in batches.
+// get_miss looks up keys that aren't there, which --filter speeds up.
+// txn_commit overwrites keys through merkle_txn, committing every 1024.
+// drop times releasing the last copy of the tree, which --reclaim can
+// spread over later node allocations or move to a background thread.
+// Sizes up to 1e8 work as long as the tree fits in memory.
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double elapsed_ns(bench_clock::time_point start)
+{
+	return std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+}
+
+// Keeps the compiler from dropping work whose result is unused
+static volatile uint64_t g_sink;
+
+// Latencies of one measurement, thinned to a bounded uniform sample
+class stats
+{
+public:
+	const static size_t k_max_samples = 1 << 20;
+
+	// Record 'ops' operations which took 'ns' in all
+	void add(double ns, size_t ops = 1)
+	{
+		m_ops += ops;
+		m_ns += ns;
+		if (m_seen++ % m_stride == 0)
+			m_samples.push_back(ns / ops);
+		if (m_samples.size() == k_max_samples) {
+			for(size_t i = 0; i < k_max_samples / 2; i++)
+				m_samples[i] = m_samples[i * 2];
+			m_samples.resize(k_max_samples / 2);
+			m_stride *= 2;
+		}
+	}
+	size_t ops() const { return m_ops; }
+	double total_ns() const { return m_ns; }
+	// p in [0, 1], sorts the samples
+	double percentile(double p)
+	{
+		if (m_samples.empty())
+			return 0;
+		std::sort(m_samples.begin(), m_samples.end());
+		size_t i = min(m_samples.size() - 1, size_t(p * m_samples.size()));
+		return m_samples[i];
+	}
+
+private:
+	size_t m_ops = 0;
+	double m_ns = 0;
+	size_t m_stride = 1;
+	size_t m_seen = 0;
+	vector<double> m_samples;
+};
+
+enum dist_t { dist_seq, dist_random, dist_zipf };
+static const char* dist_names[] = { "seq", "random", "zipf" };
+
+// A permutation of [0, n) without a table: i -> (a * i + c) mod n
+class scatter
+{
+public:
+	scatter(uint64_t n) : m_n(n), m_a(2654435761u), m_c(n / 3)
+	{
+		while(gcd(m_a, n) != 1)
+			m_a += 2;
+	}
+	uint64_t operator()(uint64_t i) const { return (m_a * (i % m_n) + m_c) % m_n; }
+
+private:
+	static uint64_t gcd(uint64_t a, uint64_t b) { return b ? gcd(b, a % b) : a; }
+	uint64_t m_n, m_a, m_c;
+};
+
+// Zipfian ranks in [0, n), as in YCSB (Gray et al., "Quickly generating
+// billion-record synthetic databases").  The zeta sum is exact for the
+// first million terms and integrated beyond that.
+class zipf
+{
+public:
+	zipf(uint64_t n, double theta) : m_n(n), m_theta(theta)
+	{
+		m_zetan = zeta(n);
+		m_alpha = 1 / (1 - theta);
+		m_eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta(2) / m_zetan);
+		m_half = 1 + pow(0.5, theta);
+	}
+	template<class Rng>
+	uint64_t operator()(Rng& rng) const
+	{
+		double u = std::uniform_real_distribution<double>(0, 1)(rng);
+		double uz = u * m_zetan;
+		if (uz < 1) return 0;
+		if (uz < m_half) return 1;
+		return min(m_n - 1, uint64_t(m_n * pow(m_eta * u - m_eta + 1, m_alpha)));
+	}
+
+private:
+	double zeta(uint64_t n) const
+	{
+		const uint64_t exact = 1000000;
+		double sum = 0;
+		for(uint64_t i = 1; i <= min(n, exact); i++)
+			sum += pow(double(i), -m_theta);
+		if (n > exact)
+			sum += (pow(double(n), 1 - m_theta) - pow(double(exact), 1 - m_theta)) / (1 - m_theta);
+		return sum;
+	}
+	uint64_t m_n;
+	double m_theta, m_zetan, m_alpha, m_eta, m_half;
+};
+
+// Picks key indexes for the measured operations
+class key_picker
+{
+public:
+	key_picker(dist_t dist, uint64_t n, double theta)
+		: m_dist(dist), m_n(n), m_scatter(n), m_zipf(n, theta), m_rng(42), m_next(0) {}
+	// i'th key to load
+	uint64_t load(uint64_t i) const { return m_dist == dist_seq ? i : m_scatter(i); }
+	// Next key to operate on
+	uint64_t next()
+	{
+		switch(m_dist) {
+		case dist_seq: return m_next++ % m_n;
+		case dist_random: return m_rng() % m_n;
+		default: return m_scatter(m_zipf(m_rng));
+		}
+	}
+
+private:
+	dist_t m_dist;
+	uint64_t m_n;
+	scatter m_scatter;
+	zipf m_zipf;
+	std::mt19937_64 m_rng;
+	uint64_t m_next;
+};
+
+struct options
+{
+	vector<size_t> sizes = { 1000, 10000, 100000, 1000000 };
+	vector<dist_t> dists = { dist_seq, dist_random, dist_zipf };
+	vector<string> trees = { "merkle_cow", "ptree" };
+	size_t ops = 200000;
+	size_t value_len = 32;
+	size_t filter_bits = 0;
+	double theta = 0.99;
+	string format = "text";
+};
+
+static options g_opts;
+
+static void report(const char* tree, dist_t dist, size_t size, const char* op, stats& s)
+{
+	double secs = s.total_ns() / 1e9;
+	double tput = secs > 0 ? s.ops() / secs : 0;
+	double mean = s.ops() ? s.total_ns() / s.ops() : 0;
+	double p50 = s.percentile(0.5), p90 = s.percentile(0.9);
+	double p99 = s.percentile(0.99), p999 = s.percentile(0.999), pmax = s.percentile(1);
+	if (g_opts.format == "csv") {
+		printf("%s,%s,%zu,%s,%zu,%.0f,%.1f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+			tree, dist_names[dist], size, op, s.ops(), tput, mean, p50, p90, p99, p999, pmax);
+	} else if (g_opts.format == "json") {
+		printf("{\"tree\":\"%s\",\"dist\":\"%s\",\"size\":%zu,\"op\":\"%s\",\"ops\":%zu,"
+			"\"ops_per_sec\":%.0f,\"mean_ns\":%.1f,\"p50_ns\":%.1f,\"p90_ns\":%.1f,"
+			"\"p99_ns\":%.1f,\"p999_ns\":%.1f,\"max_ns\":%.1f}\n",
+			tree, dist_names[dist], size, op, s.ops(), tput, mean, p50, p90, p99, p999, pmax);
+	} else {
+		printf("%-10s %-6s %10zu %-13s %10zu %12.0f %9.1f %9.1f %9.1f %9.1f %9.1f %10.1f\n",
+			tree, dist_names[dist], size, op, s.ops(), tput, mean, p50, p90, p99, p999, pmax);
+	}
+	fflush(stdout);
+}
+
+static void print_header()
+{
+	if (g_opts.format == "csv")
+		printf("tree,dist,size,op,ops,ops_per_sec,mean_ns,p50_ns,p90_ns,p99_ns,p999_ns,max_ns\n");
+	else if (g_opts.format == "text")
+		printf("%-10s %-6s %10s %-13s %10s %12s %9s %9s %9s %9s %9s %10s\n",
+			"tree", "dist", "size", "op", "ops", "ops/sec", "mean", "p50", "p90", "p99", "p99.9", "max");
+}
+
+// Fixed width decimal, so key order is index order
+static void format_key(char* buf, uint64_t i)
+{
+	for(int j = 15; j >= 0; j--, i /= 10)
+		buf[j] = '0' + i % 10;
+}
+
+static shared_ptr<string> make_key(uint64_t i)
+{
+	char buf[16];
+	format_key(buf, i);
+	return make_shared<string>(buf, sizeof(buf));
+}
+
+static shared_ptr<string> make_value(uint64_t i)
+{
+	string s(g_opts.value_len, 'v');
+	for(size_t j = 0; j < s.size() && i; j++, i /= 10)
+		s[j] = '0' + i % 10;
+	return make_shared<string>(s);
+}
+
+// Throws the bytes away, counting them
+class null_writer : public writable
+{
+public:
+	void write(const char* buf, size_t len) { m_bytes += len; }
+	void flush() {}
+	size_t m_bytes = 0;
+};
+
+static void bench_merkle_cow(dist_t dist, size_t n)
+{
+	const char* name = "merkle_cow";
+	key_picker pick(dist, n, g_opts.theta);
+	size_t ops = g_opts.ops;
+	merkle_cow tree;
+	if (g_opts.filter_bits)
+		tree.set_filter(g_opts.filter_bits);
+
+	stats put;
+	for(size_t i = 0; i < n; i++) {
+		uint64_t k = pick.load(i);
+		shared_ptr<string> key = make_key(k), value = make_value(k);
+		auto start = bench_clock::now();
+		tree.put(key, value);
+		put.add(elapsed_ns(start));
+	}
+	report(name, dist, n, "put", put);
+
+	stats full;
+	auto start = bench_clock::now();
+	hash_t root = tree.root_hash();
+	full.add(elapsed_ns(start));
+	report(name, dist, n, "root_hash_all", full);
+
+	char buf[17];
+	stats get;
+	for(size_t i = 0; i < ops; i++) {
+		format_key(buf, pick.next());
+		auto start = bench_clock::now();
+		g_sink += tree.get(slice(buf, 16)).size();
+		get.add(elapsed_ns(start));
+	}
+	report(name, dist, n, "get", get);
+
+	// Between two keys, so none are there
+	stats miss;
+	buf[16] = 'x';
+	for(size_t i = 0; i < ops; i++) {
+		format_key(buf, pick.next());
+		auto start = bench_clock::now();
+		g_sink += tree.get(slice(buf, 17)).size();
+		miss.add(elapsed_ns(start));
+	}
+	report(name, dist, n, "get_miss", miss);
+
+	// The same lookups in batches
+	stats multi;
+	const size_t batch = 1024;
+	vector<string> batch_keys(batch, string(16, ' '));
+	vector<slice> slices(batch);
+	for(size_t done = 0; done < ops; done += batch) {
+		for(size_t i = 0; i < batch; i++) {
+			format_key(&batch_keys[i][0], pick.next());
+			slices[i] = slice(batch_keys[i]);
+		}
+		auto start = bench_clock::now();
+		vector<slice> vals = tree.multi_get(slices);
+		multi.add(elapsed_ns(start), batch);
+		g_sink += vals[0].size();
+	}
+	report(name, dist, n, "multi_get", multi);
+
+	stats find;
+	for(size_t i = 0; i < ops; i++) {
+		format_key(buf, pick.next());
+		auto start = bench_clock::now();
+		g_sink += tree.find(slice(buf, 16)) != tree.end();
+		find.add(elapsed_ns(start));
+	}
+	report(name, dist, n, "find", find);
+
+	// Between two keys, so the search always runs off a leaf
+	stats lower;
+	for(size_t i = 0; i < ops; i++) {
+		format_key(buf, pick.next());
+		auto start = bench_clock::now();
+		g_sink += tree.lower_bound(slice(buf, 17)) != tree.end();
+		lower.add(elapsed_ns(start));
+	}
+	report(name, dist, n, "lower_bound", lower);
+
+	// Scoped, iterators hold the root
+	{
+		stats scan;
+		auto it = tree.begin();
+		while(it != tree.end()) {
+			size_t done = 0;
+			auto start = bench_clock::now();
+			for(; done < batch && it != tree.end(); ++done, ++it)
+				g_sink += it.key().size();
+			scan.add(elapsed_ns(start), done);
+		}
+		report(name, dist, n, "iterate", scan);
+	}
+
+	// Small batches of overwrites, each followed by a root hash
+	stats rehash;
+	merkle_cow dirty = tree;
+	for(size_t round = 0; round < min(ops / 100, size_t(1000)); round++) {
+		for(size_t i = 0; i < 100; i++) {
+			uint64_t k = pick.next();
+			dirty.put(make_key(k), make_value(k + round + 1));
+		}
+		auto start = bench_clock::now();
+		root = dirty.root_hash();
+		rehash.add(elapsed_ns(start));
+	}
+	report(name, dist, n, "root_hash_100", rehash);
+
+	// Overwrites buffered in a transaction and committed as one batch
+	{
+		stats commit;
+		merkle_cow batched = tree;
+		merkle_txn txn(batched);
+		for(size_t done = 0; done < ops; done += batch) {
+			auto start = bench_clock::now();
+			for(size_t i = 0; i < batch; i++) {
+				format_key(buf, pick.next());
+				txn.put(slice(buf, 16), slice("txn"));
+			}
+			txn.commit();
+			commit.add(elapsed_ns(start), batch);
+		}
+		report(name, dist, n, "txn_commit", commit);
+	}
+
+	stats ser;
+	null_writer out;
+	tree.rehash();
+	start = bench_clock::now();
+	tree.serialize(out);
+	ser.add(elapsed_ns(start), n);
+	report(name, dist, n, "serialize", ser);
+
+	// On a copy, so the erases are copy on write like any other update
+	stats erase;
+	merkle_cow gone = tree;
+	shared_ptr<string> none;
+	for(size_t i = 0; i < min(ops, n); i++) {
+		shared_ptr<string> key = make_key(pick.next());
+		auto start = bench_clock::now();
+		gone.put(key, none);
+		erase.add(elapsed_ns(start));
+	}
+	report(name, dist, n, "erase", erase);
+	g_sink += uint8_t(root[0]) + out.m_bytes;
+
+	// The last copy of the tree going away, all in one go on this thread
+	// unless --reclaim moves the freeing
+	stats drop;
+	dirty = merkle_cow();
+	gone = merkle_cow();
+	start = bench_clock::now();
+	tree = merkle_cow();
+	drop.add(elapsed_ns(start));
+	report(name, dist, n, "drop", drop);
+}
+
+static digest make_digest(uint64_t i)
+{
+	return digest(to_string(i));
+}
+
+static void bench_ptree(dist_t dist, size_t n)
+{
+	// Keys are hashes, so the structure is the same for any load order
+	const char* name = "ptree";
+	key_picker pick(dist, n, g_opts.theta);
+	size_t ops = g_opts.ops;
+	ptree tree;
+	if (g_opts.filter_bits)
+		tree.set_filter(g_opts.filter_bits);
+
+	stats put;
+	for(size_t i = 0; i < n; i++) {
+		uint64_t k = pick.load(i);
+		digest key = make_digest(k), value = make_digest(k + n);
+		auto start = bench_clock::now();
+		tree.set(key, value);
+		put.add(elapsed_ns(start));
+	}
+	report(name, dist, n, "put", put);
+
+	stats full;
+	auto start = bench_clock::now();
+	g_sink += tree.merkle().get_bit(0);
+	full.add(elapsed_ns(start));
+	report(name, dist, n, "root_hash_all", full);
+
+	stats get;
+	for(size_t i = 0; i < ops; i++) {
+		digest key = make_digest(pick.next());
+		auto start = bench_clock::now();
+		g_sink += tree.get(key).get_bit(0);
+		get.add(elapsed_ns(start));
+	}
+	report(name, dist, n, "get", get);
+
+	stats miss;
+	for(size_t i = 0; i < ops; i++) {
+		digest key = make_digest(n + n + pick.next());
+		auto start = bench_clock::now();
+		g_sink += tree.get(key).get_bit(0);
+		miss.add(elapsed_ns(start));
+	}
+	report(name, dist, n, "get_miss", miss);
+
+	stats multi;
+	const size_t batch = 1024;
+	vector<digest> keys(batch);
+	for(size_t done = 0; done < ops; done += batch) {
+		for(size_t i = 0; i < batch; i++)
+			keys[i] = make_digest(pick.next());
+		auto start = bench_clock::now();
+		vector<digest> vals = tree.multi_get(keys);
+		multi.add(elapsed_ns(start), batch);
+		g_sink += vals[0].get_bit(0);
+	}
+	report(name, dist, n, "multi_get", multi);
+
+	// Absent keys, so the search lands between two
+	stats lower;
+	for(size_t i = 0; i < ops; i++) {
+		digest key = make_digest(n + n + pick.next());
+		auto start = bench_clock::now();
+		g_sink += tree.lower_bound(key).valid();
+		lower.add(elapsed_ns(start));
+	}
+	report(name, dist, n, "lower_bound", lower);
+
+	// Scoped, cursors hold the root
+	{
+		stats scan;
+		ptree_cursor c = tree.begin();
+		while(c.valid()) {
+			size_t done = 0;
+			auto start = bench_clock::now();
+			for(; done < batch && c.valid(); ++done, c.next())
+				g_sink += c.key().get_bit(0);
+			scan.add(elapsed_ns(start), done);
+		}
+		report(name, dist, n, "iterate", scan);
+	}
+
+	stats rehash;
+	ptree dirty = tree;
+	for(size_t round = 0; round < min(ops / 100, size_t(1000)); round++) {
+		for(size_t i = 0; i < 100; i++) {
+			uint64_t k = pick.next();
+			dirty.set(make_digest(k), make_digest(k + round + 1));
+		}
+		auto start = bench_clock::now();
+		g_sink += dirty.merkle().get_bit(0);
+		rehash.add(elapsed_ns(start));
+	}
+	report(name, dist, n, "root_hash_100", rehash);
+
+	stats erase;
+	ptree gone = tree;
+	for(size_t i = 0; i < min(ops, n); i++) {
+		digest key = make_digest(pick.next());
+		auto start = bench_clock::now();
+		gone.set(key, k_empty);
+		erase.add(elapsed_ns(start));
+	}
+	report(name, dist, n, "erase", erase);
+
+	stats drop;
+	dirty = ptree();
+	gone = ptree();
+	start = bench_clock::now();
+	tree = ptree();
+	drop.add(elapsed_ns(start));
+	report(name, dist, n, "drop", drop);
+}
+
+// Splits "a,b,c"
+static vector<string> split_list(const string& s)
+{
+	vector<string> r;
+	size_t start = 0;
+	while(start <= s.size()) {
+		size_t end = s.find(',', start);
+		if (end == string::npos) end = s.size();
+		if (end > start) r.push_back(s.substr(start, end - start));
+		start = end + 1;
+	}
+	return r;
+}
+
+static void usage()
+{
+	fprintf(stderr, "usage: bench [--sizes=1000,100000] [--dist=seq,random,zipf] [--ops=N]\n"
+		"             [--value=N] [--theta=0.99] [--tree=merkle_cow,ptree] [--filter=bits_per_key]\n"
+		"             [--format=text|csv|json] [--reclaim=inline|deferred|background]\n");
+	exit(1);
+}
+
+int main(int argc, char** argv)
+{
+	for(int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		size_t eq = arg.find('=');
+		if (arg.compare(0, 2, "--") != 0 || eq == string::npos)
+			usage();
+		string name = arg.substr(2, eq - 2), value = arg.substr(eq + 1);
+		if (name == "sizes") {
+			g_opts.sizes.clear();
+			for(const string& s : split_list(value))
+				g_opts.sizes.push_back(size_t(atof(s.c_str())));  // Takes 1e6
+		} else if (name == "dist") {
+			g_opts.dists.clear();
+			for(const string& s : split_list(value)) {
+				size_t d = std::find(dist_names, dist_names + 3, s) - dist_names;
+				if (d == 3) usage();
+				g_opts.dists.push_back(dist_t(d));
+			}
+		} else if (name == "tree") {
+			g_opts.trees = split_list(value);
+		} else if (name == "ops") {
+			g_opts.ops = size_t(atof(value.c_str()));
+		} else if (name == "value") {
+			g_opts.value_len = atol(value.c_str());
+		} else if (name == "filter") {
+			g_opts.filter_bits = atol(value.c_str());
+		} else if (name == "theta") {
+			g_opts.theta = atof(value.c_str());
+		} else if (name == "reclaim") {
+			if (value == "inline") set_reclaim_mode(reclaim_inline);
+			else if (value == "deferred") set_reclaim_mode(reclaim_deferred);
+			else if (value == "background") set_reclaim_mode(reclaim_background);
+			else usage();
+		} else if (name == "format") {
+			g_opts.format = value;
+			if (value != "text" && value != "csv" && value != "json") usage();
+		} else {
+			usage();
+		}
+	}
+
+	print_header();
+	for(const string& tree : g_opts.trees) {
+		for(size_t n : g_opts.sizes) {
+			for(dist_t dist : g_opts.dists) {
+				if (n == 0) continue;
+				if (tree == "merkle_cow") bench_merkle_cow(dist, n);
+				else if (tree == "ptree") bench_ptree(dist, n);
+				else usage();
+			}
+		}
+	}
+}
@@ -0,0 +1,99 @@
+
+#include "ptree.h"
+#include <chrono>
+#include <random>
+
+// Times the digest primitives the ptree descent is built on, and each hash
+// policy on a digest pair, a 1KB value and a 64KB value
+// Usage: bench_digest [count]
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double elapsed_ns(bench_clock::time_point start)
+{
+	return std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+}
+
+// Keeps the compiler from dropping work whose result is unused
+static volatile uint64_t g_sink;
+
+template<class Hash>
+static void bench_hash(size_t count)
+{
+	const size_t sizes[] = { 64, 1024, 65536 };
+	for(size_t size : sizes) {
+		string input(size, 'x');
+		hash_piece piece = { input.data(), input.size() };
+		uint8_t out[32];
+		// Keep the total work about the same for each size
+		size_t n = max(size_t(1), count * 64 / size);
+		auto start = bench_clock::now();
+		for(size_t i = 0; i < n; i++) {
+			input[i % size] = char(i);
+			Hash::hash(&piece, 1, out);
+			g_sink += out[0];
+		}
+		double ns = elapsed_ns(start) / n;
+		string name = string(Hash::name()) + " " + to_string(size);
+		printf("%-16s %8.2f %8.0f MB/s\n", name.c_str(), ns, size * 1e3 / ns);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	size_t count = argc > 1 ? atol(argv[1]) : 1000000;
+	const size_t pool = 4096;
+	vector<digest> ds;
+	for(size_t i = 0; i < pool; i++)
+		ds.push_back(digest(to_string(i)));
+	// Pairs that share long prefixes, as neighbours deep in a trie do
+	vector<digest> sorted = ds;
+	sort(sorted.begin(), sorted.end());
+	std::mt19937 rng(42);
+	vector<uint32_t> idx(count);
+	for(size_t i = 0; i < count; i++)
+		idx[i] = rng() % (pool - 1);
+
+	printf("%zu ops each, ns per op\n", count);
+	uint64_t sink = 0;
+
+	auto start = bench_clock::now();
+	for(size_t i = 0; i < count; i++)
+		sink += ds[idx[i]] < ds[idx[i] + 1];
+	printf("%-16s %8.2f\n", "less", elapsed_ns(start) / count);
+
+	start = bench_clock::now();
+	for(size_t i = 0; i < count; i++)
+		sink += ds[idx[i]] == ds[idx[(i + 1) % count]];
+	printf("%-16s %8.2f\n", "equal", elapsed_ns(start) / count);
+
+	start = bench_clock::now();
+	for(size_t i = 0; i < count; i++)
+		sink += sorted[idx[i]].first_diff(sorted[idx[i] + 1]);
+	printf("%-16s %8.2f\n", "first_diff", elapsed_ns(start) / count);
+
+	start = bench_clock::now();
+	for(size_t i = 0; i < count; i++)
+		sink += ds[idx[i]].get_bit(i & 255);
+	printf("%-16s %8.2f\n", "get_bit", elapsed_ns(start) / count);
+
+	start = bench_clock::now();
+	for(size_t i = 0; i < count; i++)
+		sink += ds[idx[i]].as_hex()[i & 63];
+	printf("%-16s %8.2f\n", "as_hex", elapsed_ns(start) / count);
+
+	// And the descent they serve
+	ptree tree;
+	for(size_t i = 0; i < pool; i++)
+		tree.set(ds[i], ds[pool - 1 - i]);
+	start = bench_clock::now();
+	for(size_t i = 0; i < count; i++)
+		sink += tree.get(ds[idx[i]]).get_bit(0);
+	printf("%-16s %8.2f\n", "ptree get", elapsed_ns(start) / count);
+
+	bench_hash<sha256_hash>(count);
+	bench_hash<blake3_hash>(count);
+	bench_hash<cheap_hash>(count);
+
+	g_sink = sink;
+}
@@ -0,0 +1,90 @@
+
+#include "merkle_cow.h"
+#include <chrono>
+#include <random>
+
+// Sweeps merkle_cow node fanout and reports the cost of the basic operations
+// Usage: bench_fanout [count] [key_len] [value_len]
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double elapsed_ns(bench_clock::time_point start)
+{
+	return std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+}
+
+static shared_ptr<string> make_string(uint64_t i, size_t len)
+{
+	string s = to_string(i);
+	if (s.size() < len)
+		s = string(len - s.size(), '0') + s;
+	return make_shared<string>(s);
+}
+
+template<size_t Fanout>
+void run(const vector<shared_ptr<string>>& keys, size_t value_len)
+{
+	typedef basic_merkle_cow<Fanout> tree_t;
+	size_t n = keys.size();
+	tree_t tree;
+
+	// Insert every key, hashing is deferred to root_hash
+	auto start = bench_clock::now();
+	for(size_t i = 0; i < n; i++)
+		tree.put(keys[i], make_string(i, value_len));
+	tree.root_hash();
+	double put_ns = elapsed_ns(start) / n;
+
+	// Look each one up
+	start = bench_clock::now();
+	size_t found = 0;
+	for(size_t i = 0; i < n; i++)
+		found += (tree.find(keys[i]) != tree.end());
+	double get_ns = elapsed_ns(start) / n;
+	assert(found == n);
+
+	// Walk the whole tree
+	start = bench_clock::now();
+	size_t scanned = 0;
+	for(auto it = tree.begin(); it != tree.end(); ++it)
+		scanned++;
+	double scan_ns = elapsed_ns(start) / n;
+	assert(scanned == n);
+
+	// Overwrite values, which changes no structure, only rehashes the paths
+	start = bench_clock::now();
+	for(size_t i = 0; i < n; i++)
+		tree.put(keys[i], make_string(i + 1, value_len));
+	hash_t root = tree.root_hash();
+	double rehash_ns = elapsed_ns(start) / n;
+
+	printf("%7zu %10.1f %10.1f %10.1f %10.1f   %02x%02x%02x%02x\n",
+		Fanout, put_ns, get_ns, scan_ns, rehash_ns,
+		uint8_t(root[0]), uint8_t(root[1]), uint8_t(root[2]), uint8_t(root[3]));
+}
+
+int main(int argc, char** argv)
+{
+	size_t count = argc > 1 ? atol(argv[1]) : 200000;
+	size_t key_len = argc > 2 ? atol(argv[2]) : 16;
+	size_t value_len = argc > 3 ? atol(argv[3]) : 32;
+
+	// Random distinct keys
+	std::mt19937_64 rng(42);
+	vector<shared_ptr<string>> keys;
+	set<uint64_t> used;
+	while(keys.size() < count) {
+		uint64_t k = rng() % (count * 16);
+		if (used.insert(k).second)
+			keys.push_back(make_string(k, key_len));
+	}
+
+	printf("%zu keys of %zu bytes, values of %zu bytes, ns per op\n", count, key_len, value_len);
+	printf("%7s %10s %10s %10s %10s   %s\n", "fanout", "put", "get", "scan", "rehash", "root");
+	run<4>(keys, value_len);
+	run<8>(keys, value_len);
+	run<16>(keys, value_len);
+	run<32>(keys, value_len);
+	run<64>(keys, value_len);
+	run<128>(keys, value_len);
+}
@@ -10,6 +10,7 @@ public:
 	typedef typename Policy::key_t key_t;
 	typedef typename Policy::value_t value_t;
 	typedef typename bnode<Policy>::ptr_t ptr_t;
+	typedef typename bnode<Policy>::key_ret key_ret;
 
 	// Construct a totally empty iterator
 	biter()
@@ -87,21 +88,24 @@ public:
 		m_iters[0] = m_nodes[0]->size();
 	}
 
-	void set_find(const key_t& k)
+	template<class K>
+	void set_find(const K& k)
 	{
 		if (m_height == 0)
 			return;
 		set_lower_bound(k);
 		if (is_end()) return;
-		if (Policy::less(k, get_key()))
+		if (m_nodes[m_height-1]->compare_key(m_iters[m_height-1], k) != 0)
 			set_end();
 	}
 
-	void set_lower_bound(const key_t& k)
+	template<class K>
+	void set_lower_bound(const K& k)
 	{
 		if (m_height == 0)
 			return;
-		if (!Policy::less(m_nodes[0]->key(0), k))
+		// Bounds compare in place, so searching builds no keys
+		if (m_nodes[0]->compare_key(0, k) >= 0)
 		{
 			set_begin();
 			return;
@@ -116,11 +120,12 @@ public:
 		increment();
 	}
 
-	void set_upper_bound(const key_t& k)
+	template<class K>
+	void set_upper_bound(const K& k)
 	{
 		if (m_height == 0)
 			return;
-		if (Policy::less(k, m_nodes[0]->key(0)))
+		if (m_nodes[0]->compare_key(0, k) > 0)
 		{
 			set_begin();
 			return;
@@ -192,7 +197,7 @@ public:
 	}
 
 	bool is_end() const { return m_height == 0 || m_iters[0] == m_nodes[0]->size(); }
-	const key_t& get_key() const { assert(!is_end()); return m_nodes[m_height-1]->key(m_iters[m_height-1]); }
+	key_ret get_key() const { assert(!is_end()); return m_nodes[m_height-1]->key(m_iters[m_height-1]); }
 	const value_t& get_value() const { assert(!is_end()); return m_nodes[m_height-1]->val(m_iters[m_height-1]); }
 	ptr_t get_root() const { ptr_t r;  if (m_height != 0) r = m_nodes[0]; return r; }
 	size_t get_height() const { return m_height; }
@@ -0,0 +1,291 @@
+#pragma once
+
+#include "io.h"
+#include "memory.h"
+
+// Key storage for a bnode.  A Policy picks one via its keys_t typedef.
+// Every method that can change the encoding takes the number of entries in
+// use ('size'), slots past it are ignored.
+
+// Plain key storage, every key is stored in full
+template<class Policy>
+class plain_keys
+{
+public:
+	typedef typename Policy::key_t key_t;
+	typedef const key_t& key_ret;
+	const static size_t capacity = Policy::max_size + 1;
+
+	key_ret get(size_t i) const { return m_keys[i]; }
+	void set(size_t i, const key_t& k, size_t size) { m_keys[i] = k; }
+	void clear(size_t i) { m_keys[i] = key_t(); }
+	// Move 'count' keys from src to dst within this node, ranges may overlap
+	void move(size_t dst, size_t src, size_t count)
+	{
+		if (dst < src)
+			std::move(m_keys + src, m_keys + src + count, m_keys + dst);
+		else
+			std::move_backward(m_keys + src, m_keys + src + count, m_keys + dst + count);
+	}
+	// Move 'count' keys from another node, 'size' is my size after the move
+	void transfer(size_t dst, plain_keys& other, size_t src, size_t count, size_t size)
+	{
+		std::move(other.m_keys + src, other.m_keys + src + count, m_keys + dst);
+	}
+	// Same as transfer, but leaves other untouched
+	void copy(size_t dst, const plain_keys& other, size_t src, size_t count, size_t size)
+	{
+		std::copy(other.m_keys + src, other.m_keys + src + count, m_keys + dst);
+	}
+	// Nothing to compact
+	void compact(size_t size) {}
+
+	// Searches take anything Policy::less can compare to a key
+	template<class K>
+	size_t lower_bound(const K& k, size_t size) const
+	{ return std::lower_bound(m_keys, m_keys + size, k,
+		[](const key_t& a, const K& b) -> bool { return Policy::less(a, b); }) - m_keys; }
+	template<class K>
+	size_t upper_bound(const K& k, size_t size) const
+	{ return std::upper_bound(m_keys, m_keys + size, k,
+		[](const K& a, const key_t& b) -> bool { return Policy::less(a, b); }) - m_keys; }
+	// Key i against k: negative, 0 or positive
+	template<class K>
+	int compare(size_t i, const K& k) const
+	{ return Policy::less(m_keys[i], k) ? -1 : (Policy::less(k, m_keys[i]) ? 1 : 0); }
+
+	void serialize(writable& out, size_t size) const
+	{
+		for(size_t i = 0; i < size; i++)
+			Policy::serialize_key(out, m_keys[i]);
+	}
+	void deserialize(readable& in, size_t size)
+	{
+		for(size_t i = 0; i < size; i++)
+			Policy::deserialize_key(in, m_keys[i]);
+	}
+
+	// Bytes of key data stored, and counting its out of line storage
+	size_t key_bytes(size_t size) const
+	{
+		size_t r = 0;
+		for(size_t i = 0; i < size; i++)
+			r += mem_tracker::payload(m_keys[i]);
+		return r;
+	}
+	void account(mem_tracker& t, size_t size) const
+	{
+		for(size_t i = 0; i < size; i++)
+			t.account(m_keys[i]);
+	}
+
+private:
+	key_t m_keys[capacity];
+};
+
+// Prefix compressed key storage for blob keys.  The node stores a prefix
+// shared by all of its keys once, plus the suffix of each key.  Searches
+// check the prefix once and then compare suffixes only.
+template<class Policy>
+class prefix_keys
+{
+public:
+	typedef typename Policy::key_t key_t;
+	typedef key_t key_ret;
+	const static size_t capacity = Policy::max_size + 1;
+
+	key_ret get(size_t i) const
+	{
+		if (m_prefix.size() == 0) return m_suffix[i];
+		return concat(m_prefix.data(), m_prefix.size(), m_suffix[i].data(), m_suffix[i].size());
+	}
+
+	void set(size_t i, const key_t& k, size_t size)
+	{
+		size_t plen = m_prefix.size();
+		if (size == 1) {
+			// Only key in the node, it's all prefix
+			m_prefix = k;
+			m_suffix[i] = key_t("", 0);
+			return;
+		}
+		size_t common = common_len(k.data(), k.size(), m_prefix.data(), plen);
+		if (common < plen)
+			shrink(common, size);
+		m_suffix[i] = key_t(k.data() + common, k.size() - common);
+	}
+
+	void clear(size_t i) { m_suffix[i] = key_t(); }
+
+	void move(size_t dst, size_t src, size_t count)
+	{
+		if (dst < src)
+			std::move(m_suffix + src, m_suffix + src + count, m_suffix + dst);
+		else
+			std::move_backward(m_suffix + src, m_suffix + src + count, m_suffix + dst + count);
+	}
+
+	void transfer(size_t dst, prefix_keys& other, size_t src, size_t count, size_t size)
+	{
+		if (adopt_prefix(dst, other, src, count, size))
+			std::move(other.m_suffix + src, other.m_suffix + src + count, m_suffix + dst);
+	}
+	void copy(size_t dst, const prefix_keys& other, size_t src, size_t count, size_t size)
+	{
+		if (adopt_prefix(dst, other, src, count, size))
+			std::copy(other.m_suffix + src, other.m_suffix + src + count, m_suffix + dst);
+	}
+
+	// Grow the prefix as far as possible, since keys are sorted, the common
+	// prefix of all of them is the common prefix of the first and last.
+	void compact(size_t size)
+	{
+		if (size == 0) return;
+		const key_t& first = m_suffix[0];
+		const key_t& last = m_suffix[size - 1];
+		size_t extra = common_len(first.data(), first.size(), last.data(), last.size());
+		if (extra == 0) return;
+		m_prefix = concat(m_prefix.data(), m_prefix.size(), first.data(), extra);
+		for(size_t i = 0; i < size; i++)
+			m_suffix[i] = key_t(m_suffix[i].data() + extra, m_suffix[i].size() - extra);
+	}
+
+	// Searches take anything with data() and size(), such as a slice
+	template<class K>
+	size_t lower_bound(const K& k, size_t size) const { return bound(k.data(), k.size(), size, false); }
+	template<class K>
+	size_t upper_bound(const K& k, size_t size) const { return bound(k.data(), k.size(), size, true); }
+	// Key i against k: negative, 0 or positive.  Compares the prefix and
+	// then the suffix where they are, without putting the key together.
+	template<class K>
+	int compare(size_t i, const K& k) const
+	{
+		size_t plen = m_prefix.size();
+		int c = memcmp(m_prefix.data(), k.data(), min(plen, k.size()));
+		if (c != 0) return c;
+		if (k.size() < plen) return 1;
+		return key_t::compare(m_suffix[i].data(), m_suffix[i].size(), k.data() + plen, k.size() - plen);
+	}
+
+	void serialize(writable& out, size_t size) const
+	{
+		write_blob(out, m_prefix);
+		for(size_t i = 0; i < size; i++)
+			write_blob(out, m_suffix[i]);
+	}
+	void deserialize(readable& in, size_t size)
+	{
+		read_blob(in, m_prefix);
+		for(size_t i = 0; i < size; i++)
+			read_blob(in, m_suffix[i]);
+	}
+
+	size_t key_bytes(size_t size) const
+	{
+		size_t r = m_prefix.size();
+		for(size_t i = 0; i < size; i++)
+			r += m_suffix[i].size();
+		return r;
+	}
+	void account(mem_tracker& t, size_t size) const
+	{
+		t.account(m_prefix);
+		for(size_t i = 0; i < size; i++)
+			t.account(m_suffix[i]);
+	}
+
+private:
+	static size_t common_len(const char* a, size_t alen, const char* b, size_t blen)
+	{
+		size_t n = min(alen, blen);
+		size_t i = 0;
+		while(i < n && a[i] == b[i]) i++;
+		return i;
+	}
+
+	static key_t concat(const char* a, size_t alen, const char* b, size_t blen)
+	{
+		char buf[256];
+		if (alen + blen <= sizeof(buf)) {
+			memcpy(buf, a, alen);
+			memcpy(buf + alen, b, blen);
+			return key_t(buf, alen + blen);
+		}
+		string s(a, alen);
+		s.append(b, blen);
+		return key_t(s.data(), s.size());
+	}
+
+	// Make my prefix compatible with keys coming from other.  Returns true
+	// if the suffixes can be used as is, otherwise fills them in itself.
+	bool adopt_prefix(size_t dst, const prefix_keys& other, size_t src, size_t count, size_t size)
+	{
+		if (size == count) {
+			// I have no other keys, just take the other prefix
+			m_prefix = other.m_prefix;
+			return true;
+		}
+		size_t common = common_len(m_prefix.data(), m_prefix.size(),
+			other.m_prefix.data(), other.m_prefix.size());
+		if (common < m_prefix.size())
+			shrink(common, size);
+		if (common == other.m_prefix.size())
+			return true;
+		// Put the part of the other prefix I lack back on its suffixes
+		const char* extra = other.m_prefix.data() + common;
+		size_t extra_len = other.m_prefix.size() - common;
+		for(size_t i = 0; i < count; i++) {
+			const key_t& s = other.m_suffix[src + i];
+			m_suffix[dst + i] = concat(extra, extra_len, s.data(), s.size());
+		}
+		return false;
+	}
+
+	// Shorten the prefix to 'len', moving the rest onto each suffix
+	void shrink(size_t len, size_t size)
+	{
+		const char* extra = m_prefix.data() + len;
+		size_t extra_len = m_prefix.size() - len;
+		for(size_t i = 0; i < size; i++) {
+			if (m_suffix[i].is_null()) continue;  // Slot being filled
+			m_suffix[i] = concat(extra, extra_len, m_suffix[i].data(), m_suffix[i].size());
+		}
+		m_prefix = key_t(m_prefix.data(), len);
+	}
+
+	size_t bound(const char* kd, size_t klen, size_t size, bool upper) const
+	{
+		size_t plen = m_prefix.size();
+		int c = memcmp(kd, m_prefix.data(), min(klen, plen));
+		if (c < 0 || (c == 0 && klen < plen)) return 0;  // Before every key
+		if (c > 0) return size;  // After every key
+		// Key has my prefix, search suffixes
+		const char* ks = kd + plen;
+		size_t kl = klen - plen;
+		size_t lo = 0, hi = size;
+		while(lo < hi) {
+			size_t mid = (lo + hi) / 2;
+			int r = key_t::compare(m_suffix[mid].data(), m_suffix[mid].size(), ks, kl);
+			if (r < 0 || (upper && r == 0))
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		return lo;
+	}
+
+	static void write_blob(writable& out, const key_t& b)
+	{
+		write_varint(out, b.size());
+		out.write(b.data(), b.size());
+	}
+	static void read_blob(readable& in, key_t& b)
+	{
+		string s(read_varint(in), '\0');
+		read_exact(in, &s[0], s.size());
+		b = key_t(s);
+	}
+
+	key_t m_prefix;  // Common prefix of all keys
+	key_t m_suffix[capacity];  // Remainder of each key
+};
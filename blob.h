@@ -0,0 +1,142 @@
+#pragma once
+
+#include "types.h"
+#include <atomic>
+#include <new>
+
+// A compact immutable byte string.  Strings of up to Inline bytes are held
+// directly inside the object, longer ones live in a single refcounted heap
+// block (no separate control block or std::string header).  A default
+// constructed blob is 'null', which is distinct from an empty string.
+template<size_t Inline>
+class blob : comparable<blob<Inline>>
+{
+	static_assert(Inline >= sizeof(void*) && Inline < 0xfe, "Invalid inline size");
+	// Heap representation for long strings
+	struct heap_t
+	{
+		std::atomic<uint32_t> refs;
+		uint32_t size;
+		char data[1];
+	};
+	const static uint8_t k_heap = 0xfe;
+	const static uint8_t k_null = 0xff;
+public:
+	// Make a null blob
+	blob() : m_buf(), m_tag(k_null) {}
+
+	// Make a blob from some bytes
+	blob(const char* data, size_t len)
+	{
+		if (len <= Inline) {
+			memcpy(m_buf, data, len);
+			memset(m_buf + len, 0, Inline - len);
+			m_tag = uint8_t(len);
+			return;
+		}
+		assert(len <= UINT32_MAX);
+		heap_t* h = (heap_t*) ::operator new(offsetof(heap_t, data) + len);
+		new (&h->refs) std::atomic<uint32_t>(1);
+		h->size = uint32_t(len);
+		memcpy(h->data, data, len);
+		set_heap(h);
+	}
+
+	explicit blob(const string& str) : blob(str.data(), str.size()) {}
+
+	blob(const blob& rhs)
+	{
+		memcpy(m_buf, rhs.m_buf, Inline);
+		m_tag = rhs.m_tag;
+		if (m_tag == k_heap)
+			heap()->refs.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	blob(blob&& rhs)
+	{
+		memcpy(m_buf, rhs.m_buf, Inline);
+		m_tag = rhs.m_tag;
+		rhs.m_tag = k_null;
+	}
+
+	~blob() { release(); }
+
+	blob& operator=(const blob& rhs)
+	{
+		if (this != &rhs) {
+			blob tmp(rhs);
+			swap(tmp);
+		}
+		return *this;
+	}
+
+	blob& operator=(blob&& rhs)
+	{
+		if (this != &rhs) {
+			release();
+			memcpy(m_buf, rhs.m_buf, Inline);
+			m_tag = rhs.m_tag;
+			rhs.m_tag = k_null;
+		}
+		return *this;
+	}
+
+	void swap(blob& rhs)
+	{
+		char buf[Inline];
+		memcpy(buf, m_buf, Inline);
+		memcpy(m_buf, rhs.m_buf, Inline);
+		memcpy(rhs.m_buf, buf, Inline);
+		std::swap(m_tag, rhs.m_tag);
+	}
+
+	bool is_null() const { return m_tag == k_null; }
+	bool is_inline() const { return m_tag < k_heap; }
+	const char* data() const { return m_tag == k_heap ? heap()->data : m_buf; }
+	size_t size() const
+	{
+		if (m_tag == k_heap) return heap()->size;
+		if (m_tag == k_null) return 0;
+		return m_tag;
+	}
+	string str() const { return string(data(), size()); }
+	// The out of line block (null when inline) and its size, copies of a
+	// blob share one block
+	const void* heap_block() const { return m_tag == k_heap ? heap() : nullptr; }
+	size_t heap_bytes() const { return m_tag == k_heap ? offsetof(heap_t, data) + heap()->size : 0; }
+
+	// Byte-wise ordering, same as std::string
+	bool operator<(const blob& rhs) const { return compare(data(), size(), rhs.data(), rhs.size()) < 0; }
+	bool operator==(const blob& rhs) const
+	{
+		if (m_tag == k_heap && rhs.m_tag == k_heap && heap() == rhs.heap())
+			return true;
+		size_t len = size();
+		return len == rhs.size() && memcmp(data(), rhs.data(), len) == 0;
+	}
+
+	// Compare two byte ranges, memcmp style
+	static int compare(const char* a, size_t alen, const char* b, size_t blen)
+	{
+		int r = memcmp(a, b, min(alen, blen));
+		if (r != 0) return r;
+		return alen < blen ? -1 : (alen > blen ? 1 : 0);
+	}
+
+private:
+	heap_t* heap() const { heap_t* h; memcpy(&h, m_buf, sizeof(h)); return h; }
+	void set_heap(heap_t* h) { memcpy(m_buf, &h, sizeof(h)); m_tag = k_heap; }
+	void release()
+	{
+		if (m_tag != k_heap) return;
+		heap_t* h = heap();
+		if (h->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+			h->refs.~atomic();
+			::operator delete(h);
+		}
+		m_tag = k_null;
+	}
+
+	char m_buf[Inline];  // Inline bytes, or the heap pointer
+	uint8_t m_tag;  // Inline length, or k_heap / k_null
+};
@@ -0,0 +1,49 @@
+
+#include "bloom.h"
+#include <stdlib.h>
+
+bloom_filter::bloom_filter(size_t keys, size_t bits_per_key)
+	: m_capacity(max(keys, size_t(1)))
+	, m_bits_per_key(bits_per_key)
+	, m_inserted(0)
+{
+	m_blocks = max(size_t(1), (m_capacity * bits_per_key + 511) / 512);
+	assert(m_blocks <= UINT32_MAX);
+	void* p;
+	if (posix_memalign(&p, 64, m_blocks * 64) != 0)
+		throw std::bad_alloc();
+	m_bits = (uint64_t*) p;
+	memset(m_bits, 0, m_blocks * 64);
+}
+
+bloom_filter::~bloom_filter()
+{
+	free(m_bits);
+}
+
+// Odd multipliers that spread the low 32 bits of the hash over each word
+// (the same as Parquet's split block Bloom filters)
+uint64_t bloom_filter::mask(uint32_t h, size_t word)
+{
+	static const uint32_t salt[8] = {
+		0x47b6137bu, 0x44974d91u, 0x8824ad5bu, 0xa2b7289du,
+		0x705495c7u, 0x2df1424bu, 0x9efc4947u, 0x5c6bfb31u };
+	return uint64_t(1) << ((h * salt[word]) >> 26);
+}
+
+void bloom_filter::insert(uint64_t h)
+{
+	uint64_t* b = m_bits + block(h) * 8;
+	for(size_t i = 0; i < 8; i++)
+		__atomic_fetch_or(&b[i], mask(uint32_t(h), i), __ATOMIC_RELAXED);
+	m_inserted.fetch_add(1, std::memory_order_relaxed);
+}
+
+bool bloom_filter::may_contain(uint64_t h) const
+{
+	const uint64_t* b = m_bits + block(h) * 8;
+	uint64_t miss = 0;
+	for(size_t i = 0; i < 8; i++)
+		miss |= mask(uint32_t(h), i) & ~__atomic_load_n(&b[i], __ATOMIC_RELAXED);
+	return miss == 0;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "types.h"
+#include <atomic>
+
+// A blocked Bloom filter for ruling out lookups of absent keys.  Each key
+// sets 8 bits, one in each 64 bit word of a single 64 byte block, so a
+// check reads one cache line.  Keys are given as well mixed 64 bit hashes.
+//
+// There is no erase, so a filter only grows: it stays a superset of the
+// keys of every snapshot that shares it, which is all it has to be.  Bits
+// are set with atomic ORs, so one writer may insert while other threads
+// check snapshots that share the filter.
+class bloom_filter
+{
+public:
+	// Sized for 'keys' entries at about bits_per_key each, 10 bits gives
+	// a false positive rate of about 1%
+	bloom_filter(size_t keys, size_t bits_per_key = 10);
+	~bloom_filter();
+	bloom_filter(const bloom_filter&) = delete;
+	bloom_filter& operator=(const bloom_filter&) = delete;
+
+	void insert(uint64_t h);
+	bool may_contain(uint64_t h) const;
+
+	// Keys it was sized for, and keys inserted so far (repeats included).
+	// Past capacity the false positive rate climbs, so rebuild bigger.
+	size_t capacity() const { return m_capacity; }
+	size_t bits_per_key() const { return m_bits_per_key; }
+	size_t inserted() const { return m_inserted.load(std::memory_order_relaxed); }
+	bool full() const { return inserted() > m_capacity; }
+
+private:
+	// The block, and the bit to set in each of its words
+	size_t block(uint64_t h) const { return size_t(((h >> 32) * m_blocks) >> 32); }
+	static uint64_t mask(uint32_t h, size_t word);
+
+	size_t m_capacity;
+	size_t m_bits_per_key;
+	size_t m_blocks;
+	uint64_t* m_bits;  // m_blocks * 8 words, 64 byte aligned
+	std::atomic<size_t> m_inserted;
+};
@@ -1,7 +1,20 @@
 
 #pragma once
 
-#include "io.h"
+#include "bkeys.h"
+#include "stats.h"
+#include "reclaim.h"
+
+// The shape rules of bnode::update, shared with paged_merkle_cow so both
+// build the same tree (and root hash) from the same updates: the peer of
+// child i of size, how many entries a split keeps, and how many an erase
+// steals from its peer (up to max_steal, half the difference, at least 1)
+constexpr size_t bnode_peer(size_t i, size_t size) { return i == size - 1 ? i - 1 : i + 1; }
+constexpr size_t bnode_split_keep(size_t size) { return size / 2; }
+constexpr size_t bnode_steal_count(size_t max_steal, size_t size, size_t peer_size)
+{
+	return (peer_size - size) / 2 < 1 ? 1 : ((peer_size - size) / 2 < max_steal ? (peer_size - size) / 2 : max_steal);
+}
 
 template<class Policy>
 class bnode 
@@ -9,8 +22,12 @@ class bnode
 public:
 	const static size_t min_size = Policy::min_size;
 	const static size_t max_size = Policy::max_size;
+	static_assert(max_size + 1 >= 2 * min_size, "Nodes must be able to split evenly");
+	static_assert(Policy::max_steal >= 1, "Erases steal at least one entry");
 	typedef typename Policy::key_t key_t;
 	typedef typename Policy::value_t value_t;
+	typedef typename Policy::keys_t keys_t;
+	typedef typename keys_t::key_ret key_ret;
 	typedef shared_ptr<const bnode> ptr_t;
 	typedef shared_ptr<bnode> wptr_t;
 
@@ -18,62 +35,82 @@ public:
 	bnode(const key_t& k, const value_t& v)
 		: m_size(1)
 	{
-		recompute_total();
-		m_keys[0] = k;
+		STAT_INC(stat_node_alloc);
+		m_keys.set(0, k, 1);
 		m_vals[0] = v;
+		mark_changed();
 	}
 
 	// Make a new root node based on two nodes (which must be identical height)
 	bnode(const ptr_t& n1, const ptr_t& n2)
 		: m_size(2)
 	{
+		STAT_INC(stat_node_alloc);
 		assign(0, n1);
 		assign(1, n2);
-		recompute_total();
+		m_keys.compact(m_size);
+		mark_changed();
 	}
 	
+	// Children go through reclaim_retire, so dropping a big tree doesn't
+	// free it in one recursive cascade
+	~bnode()
+	{
+		for(ptr_t& p : m_ptrs)
+			if (p) reclaim_retire(std::move(p));
+	}
+
+	// Leaves write their keys (in the key storage's encoding) followed by
+	// their values, inner nodes write only their children
 	void serialize(writable& out, size_t height) const
 	{
 		uint8_t size = uint8_t(m_size);
 		out.write((const char*) &size, 1);
+		if (height == 0) {
+			m_keys.serialize(out, m_size);
+			for(size_t i = 0; i < m_size; i++)
+				Policy::serialize_value(out, m_vals[i]);
+			return;
+		}
 		for(size_t i = 0; i < m_size; i++)
-		{
-			if (height == 0) {
-				Policy::serialize(out, m_keys[i], m_vals[i]);
-				continue;
-			}
 			m_ptrs[i]->serialize(out, height - 1);
-		}
 	}
 
 	void deserialize(readable& in, size_t height)
 	{
 		uint8_t size;
-		in.read((char*) &size, 1);
-		for(size_t i = 0; i < m_size; i++)
-		{
-			if (height == 0) {
-				Policy::deserialize(in, m_keys[i], m_vals[i]);
-				continue;
+		read_exact(in, (char*) &size, 1);
+		if (size == 0 || size > max_size)
+			throw io_exception("Invalid node size");
+		m_size = size;
+		if (height == 0) {
+			m_keys.deserialize(in, m_size);
+			for(size_t i = 0; i < m_size; i++)
+				Policy::deserialize_value(in, m_vals[i]);
+		} else {
+			for(size_t i = 0; i < m_size; i++)
+			{
+				wptr_t ptr = make_node<bnode>(0);
+				ptr->deserialize(in, height - 1);
+				assign(i, ptr);
 			}
-			wptr_t ptr = make_shared<bnode>(m_size);
-			ptr->deserialize(in, height - 1);
-			m_keys[i] = ptr->m_keys[0];
-			m_vals[i] = ptr->m_total;
-			m_ptrs[i] = ptr;
+			m_keys.compact(m_size);
 		}
-		recompute_total();
+		mark_changed();
 	}
 
 	// Return a writable version of this node
 	wptr_t copy() const
 	{
 		// Make a copy of a node	
-		wptr_t copy = make_shared<bnode>(m_size);
+		STAT_INC(stat_node_copy);
+		wptr_t copy = make_node<bnode>(m_size);
 		copy->m_total = m_total;
+		copy->m_dirty = m_dirty;
+		copy->m_count = m_count;
+		copy->m_keys = m_keys;
 		for(size_t i = 0; i < m_size; i++)
 		{
-			copy->m_keys[i] = m_keys[i];
 			copy->m_vals[i] = m_vals[i];
 			copy->m_ptrs[i] = m_ptrs[i];
 		}
@@ -82,6 +119,15 @@ public:
 		return copy;
 	}
 
+	// A writable version of p.  That's p itself if in_place and nothing
+	// else holds it, since no snapshot can see the change, else a copy.
+	static wptr_t own(const ptr_t& p, bool in_place)
+	{
+		if (in_place && p.use_count() == 1)
+			return std::const_pointer_cast<bnode>(p);
+		return p->copy();
+	}
+
 	// What happened during the update
 	enum update_result 
 	{
@@ -97,7 +143,7 @@ public:
 	};
 
 	template<class Updater> 
-	update_result update(const key_t& k, ptr_t& peer, wptr_t& split, const Updater& updater, int height)
+	update_result update(const key_t& k, ptr_t& peer, wptr_t& split, const Updater& updater, int height, bool in_place)
 	{
 		if (height == 0)
 		{
@@ -126,7 +172,7 @@ public:
 				// Erase case, remove element
 				erase(i);
 				// Run fixup
-				return erase_fixup(peer, height);
+				return erase_fixup(peer, height, in_place);
 			}
 			else if (!did_exist && exists)
 			{
@@ -139,22 +185,22 @@ public:
 			else 
 			{
 				// Modify case
-				m_vals[i] = v; 
-				recompute_total();
+				m_vals[i] = std::move(v); 
+				mark_changed();
 				return ur_modify;
 			}
 		}
 		// Find the child node the update goes to
 		size_t i = find_by_key(k);  
 		// Find a peer, try next node over
-		size_t pi = (i == m_size-1 ? i - 1 : i+1);
+		size_t pi = bnode_peer(i, m_size);
 
 		// Prepare node and it's peer for modification
-		wptr_t new_node = m_ptrs[i]->copy();
+		wptr_t new_node = own(m_ptrs[i], in_place);
 		wptr_t overflow;
 
 		// Run the recursive update 
-		update_result r = new_node->update(k, m_ptrs[pi], overflow, updater, height - 1);
+		update_result r = new_node->update(k, m_ptrs[pi], overflow, updater, height - 1, in_place);
 		if (r == ur_nop)
 		{
 			// Nothing happened, undo everything
@@ -164,7 +210,7 @@ public:
 		{
 			// Easy case, keep new node, peer is untouched
 			assign(i, new_node);
-			recompute_total();  // Recompute self
+			touch(m_count + (r == ur_insert) - (r == ur_erase));
 			return r;  // Send status up
 		}
 		if (r == ur_split)
@@ -179,50 +225,307 @@ public:
 			return split ? ur_split : ur_insert;
 		}
 		// We modified peer, update info
-		m_keys[pi] = m_ptrs[pi]->m_keys[0];
+		m_keys.set(pi, m_ptrs[pi]->key(0), m_size);
 		m_vals[pi] = m_ptrs[pi]->m_total;
 		if (r == ur_steal)
 		{
-			// Keep new node
+			// Keep new node, the entry moved within my subtree
 			assign(i, new_node);
-			recompute_total();  // Recompute self
+			touch(m_count - 1);
 			return ur_erase;  // Send up status
 		}
 		// r == ur_merge
 		// Keep only peer (main down ptr is deleted)
 		erase(i);  // Delete erased down ptr
-		return erase_fixup(peer, height);  // Do an erase fixup
+		return erase_fixup(peer, height, in_place);  // Do an erase fixup
+	}
+
+	// Join two trees of the given heights (as in btree, 0 is empty) where
+	// every key in l is before every key in r.  Only the nodes along the
+	// seam are copied, everything else is shared.
+	static ptr_t join(const ptr_t& l, size_t lh, const ptr_t& r, size_t rh, size_t& height)
+	{
+		if (lh == 0) { height = rh; return r; }
+		if (rh == 0) { height = lh; return l; }
+		ptr_t split;
+		ptr_t root = join_at(l, lh, r, rh, split);
+		height = max(lh, rh);
+		if (!split)
+			return root;
+		height++;
+		return make_node<bnode>(root, split);
+	}
+
+	// Split a tree into the keys before k and the keys at or after k
+	static void split(const ptr_t& n, size_t h, const key_t& k, ptr_t& l, size_t& lh, ptr_t& r, size_t& rh)
+	{
+		if (h == 0)
+		{
+			l = r = ptr_t();
+			lh = rh = 0;
+			return;
+		}
+		if (h == 1)
+		{
+			size_t i = n->lower_bound(k);
+			sub_tree(n, h, 0, i, l, lh);
+			sub_tree(n, h, i, n->m_size, r, rh);
+			return;
+		}
+		size_t c = n->find_by_key(k);
+		if (n->m_keys.compare(c, k) >= 0)
+		{
+			// Split falls between children, no need to go down
+			sub_tree(n, h, 0, c, l, lh);
+			sub_tree(n, h, c, n->m_size, r, rh);
+			return;
+		}
+		ptr_t before, after, cl, cr;
+		size_t bh, ah, clh, crh;
+		split(n->m_ptrs[c], h - 1, k, cl, clh, cr, crh);
+		sub_tree(n, h, 0, c, before, bh);
+		sub_tree(n, h, c + 1, n->m_size, after, ah);
+		l = join(before, bh, cl, clh, lh);
+		r = join(cr, crh, after, ah, rh);
+	}
+
+	// Combine two trees, see btree::merge for the meaning of the flags.
+	// The taller tree's root is taken apart, the other tree is split at
+	// each of its children's boundaries, and the pieces are merged pairwise.
+	// Pointer identical subtrees are resolved without being visited.
+	template<class Resolver>
+	static void merge(const ptr_t& a, size_t ah, const ptr_t& b, size_t bh, 
+		bool keep_a, bool keep_b, bool keep_same, const Resolver& resolver,
+		ptr_t& out, size_t& height)
+	{
+		out = ptr_t();
+		height = 0;
+		if (ah == 0 || bh == 0)
+		{
+			if (ah != 0 && keep_a) { out = a; height = ah; }
+			if (bh != 0 && keep_b) { out = b; height = bh; }
+			return;
+		}
+		if (a == b && ah == bh)
+		{
+			if (keep_same) { out = a; height = ah; }
+			return;
+		}
+		if (ah == 1 && bh == 1)
+		{
+			merge_leaves(*a, *b, keep_a, keep_b, resolver, out, height);
+			return;
+		}
+		// Take apart the taller tree
+		bool split_a = (ah >= bh);
+		const ptr_t& n = split_a ? a : b;
+		size_t nh = split_a ? ah : bh;
+		ptr_t rest = split_a ? b : a;
+		size_t rest_h = split_a ? bh : ah;
+		for(size_t i = 0; i < n->m_size; i++)
+		{
+			// Get the part of the other tree that lines up with child i
+			ptr_t piece = rest;
+			size_t piece_h = rest_h;
+			if (i + 1 < n->m_size)
+			{
+				ptr_t next;
+				size_t next_h;
+				split(rest, rest_h, n->key(i + 1), piece, piece_h, next, next_h);
+				rest = next;
+				rest_h = next_h;
+			}
+			ptr_t r;
+			size_t rh;
+			if (split_a)
+				merge(n->m_ptrs[i], nh - 1, piece, piece_h, keep_a, keep_b, keep_same, resolver, r, rh);
+			else
+				merge(piece, piece_h, n->m_ptrs[i], nh - 1, keep_a, keep_b, keep_same, resolver, r, rh);
+			out = join(out, height, r, rh, height);
+		}
+	}
+
+	// Build a tree from sorted entries, nodes are filled evenly
+	static void build(vector<pair<key_t, value_t>>& entries, ptr_t& out, size_t& height)
+	{
+		out = ptr_t();
+		height = 0;
+		if (entries.empty())
+			return;
+		vector<ptr_t> level;
+		size_t n = entries.size();
+		size_t nodes = (n + max_size - 1) / max_size;
+		for(size_t i = 0, pos = 0; i < nodes; i++)
+		{
+			size_t end = n * (i + 1) / nodes;
+			wptr_t leaf = make_node<bnode>(end - pos);
+			for(size_t j = 0; pos < end; j++, pos++)
+			{
+				leaf->m_keys.set(j, entries[pos].first, j + 1);
+				leaf->m_vals[j] = std::move(entries[pos].second);
+			}
+			leaf->m_keys.compact(leaf->m_size);
+			leaf->mark_changed();
+			level.push_back(leaf);
+		}
+		height = 1;
+		while(level.size() > 1)
+		{
+			vector<ptr_t> up;
+			n = level.size();
+			nodes = (n + max_size - 1) / max_size;
+			for(size_t i = 0, pos = 0; i < nodes; i++)
+			{
+				size_t end = n * (i + 1) / nodes;
+				wptr_t inner = make_node<bnode>(end - pos);
+				for(size_t j = 0; pos < end; j++, pos++)
+					inner->assign(j, level[pos]);
+				inner->m_keys.compact(inner->m_size);
+				inner->mark_changed();
+				up.push_back(inner);
+			}
+			level.swap(up);
+			height++;
+		}
+		out = level[0];
 	}
 
 public:
 	size_t size() const { return m_size; }
-	const key_t& key(size_t i) const { return m_keys[i]; }
+	// Number of leaf entries at or below this node
+	size_t count() const { return m_count; }
+	key_ret key(size_t i) const { return m_keys.get(i); }
 	const value_t& val(size_t i) const { return m_vals[i]; }
-	const value_t& total() const { return m_total; }
+	// Totals are computed lazily, so a batch of updates hashes each changed
+	// node once.  A node's total is stale only if some node below it is.
+	const value_t& total() const 
+	{
+		if (m_dirty) {
+			size_t budget = SIZE_MAX;
+			rehash(budget);
+		}
+		return m_total;
+	}
+	bool dirty() const { return m_dirty; }
+
+	// Recompute stale totals at or below this node, children before
+	// parents, computing at most 'budget' of them.  Returns true once this
+	// node's total is current, otherwise calling again resumes.  This writes
+	// cached values inside shared nodes, so don't let two threads rehash
+	// (or call total() on) the same dirty nodes at once.
+	bool rehash(size_t& budget) const
+	{
+		if (!m_dirty)
+			return true;
+		bool leaf = !m_ptrs[0];
+		if (!leaf) {
+			for(size_t i = 0; i < m_size; i++) {
+				if (m_ptrs[i]->m_dirty && !m_ptrs[i]->rehash(budget))
+					return false;
+			}
+		}
+		if (budget == 0)
+			return false;
+		budget--;
+		STAT_INC(stat_node_hash);
+		STAT_TIMER(timer_node_hash);
+		// Only cached copies of child totals (and lazily finished leaf
+		// values) change, not the node's contents
+		bnode* self = const_cast<bnode*>(this);
+		if (leaf) {
+			prepare_leaves<Policy>(*self, 0);
+		} else {
+			for(size_t i = 0; i < m_size; i++)
+				self->m_vals[i] = m_ptrs[i]->m_total;
+		}
+		self->m_total = Policy::compute_total(&m_vals[0], m_size);
+		self->m_dirty = false;
+		return true;
+	}
 	const ptr_t& ptr(size_t i) const { return m_ptrs[i]; } 
 
-	size_t lower_bound(const key_t& k) const 
-	{ return std::lower_bound(m_keys, m_keys + m_size, k, 
-		[this](const key_t& a, const key_t& b) -> bool { return Policy::less(a, b); }) - m_keys; }
-	size_t upper_bound(const key_t& k) const 
-	{ return std::upper_bound(m_keys, m_keys + m_size, k,
-		[this](const key_t& a, const key_t& b) -> bool { return Policy::less(a, b); }) - m_keys; }
-	size_t find(const key_t& k) const
+	// Start loading what a search of this node reads, the header and keys,
+	// and the child pointers of inner nodes
+	void prefetch(bool inner) const
+	{
+		prefetch_range(this, &m_keys + 1);
+		if (inner)
+			prefetch_range(m_ptrs, m_ptrs + max_size + 1);
+	}
+
+	// Count this node and everything below it, see mem_tracker
+	void account(mem_tracker& t, size_t height) const
+	{
+		mem_usage own;
+		own.nodes = 1;
+		own.node_bytes = sizeof(bnode);
+		own.control_bytes = mem_tracker::k_control_bytes;
+		if (height == 0) {
+			own.key_bytes = m_keys.key_bytes(m_size);
+			for(size_t i = 0; i < m_size; i++)
+				own.value_bytes += mem_tracker::payload(m_vals[i]);
+		}
+		if (!t.visit(this, own))
+			return;
+		m_keys.account(t, m_size);
+		for(size_t i = 0; i < m_size; i++) {
+			t.account(m_vals[i]);
+			if (height != 0)
+				m_ptrs[i]->account(t, height - 1);
+		}
+	}
+
+	// Searches take a key_t or anything else the key storage can compare
+	template<class K>
+	size_t lower_bound(const K& k) const { return m_keys.lower_bound(k, m_size); }
+	template<class K>
+	size_t upper_bound(const K& k) const { return m_keys.upper_bound(k, m_size); }
+	template<class K>
+	size_t find(const K& k) const
 	{
 		size_t i = lower_bound(k);
-		if (i != m_size && !Policy::less(k, m_keys[i])) return i;
+		if (i != m_size && m_keys.compare(i, k) == 0) return i;
 		return m_size;
 	}
+	// Key i against k, without making a key_t: negative, 0 or positive
+	template<class K>
+	int compare_key(size_t i, const K& k) const { return m_keys.compare(i, k); }
 
 	// Constructor for an empty bnode
 	// Used during deserialization
 	bnode(size_t size) 
-		: m_size(size)
-	{}
+		: m_dirty(true)
+		, m_size(size)
+	{
+		STAT_INC(stat_node_alloc);
+	}
 
 private:
+	// A policy may store leaf values unfinished and complete them just
+	// before a total needs them, by defining leaf_pending(v) and
+	// prepare_leaf(k, v).  Policies without them skip this.
+	template<class P>
+	static auto prepare_leaves(bnode& n, int) -> decltype(P::prepare_leaf(std::declval<key_t>(), std::declval<value_t&>()), void())
+	{
+		for(size_t i = 0; i < n.m_size; i++) {
+			if (P::leaf_pending(n.m_vals[i]))
+				P::prepare_leaf(n.m_keys.get(i), n.m_vals[i]);
+		}
+	}
+	template<class P>
+	static void prepare_leaves(bnode&, long) {}
+
+	// Up to 16 cache lines, more than a binary search of any node touches
+	static void prefetch_range(const void* begin, const void* end)
+	{
+		const char* p = (const char*) begin;
+		const char* e = min((const char*) end, p + 16 * 64);
+		for(; p < e; p += 64)
+			__builtin_prefetch(p);
+	}
+
 	// Find the entry for a key
-	size_t find_by_key(const key_t& k)
+	size_t find_by_key(const key_t& k) const
 	{
 		size_t i = upper_bound(k);
 		if (i != 0) i--;
@@ -230,53 +533,118 @@ private:
 	}
 
 	void assign(size_t i, const ptr_t& newval) { 
-		m_keys[i] = newval->m_keys[0];
+		m_keys.set(i, newval->key(0), m_size);
 		m_vals[i] = newval->m_total;
 		m_ptrs[i] = newval;
 	}
 
-	void copy_entry(size_t i, size_t j)
+	// Move 'count' entries from src to dst within this node, ranges may overlap
+	void move_entries(size_t dst, size_t src, size_t count)
 	{
-		m_keys[i] = m_keys[j];
-		m_vals[i] = m_vals[j];
-		m_ptrs[i] = m_ptrs[j];
+		m_keys.move(dst, src, count);
+		if (dst < src) {
+			std::move(m_vals + src, m_vals + src + count, m_vals + dst);
+			std::move(m_ptrs + src, m_ptrs + src + count, m_ptrs + dst);
+		} else {
+			std::move_backward(m_vals + src, m_vals + src + count, m_vals + dst + count);
+			std::move_backward(m_ptrs + src, m_ptrs + src + count, m_ptrs + dst + count);
+		}
 	}
 
-	void insert(const key_t& k, const value_t& v, const ptr_t& down)
+	// Move 'count' entries from another node into this one at dst, m_size
+	// must already include them.  The entries are left moved from in other.
+	void take_entries(size_t dst, bnode& other, size_t src, size_t count)
 	{
-		int loc = (int) lower_bound(k);
-		for(int i = m_size; i > loc; i--)
-			copy_entry(i, i-1);
-		m_keys[loc] = k;
-		m_vals[loc] = v;
-		m_ptrs[loc] = down;
-		m_size++;
+		m_keys.transfer(dst, other.m_keys, src, count, m_size);
+		std::move(other.m_vals + src, other.m_vals + src + count, m_vals + dst);
+		std::move(other.m_ptrs + src, other.m_ptrs + src + count, m_ptrs + dst);
 	}
-	
-	void insert(const ptr_t& down)
+
+	// Same as take_entries, but leaves other untouched
+	void copy_entries(size_t dst, const bnode& other, size_t src, size_t count)
 	{
-		insert(down->m_keys[0], down->m_total, down);
+		m_keys.copy(dst, other.m_keys, src, count, m_size);
+		std::copy(other.m_vals + src, other.m_vals + src + count, m_vals + dst);
+		std::copy(other.m_ptrs + src, other.m_ptrs + src + count, m_ptrs + dst);
 	}
 
-	void erase(size_t begin, size_t end)
+	// Move the last 'count' entries of left to the front of right
+	static void shift_right(bnode& left, bnode& right, size_t count)
+	{
+		right.move_entries(count, 0, right.m_size);
+		right.m_size += count;
+		right.take_entries(0, left, left.m_size - count, count);
+		left.clear_entries(left.m_size - count, left.m_size);
+		left.m_size -= count;
+		left.m_keys.compact(left.m_size);
+		right.m_keys.compact(right.m_size);
+	}
+
+	// Move the first 'count' entries of right to the end of left
+	static void shift_left(bnode& left, bnode& right, size_t count)
 	{
-		int diff = end - begin;
-		for(int i = begin; i + diff < (int) m_size; i++)
-			copy_entry(i, i+diff);
-		for(int i = m_size - diff; i < (int) m_size; i++)
+		left.m_size += count;
+		left.take_entries(left.m_size - count, right, 0, count);
+		right.erase(0, count);
+		left.m_keys.compact(left.m_size);
+	}
+
+	// Reset entries that are no longer in use
+	void clear_entries(size_t begin, size_t end)
+	{
+		for(size_t i = begin; i < end; i++)
 		{
-			m_keys[i] = key_t();
+			m_keys.clear(i);
 			m_vals[i] = value_t();
 			m_ptrs[i] = ptr_t();
 		}
-			
+	}
+
+	void insert(const key_t& k, value_t v, ptr_t down)
+	{
+		size_t loc = lower_bound(k);
+		move_entries(loc + 1, loc, m_size - loc);
+		m_size++;
+		m_keys.set(loc, k, m_size);
+		m_vals[loc] = std::move(v);
+		m_ptrs[loc] = std::move(down);
+	}
+	
+	void insert(const ptr_t& down)
+	{
+		insert(down->key(0), down->m_total, down);
+	}
+
+	void erase(size_t begin, size_t end)
+	{
+		size_t diff = end - begin;
+		move_entries(begin, end, m_size - end);
+		clear_entries(m_size - diff, m_size);
 		m_size -= diff;
+		m_keys.compact(m_size);
 	}
 	void erase(size_t loc) { erase(loc, loc+1); }
 
-	void recompute_total() 
+	// Recount entries and leave the total to be recomputed on demand.
+	// Leaves hold no pointers and count their own entries, inner nodes add
+	// up their children's counts.
+	void mark_changed() 
+	{
+		size_t count = m_size;
+		if (m_size && m_ptrs[0]) {
+			count = 0;
+			for(size_t i = 0; i < m_size; i++)
+				count += m_ptrs[i]->m_count;
+		}
+		touch(count);
+	}
+
+	// mark_changed when the caller knows the new count, so updates that
+	// don't change the shape needn't read every child
+	void touch(size_t count)
 	{
-		m_total = Policy::compute_total(&m_vals[0], m_size);
+		m_dirty = true;
+		m_count = count;
 	}
 
 	wptr_t maybe_split()
@@ -284,46 +652,38 @@ private:
 		// If the node isn't too big, and fix up total
 		if (m_size <= max_size)
 		{
-			recompute_total();
+			mark_changed();
 			return NULL;
 		}
 
-		// Compute the size of half (rounded dVown) to keep
-		int keep_size = m_size / 2;
+		STAT_INC(stat_split);
+		// Compute the size of half (rounded down) to keep
+		size_t keep_size = bnode_split_keep(m_size);
 
 		// Create a new bnode with the same height as me
-		wptr_t r = make_shared<bnode>(m_size - keep_size);
+		wptr_t r = make_node<bnode>(m_size - keep_size);
 
-		// Copy second of the entries into the new node
-		for(size_t i = 0; i < m_size - keep_size; i++)
-		{
-			r->m_keys[i] = m_keys[i + keep_size];
-			r->m_vals[i] = m_vals[i + keep_size];
-			r->m_ptrs[i] = m_ptrs[i + keep_size];
-		}
-		// Erase them from me
-		for(size_t i = keep_size; i < m_size; i++)
-		{
-			m_keys[i] = key_t();
-			m_vals[i] = value_t();
-			m_ptrs[i] = ptr_t();
-		}
-	
+		// Move second half of the entries into the new node
+		r->take_entries(0, *this, keep_size, r->m_size);
+		clear_entries(keep_size, m_size);
 		m_size = keep_size;
+		// Each half may now share a longer prefix
+		m_keys.compact(m_size);
+		r->m_keys.compact(r->m_size);
 
-		recompute_total();
-		r->recompute_total();
+		mark_changed();
+		r->mark_changed();
 		// Return new node
 		return r;
 	}
 
-	update_result erase_fixup(ptr_t& peer_ptr, int height)
+	update_result erase_fixup(ptr_t& peer_ptr, int height, bool in_place)
 	{
 		// If we still have a valid number of nodes, we're done
 		if (m_size >= min_size)
 		{
 			// Still need to fix total
-			recompute_total();
+			mark_changed();
 			// Return easy case
 			return ur_erase; 
 		}	
@@ -335,50 +695,173 @@ private:
 			if (m_size == 0)
 				return ur_empty; 
 			// No more recursion, compute totals
-			recompute_total();
+			mark_changed();
 			// Figure out which enum to return
 			if (height != 0 && size() == 1)
 				return ur_singular; // Down to 1 entry at top of tree
 			return ur_erase;
 		}
 		// We are going to modify peer, let's copy first
-		wptr_t peer = peer_ptr->copy();
+		wptr_t peer = own(peer_ptr, in_place);
+		bool peer_first = Policy::less(peer->key(0), key(0));
 		// Now we try to steal from peer
 		if (peer->m_size > min_size)
 		{
-			// Get the appropriate peer entry
-			size_t pi = (Policy::less(peer->m_keys[0], m_keys[0])) 
-					? peer->size() - 1 // Last of peer before me
-					: 0 // First of peer after me
-					;
-
-			// 'Move' the entry over
-			insert(peer->m_keys[pi], peer->m_vals[pi], peer->m_ptrs[pi]);
-			peer->erase(pi);
+			// Steal up to Policy::max_steal entries to even us out, so the
+			// next few erases don't need to steal again.  This changes the
+			// shape of the tree (and so any hashes), 1 is the classic steal.
+			size_t count = bnode_steal_count(Policy::max_steal, m_size, peer->m_size);
+			STAT_INC(stat_steal);
+			if (peer_first)
+				shift_right(*peer, *this, count);  // Take the end of peer
+			else
+				shift_left(*this, *peer, count);  // Take the start of peer
 			// Recompute self and peer's totals
-			recompute_total();
-			peer->recompute_total();
+			mark_changed();
+			peer->mark_changed();
 			// Set output
 			peer_ptr = peer;
 			// Return my state
 			return ur_steal;
 		}
 		// Looks like we need to merge with peer
-		// Add my entries into it, and recompute total
-		// TODO: Make this not slow!
-		for(size_t i = 0; i < m_size; i++)
-			peer->insert(m_keys[i], m_vals[i], m_ptrs[i]);
+		STAT_INC(stat_merge);
+		// Move all my entries into it in one block
+		if (peer_first)
+			shift_left(*peer, *this, m_size);
+		else
+			shift_right(*this, *peer, m_size);
 		// Fix peers total
-		peer->recompute_total();
+		peer->mark_changed();
 		// Set output
 		peer_ptr = peer;
 		// Return the fact that I merged
 		return ur_merge;
 	}
 
+	// Merge the entries of two leaves, see merge
+	template<class Resolver>
+	static void merge_leaves(const bnode& a, const bnode& b, bool keep_a, bool keep_b, 
+		const Resolver& resolver, ptr_t& out, size_t& height)
+	{
+		vector<pair<key_t, value_t>> entries;
+		size_t i = 0, j = 0;
+		while(i < a.m_size || j < b.m_size)
+		{
+			if (j == b.m_size || (i < a.m_size && Policy::less(a.key(i), b.key(j))))
+			{
+				if (keep_a) entries.emplace_back(a.key(i), a.m_vals[i]);
+				i++;
+			}
+			else if (i == a.m_size || Policy::less(b.key(j), a.key(i)))
+			{
+				if (keep_b) entries.emplace_back(b.key(j), b.m_vals[j]);
+				j++;
+			}
+			else
+			{
+				value_t v;
+				if (resolver(a.key(i), a.m_vals[i], b.m_vals[j], v))
+					entries.emplace_back(a.key(i), std::move(v));
+				i++;
+				j++;
+			}
+		}
+		build(entries, out, height);
+	}
+
+	// Join at the level where the shorter tree fits, splits propagate up
+	static ptr_t join_at(const ptr_t& l, size_t lh, const ptr_t& r, size_t rh, ptr_t& split)
+	{
+		if (lh == rh)
+			return join_siblings(l, r, split);
+		ptr_t over;
+		wptr_t n;
+		if (lh > rh)
+		{
+			// Add r along the right edge of l
+			n = l->copy();
+			size_t last = n->m_size - 1;
+			n->assign(last, join_at(n->m_ptrs[last], lh - 1, r, rh, over));
+		}
+		else
+		{
+			// Add l along the left edge of r
+			n = r->copy();
+			n->assign(0, join_at(l, lh, n->m_ptrs[0], rh - 1, over));
+		}
+		if (over)
+			n->insert(over);
+		split = n->maybe_split();
+		return n;
+	}
+
+	// Join two nodes of the same height, either may be an undersized root
+	static ptr_t join_siblings(const ptr_t& l, const ptr_t& r, ptr_t& split)
+	{
+		if (l->m_size >= min_size && r->m_size >= min_size)
+		{
+			// Both are fine as is
+			split = r;
+			return l;
+		}
+		wptr_t n = l->copy();
+		size_t total = l->m_size + r->m_size;
+		if (total <= max_size)
+		{
+			// Fits in a single node
+			n->m_size = total;
+			n->copy_entries(l->m_size, *r, 0, r->m_size);
+			n->m_keys.compact(n->m_size);
+			n->mark_changed();
+			return n;
+		}
+		// Even out the two nodes
+		wptr_t m = r->copy();
+		if (n->m_size < total / 2)
+			shift_left(*n, *m, total / 2 - n->m_size);
+		else
+			shift_right(*n, *m, n->m_size - total / 2);
+		n->mark_changed();
+		m->mark_changed();
+		split = m;
+		return n;
+	}
+
+	// Make a tree from the entries [begin, end) of a node at height h
+	static void sub_tree(const ptr_t& n, size_t h, size_t begin, size_t end, ptr_t& out, size_t& height)
+	{
+		if (begin == end)
+		{
+			out = ptr_t();
+			height = 0;
+		}
+		else if (begin == 0 && end == n->m_size)
+		{
+			out = n;
+			height = h;
+		}
+		else if (h > 1 && end - begin == 1)
+		{
+			out = n->m_ptrs[begin];
+			height = h - 1;
+		}
+		else
+		{
+			wptr_t r = make_node<bnode>(end - begin);
+			r->copy_entries(0, *n, begin, end - begin);
+			r->m_keys.compact(r->m_size);
+			r->mark_changed();
+			out = r;
+			height = h;
+		}
+	}
+
 	value_t m_total;  // Total of all down entries, cached
+	bool m_dirty;  // m_total (and child totals in m_vals) may be stale
+	size_t m_count;  // Number of leaf entries below me, cached
 	size_t m_size;
-	key_t m_keys[max_size + 1];  // All my keys
+	keys_t m_keys;  // All my keys
 	value_t m_vals[max_size + 1];  // All my values
 	ptr_t m_ptrs[max_size + 1];  // All my pointers
 };
@@ -18,9 +18,15 @@ public:
 		, m_size(0)
 	{}
 		
+	// Run updater on the entry for k.  Nodes are copied on write, unless
+	// in_place, where nodes held by nothing but this tree are changed
+	// directly.  So a run of in_place updates copies each shared node
+	// once, not once per update.
 	template<class Updater>
-	bool update(const key_t& k, const Updater& updater)
+	bool update(const key_t& k, const Updater& updater, bool in_place = false)
 	{
+		STAT_INC(stat_update);
+		STAT_TIMER(timer_update);
 		// If root is null, see if an insert works
 		if (m_height == 0) {
 			value_t v;
@@ -31,17 +37,17 @@ public:
 			if (!changed || !exists)
 				return false;
 			// Otherwise, create the initial node
-			m_root = make_shared<node_t>(k, v);
+			m_root = make_node<node_t>(k, v);
 			m_height++;
 			m_size++;
 			return true;
 		}
 
 		// Let's try running the update
-		wptr_t w_root = m_root->copy();
+		wptr_t w_root = node_t::own(m_root, in_place);
 		wptr_t overflow;
 		ptr_t peer;
-		auto r = w_root->update(k, peer, overflow, updater, m_height - 1);
+		auto r = w_root->update(k, peer, overflow, updater, m_height - 1, in_place);
 
 		if (r == node_t::ur_nop) {
 			// If nothing happend, return false
@@ -59,7 +65,7 @@ public:
 		else if (r == node_t::ur_split)
 		{
 			// Root just split, make new root
-			m_root = make_shared<node_t>(w_root, overflow);
+			m_root = make_node<node_t>(w_root, overflow);
 			m_height++;  
 			m_size++;
 		} 
@@ -80,20 +86,183 @@ public:
 		return true;    
 	}
 
+	// Split into the keys before k and the keys at or after k.  Runs in
+	// O(height), only nodes along the split path are copied.
+	pair<btree, btree> split_at(const key_t& k) const
+	{
+		ptr_t left, right;
+		size_t lh, rh;
+		node_t::split(m_root, m_height, k, left, lh, right, rh);
+		return pair<btree, btree>(btree(left, lh), btree(right, rh));
+	}
+
+	// Join two trees, every key in left must be before every key in right.
+	// Runs in O(height), only nodes along the seam are copied.
+	static btree join(const btree& left, const btree& right)
+	{
+		size_t height;
+		ptr_t root = node_t::join(left.m_root, left.m_height, right.m_root, right.m_height, height);
+		return btree(root, height);
+	}
+
+	// Combine two trees.  Keys only in a are kept if keep_a, keys only in b
+	// if keep_b.  For keys in both, resolver(k, va, vb, out) sets the value
+	// to keep, or returns false to drop the key.  Pointer identical subtrees
+	// are kept (or dropped if !keep_same) without calling the resolver, so
+	// it must keep the common value when both sides agree.
+	template<class Resolver>
+	static btree merge(const btree& a, const btree& b, bool keep_a, bool keep_b, bool keep_same, const Resolver& resolver)
+	{
+		ptr_t root;
+		size_t height;
+		node_t::merge(a.m_root, a.m_height, b.m_root, b.m_height, 
+			keep_a, keep_b, keep_same, resolver, root, height);
+		return btree(root, height);
+	}
+
+	// Keys in either tree
+	template<class Resolver>
+	static btree set_union(const btree& a, const btree& b, const Resolver& resolver)
+	{ return merge(a, b, true, true, true, resolver); }
+
+	// Keys in both trees
+	template<class Resolver>
+	static btree set_intersection(const btree& a, const btree& b, const Resolver& resolver)
+	{ return merge(a, b, false, false, true, resolver); }
+
+	// Keys in a but not in b
+	static btree set_difference(const btree& a, const btree& b)
+	{ return merge(a, b, true, false, false, 
+		[](const key_t&, const value_t&, const value_t&, value_t&) { return false; }); }
+
+	// Build a tree from entries sorted by key with no duplicates
+	static btree build(vector<pair<key_t, value_t>>& entries)
+	{
+		ptr_t root;
+		size_t height;
+		node_t::build(entries, root, height);
+		return btree(root, height);
+	}
+
+	// Erase every key in [lo, hi).  Subtrees entirely inside the range are
+	// dropped without being visited, only the two boundary paths are copied
+	// and rebalanced.  Returns the number of entries removed.
+	size_t erase_range(const key_t& lo, const key_t& hi)
+	{
+		if (m_height == 0 || !Policy::less(lo, hi))
+			return 0;
+		pair<btree, btree> outer = split_at(lo);
+		pair<btree, btree> inner = outer.second.split_at(hi);
+		if (inner.first.size() == 0)
+			return 0;
+		*this = join(outer.first, inner.second);
+		return inner.first.size();
+	}
+
+	// Find the value for a key without building an iterator, null if
+	// absent.  The pointer is good for as long as the current root lives.
+	template<class K>
+	const value_t* get(const K& k) const
+	{
+		if (m_height == 0)
+			return nullptr;
+		const node_t* n = m_root.get();
+		for(size_t h = m_height; h > 1; h--) {
+			size_t i = n->upper_bound(k);
+			if (i == 0)
+				return nullptr;  // Before the first key
+			n = n->ptr(i - 1).get();
+		}
+		size_t i = n->find(k);
+		return i == n->size() ? nullptr : &n->val(i);
+	}
+
+	// get() for count keys at once, into out.  The lookups go down the
+	// tree together a level at a time, and each one's next node is
+	// prefetched before any of them touch it, so the cache misses of a
+	// level overlap instead of being paid one after another.
+	template<class K>
+	void multi_get(const K* keys, size_t count, const value_t** out) const
+	{
+		const size_t group = 16;
+		const node_t* cur[group];
+		for(size_t base = 0; base < count; base += group) {
+			size_t n = min(group, count - base);
+			for(size_t i = 0; i < n; i++)
+				cur[i] = m_root.get();
+			for(size_t h = m_height; h > 1; h--) {
+				for(size_t i = 0; i < n; i++) {
+					if (!cur[i])
+						continue;
+					size_t j = cur[i]->upper_bound(keys[base + i]);
+					cur[i] = (j == 0 ? nullptr : cur[i]->ptr(j - 1).get());
+					if (cur[i])
+						cur[i]->prefetch(h > 2);
+				}
+			}
+			for(size_t i = 0; i < n; i++) {
+				size_t j = cur[i] ? cur[i]->find(keys[base + i]) : 0;
+				out[base + i] = (!cur[i] || j == cur[i]->size()) ? nullptr : &cur[i]->val(j);
+			}
+		}
+	}
+
+	// Node totals are computed lazily, the first call to the root's total()
+	// computes every stale one.  To spread that work out, call rehash with
+	// a budget of node totals to compute, stale nodes are visited deepest
+	// first and each is computed once.  Returns true once the root total is
+	// current, until then call again to resume.
+	bool rehash(size_t budget = SIZE_MAX) const
+	{
+		return m_height == 0 || m_root->rehash(budget);
+	}
+
 	size_t size() const { return m_size; }
 	size_t height() const { return m_height; }
 	ptr_t root() const { return m_root; }
 
-	void serialize(writable& out) {
-		// TODO: Serialize size
+	// For mem_tracker::add
+	void account(mem_tracker& t) const
+	{
+		if (m_height)
+			m_root->account(t, m_height - 1);
+	}
+
+	// Only reads the nodes, so it can write a copy while updates continue.
+	// Totals and lazily finished values must already be current, since
+	// computing them here would write into nodes the copy shares.
+	void serialize(writable& out) const {
+		assert(rehash(0));
 		uint8_t height = uint8_t(m_height);
 		out.write((const char *) &height, 1);
 		if (height) {
+			write_varint(out, m_size);
 			m_root->serialize(out, m_height - 1);
 		}
 	}
 
+	void deserialize(readable& in) {
+		uint8_t height;
+		read_exact(in, (char *) &height, 1);
+		if (height == 0) {
+			*this = btree();
+			return;
+		}
+		size_t size = read_varint(in);
+		wptr_t root = make_node<node_t>(0);
+		root->deserialize(in, height - 1);
+		m_root = root;
+		m_height = height;
+		m_size = size;
+	}
+
 private:
+	btree(const ptr_t& root, size_t height)
+		: m_root(root)
+		, m_height(height)
+		, m_size(height ? root->count() : 0)
+	{}
+
 	ptr_t m_root;
 	size_t m_height;
 	size_t m_size;
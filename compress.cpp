@@ -0,0 +1,536 @@
+
+#include "compress.h"
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+const static size_t k_chunk_header = 13;
+const static size_t k_index_entry = 12;
+const static size_t k_footer = 16;
+const static size_t k_max_chunk = 1 << 30;
+const static char k_magic[4] = { 'M', 'C', 'Z', '1' };
+
+#ifndef HAVE_LZ4
+// Built in LZ4 block format: a series of sequences, each a token of
+// literal length and match length nibbles, extra length bytes, literals,
+// and a 16 bit match offset.  The last sequence has literals only.
+const static size_t k_lz4_min_match = 4;
+const static size_t k_lz4_last_literals = 5;  // The last 5 bytes are always literals
+const static size_t k_lz4_match_limit = 12;  // No match starts in the last 12 bytes
+const static int k_lz4_hash_log = 12;
+
+static uint32_t read32(const char* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static void lz4_length(char*& op, size_t len)
+{
+	while(len >= 255) {
+		*op++ = char(255);
+		len -= 255;
+	}
+	*op++ = char(len);
+}
+
+// Emit one sequence, match_len 0 means the final literals only
+static bool lz4_sequence(char*& op, const char* oend, const char* lit, size_t lit_len, size_t offset, size_t match_len)
+{
+	size_t need = 1 + lit_len / 255 + 1 + lit_len + 2 + match_len / 255 + 1;
+	if (size_t(oend - op) < need)
+		return false;
+	char* token = op++;
+	*token = char(min(lit_len, size_t(15)) << 4);
+	if (lit_len >= 15)
+		lz4_length(op, lit_len - 15);
+	memcpy(op, lit, lit_len);
+	op += lit_len;
+	if (match_len == 0)
+		return true;
+	*op++ = char(offset);
+	*op++ = char(offset >> 8);
+	size_t ml = match_len - k_lz4_min_match;
+	*token |= char(min(ml, size_t(15)));
+	if (ml >= 15)
+		lz4_length(op, ml - 15);
+	return true;
+}
+
+static size_t lz4_compress(const char* src, size_t len, char* dst, size_t cap)
+{
+	uint32_t table[1 << k_lz4_hash_log] = {};  // Position + 1 of the last sighting
+	char* op = dst;
+	const char* oend = dst + cap;
+	size_t ip = 0, anchor = 0;
+	if (len > k_lz4_match_limit) {
+		size_t limit = len - k_lz4_match_limit;
+		size_t match_end = len - k_lz4_last_literals;
+		while(ip < limit) {
+			uint32_t seq = read32(src + ip);
+			uint32_t h = (seq * 2654435761u) >> (32 - k_lz4_hash_log);
+			size_t ref = table[h];
+			table[h] = uint32_t(ip + 1);
+			if (ref && ip - (ref - 1) <= 65535 && read32(src + ref - 1) == seq) {
+				ref--;
+				size_t m = k_lz4_min_match;
+				while(ip + m < match_end && src[ref + m] == src[ip + m])
+					m++;
+				if (!lz4_sequence(op, oend, src + anchor, ip - anchor, ip - ref, m))
+					return 0;
+				ip += m;
+				anchor = ip;
+			} else {
+				// Step faster through data that doesn't compress
+				ip += 1 + ((ip - anchor) >> 6);
+			}
+		}
+	}
+	if (!lz4_sequence(op, oend, src + anchor, len - anchor, 0, 0))
+		return 0;
+	return op - dst;
+}
+
+static bool lz4_length(const uint8_t*& ip, const uint8_t* iend, size_t& len)
+{
+	uint8_t b;
+	do {
+		if (ip == iend) return false;
+		b = *ip++;
+		len += b;
+	} while(b == 255);
+	return true;
+}
+
+static bool lz4_decompress(const char* src, size_t len, char* dst, size_t cap, size_t& out_len)
+{
+	const uint8_t* ip = (const uint8_t*) src;
+	const uint8_t* iend = ip + len;
+	size_t op = 0;
+	while(ip < iend) {
+		uint8_t token = *ip++;
+		size_t lit = token >> 4;
+		if (lit == 15 && !lz4_length(ip, iend, lit))
+			return false;
+		if (size_t(iend - ip) < lit || cap - op < lit)
+			return false;
+		memcpy(dst + op, ip, lit);
+		ip += lit;
+		op += lit;
+		if (ip == iend)
+			break;  // Final literals
+		if (iend - ip < 2)
+			return false;
+		size_t offset = ip[0] | (size_t(ip[1]) << 8);
+		ip += 2;
+		if (offset == 0 || offset > op)
+			return false;
+		size_t m = token & 15;
+		if (m == 15 && !lz4_length(ip, iend, m))
+			return false;
+		m += k_lz4_min_match;
+		if (cap - op < m)
+			return false;
+		// Matches may overlap their own output, so copy forward bytewise then
+		char* d = dst + op;
+		const char* s = d - offset;
+		if (offset >= m)
+			memcpy(d, s, m);
+		else
+			for(size_t i = 0; i < m; i++) d[i] = s[i];
+		op += m;
+	}
+	out_len = op;
+	return true;
+}
+#endif
+
+bool codec_available(compress_codec codec)
+{
+	switch(codec) {
+	case codec_none: return true;
+	case codec_lz4: return true;
+#ifdef HAVE_ZSTD
+	case codec_zstd: return true;
+#endif
+	default: return false;
+	}
+}
+
+// Returns the compressed size, or 0 if it didn't fit in cap
+static size_t compress_block(compress_codec codec, int level, const char* src, size_t len, char* dst, size_t cap)
+{
+	switch(codec) {
+	case codec_lz4:
+#ifdef HAVE_LZ4
+		return size_t(max(0, LZ4_compress_default(src, dst, int(len), int(cap))));
+#else
+		return lz4_compress(src, len, dst, cap);
+#endif
+#ifdef HAVE_ZSTD
+	case codec_zstd: {
+		size_t r = ZSTD_compress(dst, cap, src, len, level ? level : 3);
+		return ZSTD_isError(r) ? 0 : r;
+	}
+#endif
+	default:
+		return 0;
+	}
+}
+
+// Decompresses exactly raw_len bytes, throws if the data is bad
+static void decompress_block(compress_codec codec, const char* src, size_t len, char* dst, size_t raw_len)
+{
+	size_t out_len = 0;
+	bool ok = false;
+	switch(codec) {
+	case codec_none:
+		ok = (len == raw_len);
+		if (ok) memcpy(dst, src, len);
+		out_len = len;
+		break;
+	case codec_lz4: {
+#ifdef HAVE_LZ4
+		int r = LZ4_decompress_safe(src, dst, int(len), int(raw_len));
+		ok = r >= 0;
+		out_len = size_t(r);
+#else
+		ok = lz4_decompress(src, len, dst, raw_len, out_len);
+#endif
+		break;
+	}
+#ifdef HAVE_ZSTD
+	case codec_zstd: {
+		size_t r = ZSTD_decompress(dst, raw_len, src, len);
+		ok = !ZSTD_isError(r);
+		out_len = r;
+		break;
+	}
+#endif
+	default:
+		throw io_exception("Unknown compression codec");
+	}
+	if (!ok || out_len != raw_len)
+		throw io_exception("Corrupt compressed chunk");
+}
+
+// Check a chunk header, returns false for the end marker
+static bool parse_header(const char* header, uint32_t& raw_len, uint32_t& stored_len, compress_codec& codec)
+{
+	raw_len = get_u32(header);
+	stored_len = get_u32(header + 4);
+	codec = compress_codec(uint8_t(header[8]));
+	if (raw_len == 0 && stored_len == 0)
+		return false;
+	if (raw_len == 0 || raw_len > k_max_chunk || stored_len > k_max_chunk)
+		throw io_exception("Invalid chunk header");
+	return true;
+}
+
+// Unpack stored bytes into raw, checking the checksum
+static void unpack_chunk(const char* header, const vector<char>& stored, vector<char>& raw)
+{
+	uint32_t raw_len, stored_len;
+	compress_codec codec;
+	parse_header(header, raw_len, stored_len, codec);
+	if (crc32c(0, stored.data(), stored.size()) != get_u32(header + 9))
+		throw io_exception("Chunk checksum mismatch");
+	raw.resize(raw_len);
+	decompress_block(codec, stored.data(), stored.size(), raw.data(), raw_len);
+}
+
+compress_writer::compress_writer(writable& out, compress_codec codec, size_t chunk_size, int level)
+	: m_out(out)
+	, m_codec(codec)
+	, m_level(level)
+	, m_raw(chunk_size)
+	, m_used(0)
+	, m_packed(chunk_size)
+	, m_offset(0)
+	, m_closed(false)
+{
+	assert(chunk_size > 0 && chunk_size <= k_max_chunk);
+	if (!codec_available(codec))
+		throw io_exception("Compression codec not available");
+}
+
+compress_writer::~compress_writer()
+{
+	if (m_closed)
+		return;
+	try {
+		write_chunk();
+	} catch(const io_exception&) {}
+}
+
+void compress_writer::write(const char* buf, size_t len)
+{
+	assert(!m_closed);
+	while(len) {
+		size_t n = min(len, m_raw.size() - m_used);
+		memcpy(m_raw.data() + m_used, buf, n);
+		m_used += n;
+		buf += n;
+		len -= n;
+		if (m_used == m_raw.size())
+			write_chunk();
+	}
+}
+
+void compress_writer::write_chunk()
+{
+	if (m_used == 0)
+		return;
+	// Only keep the compressed form if it's smaller
+	size_t packed = compress_block(m_codec, m_level, m_raw.data(), m_used, m_packed.data(), m_used - 1);
+	compress_codec codec = packed ? m_codec : codec_none;
+	const char* stored = packed ? m_packed.data() : m_raw.data();
+	size_t stored_len = packed ? packed : m_used;
+	char header[k_chunk_header];
+	put_u32(header, uint32_t(m_used));
+	put_u32(header + 4, uint32_t(stored_len));
+	header[8] = char(codec);
+	put_u32(header + 9, crc32c(0, stored, stored_len));
+	m_out.write(header, sizeof(header));
+	m_out.write(stored, stored_len);
+	m_index.emplace_back(m_offset, uint32_t(m_used));
+	m_offset += sizeof(header) + stored_len;
+	m_used = 0;
+}
+
+void compress_writer::flush()
+{
+	write_chunk();
+	m_out.flush();
+}
+
+void compress_writer::close()
+{
+	if (m_closed)
+		return;
+	write_chunk();
+	// End marker, index, footer
+	vector<char> tail(k_chunk_header + m_index.size() * k_index_entry + k_footer, 0);
+	char* p = tail.data() + k_chunk_header;
+	for(const auto& e : m_index) {
+		put_u64(p, e.first);
+		put_u32(p + 8, e.second);
+		p += k_index_entry;
+	}
+	put_u64(p, m_offset + k_chunk_header);
+	put_u32(p + 8, uint32_t(m_index.size()));
+	memcpy(p + 12, k_magic, sizeof(k_magic));
+	m_out.write(tail.data(), tail.size());
+	m_closed = true;
+	m_out.close();
+}
+
+decompress_reader::decompress_reader(readable& in)
+	: m_in(in)
+	, m_pos(0)
+	, m_done(false)
+{}
+
+bool decompress_reader::next_chunk()
+{
+	if (m_done)
+		return false;
+	char header[k_chunk_header];
+	size_t r = m_in.read(header, sizeof(header));
+	uint32_t raw_len, stored_len;
+	compress_codec codec;
+	// End marker, a stream that was flushed but never closed, or one torn
+	// partway through its last header
+	if (r != sizeof(header) || !parse_header(header, raw_len, stored_len, codec)) {
+		m_done = true;
+		return false;
+	}
+	m_packed.resize(stored_len);
+	if (m_in.read(m_packed.data(), stored_len) != stored_len) {
+		// Torn partway through the last chunk, what came before it stands
+		m_done = true;
+		return false;
+	}
+	unpack_chunk(header, m_packed, m_raw);
+	m_pos = 0;
+	return true;
+}
+
+size_t decompress_reader::read(char* buf, size_t len)
+{
+	size_t tot_read = 0;
+	while(len) {
+		if (m_pos == m_raw.size() && !next_chunk())
+			break;
+		size_t n = min(len, m_raw.size() - m_pos);
+		memcpy(buf, m_raw.data() + m_pos, n);
+		m_pos += n;
+		tot_read += n;
+		buf += n;
+		len -= n;
+	}
+	return tot_read;
+}
+
+chunk_reader::chunk_reader(int fd, bool owned, size_t threads)
+	: m_fd(fd)
+	, m_owned(owned)
+	, m_size(0)
+	, m_cur(0)
+	, m_pos(0)
+	, m_window(max(size_t(1), 2 * threads))
+	, m_stop(false)
+{
+	// Find the index through the footer
+	struct stat st;
+	if (fstat(fd, &st) < 0 || size_t(st.st_size) < k_footer)
+		throw io_exception("Not a compressed file");
+	char footer[k_footer];
+	pread_exact(fd, footer, k_footer, st.st_size - k_footer);
+	if (memcmp(footer + 12, k_magic, sizeof(k_magic)) != 0)
+		throw io_exception("Not a compressed file");
+	uint64_t index_offset = get_u64(footer);
+	size_t count = get_u32(footer + 8);
+	if (index_offset + count * k_index_entry + k_footer != uint64_t(st.st_size))
+		throw io_exception("Invalid compressed file index");
+	vector<char> index(count * k_index_entry);
+	pread_exact(fd, index.data(), index.size(), index_offset);
+	for(size_t i = 0; i < count; i++) {
+		const char* e = index.data() + i * k_index_entry;
+		chunk c = { get_u64(e), m_size, get_u32(e + 8) };
+		m_chunks.push_back(c);
+		m_size += c.raw_len;
+	}
+	for(size_t i = 0; i < threads; i++)
+		m_threads.emplace_back([this]() { run(); });
+}
+
+chunk_reader::~chunk_reader()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_work.notify_all();
+	for(auto& t : m_threads)
+		t.join();
+	if (m_owned)
+		::close(m_fd);
+}
+
+void chunk_reader::load_chunk(size_t i, vector<char>& out) const
+{
+	const chunk& c = m_chunks[i];
+	char header[k_chunk_header];
+	pread_exact(m_fd, header, sizeof(header), c.offset);
+	if (get_u32(header) != c.raw_len)
+		throw io_exception("Chunk does not match index");
+	vector<char> stored(get_u32(header + 4));
+	pread_exact(m_fd, stored.data(), stored.size(), c.offset + sizeof(header));
+	unpack_chunk(header, stored, out);
+}
+
+// Queue the chunks in the read ahead window, called with the lock held
+void chunk_reader::schedule()
+{
+	size_t end = min(m_cur + m_window, m_chunks.size());
+	bool added = false;
+	for(size_t i = m_cur; i < end; i++) {
+		if (m_slots.count(i)) continue;
+		slot& s = m_slots[i];
+		s.ready = false;
+		s.failed = false;
+		m_queue.push_back(i);
+		added = true;
+	}
+	if (added)
+		m_work.notify_all();
+}
+
+void chunk_reader::run()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while(true) {
+		while(!m_stop && m_queue.empty())
+			m_work.wait(lock);
+		if (m_stop)
+			return;
+		size_t i = m_queue.front();
+		m_queue.pop_front();
+		lock.unlock();
+		vector<char> data;
+		bool failed = false;
+		try {
+			load_chunk(i, data);
+		} catch(const io_exception&) {
+			failed = true;
+		}
+		lock.lock();
+		// The reader may have seeked away meanwhile
+		auto it = m_slots.find(i);
+		if (it != m_slots.end() && !it->second.ready) {
+			it->second.data.swap(data);
+			it->second.failed = failed;
+			it->second.ready = true;
+			m_done.notify_all();
+		}
+	}
+}
+
+size_t chunk_reader::read(char* buf, size_t len)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	size_t tot_read = 0;
+	while(len && m_cur < m_chunks.size()) {
+		if (m_threads.empty()) {
+			slot& s = m_slots[m_cur];
+			if (!s.ready) {
+				load_chunk(m_cur, s.data);
+				s.ready = true;
+			}
+		} else {
+			schedule();
+			while(!m_slots[m_cur].ready)
+				m_done.wait(lock);
+		}
+		slot& s = m_slots[m_cur];
+		if (s.failed)
+			throw io_exception("Corrupt compressed chunk");
+		size_t n = min(len, s.data.size() - m_pos);
+		memcpy(buf, s.data.data() + m_pos, n);
+		m_pos += n;
+		tot_read += n;
+		buf += n;
+		len -= n;
+		if (m_pos == s.data.size()) {
+			m_slots.erase(m_cur);
+			m_cur++;
+			m_pos = 0;
+		}
+	}
+	return tot_read;
+}
+
+void chunk_reader::seek(uint64_t pos)
+{
+	assert(pos <= m_size);
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_slots.clear();
+	m_queue.clear();
+	// First chunk that starts after pos, then back one
+	size_t i = std::upper_bound(m_chunks.begin(), m_chunks.end(), pos,
+		[](uint64_t p, const chunk& c) { return p < c.raw_offset; }) - m_chunks.begin();
+	if (pos == m_size) {
+		m_cur = m_chunks.size();
+		m_pos = 0;
+		return;
+	}
+	m_cur = i - 1;
+	m_pos = size_t(pos - m_chunks[m_cur].raw_offset);
+}
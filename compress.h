@@ -0,0 +1,114 @@
+#pragma once
+
+#include "io.h"
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+// Chunked compression for snapshots and journals.  A stream is a series of
+// independently compressed chunks, each with a small header:
+//   u32 raw length, u32 stored length, u8 codec, u32 CRC32C of stored bytes
+// then an end marker (a header of zero lengths), an index of u64 chunk
+// offset + u32 raw length per chunk, and a footer of u64 index offset,
+// u32 chunk count and the magic "MCZ1".  Chunks that don't shrink are
+// stored as is.  All integers are little endian.
+//
+// LZ4 uses liblz4 when built with HAVE_LZ4 and a built in implementation of
+// the same block format otherwise.  zstd needs HAVE_ZSTD and libzstd.
+enum compress_codec { codec_none = 0, codec_lz4 = 1, codec_zstd = 2 };
+
+// True if this build can compress and decompress with codec
+bool codec_available(compress_codec codec);
+
+// Compresses everything written into chunks on out.  flush() ends the
+// current chunk early so everything so far can be read back, close()
+// writes the index and closes out.
+class compress_writer : public writable
+{
+public:
+	compress_writer(writable& out, compress_codec codec = codec_lz4, size_t chunk_size = 256 * 1024, int level = 0);
+	// Writes out the current chunk if not closed, see writable
+	~compress_writer();
+	void write(const char* buf, size_t len);
+	void flush();
+	void close();
+
+private:
+	void write_chunk();
+
+	writable& m_out;
+	compress_codec m_codec;
+	int m_level;
+	vector<char> m_raw;
+	size_t m_used;  // Bytes in m_raw
+	vector<char> m_packed;  // Compression output, reused
+	uint64_t m_offset;  // Bytes written to m_out
+	vector<pair<uint64_t, uint32_t>> m_index;  // Chunk offset, raw length
+	bool m_closed;
+};
+
+// Reads a compressed stream front to back from any readable.  A stream cut
+// off in its last chunk (say a journal torn by a crash) ends quietly after
+// the chunks before it, like one that was flushed but never closed.
+class decompress_reader : public readable
+{
+public:
+	decompress_reader(readable& in);
+	size_t read(char* buf, size_t len);
+
+private:
+	bool next_chunk();
+
+	readable& m_in;
+	vector<char> m_raw;
+	size_t m_pos;  // Bytes of m_raw consumed
+	vector<char> m_packed;
+	bool m_done;
+};
+
+// Random access to a compressed file using its index.  Chunks ahead of the
+// read position are decompressed in parallel by 'threads' workers, 0 means
+// decompress on the reading thread.
+class chunk_reader : public readable
+{
+public:
+	chunk_reader(int fd, bool owned = true, size_t threads = 2);
+	~chunk_reader();
+	size_t read(char* buf, size_t len);
+
+	// Total uncompressed size, and move the read position
+	uint64_t size() const { return m_size; }
+	void seek(uint64_t pos);
+
+private:
+	struct chunk {
+		uint64_t offset;  // File offset of the chunk header
+		uint64_t raw_offset;  // Position of its first byte in the stream
+		uint32_t raw_len;
+	};
+	struct slot {
+		bool ready;
+		bool failed;
+		vector<char> data;
+	};
+	void load_chunk(size_t i, vector<char>& out) const;
+	void schedule();
+	void run();
+
+	int m_fd;
+	bool m_owned;
+	vector<chunk> m_chunks;
+	uint64_t m_size;
+	size_t m_cur;  // Chunk holding the read position
+	size_t m_pos;  // Offset within it
+	size_t m_window;  // Chunks to keep decompressing ahead
+
+	std::mutex m_mutex;
+	std::condition_variable m_work;
+	std::condition_variable m_done;
+	map<size_t, slot> m_slots;  // Chunks queued or decompressed
+	std::deque<size_t> m_queue;  // Chunks waiting for a worker
+	bool m_stop;
+	vector<std::thread> m_threads;
+};
@@ -1,78 +1,129 @@
-
 #include "crypto.h"
+#include "stats.h"
 
-#pragma clang diagnostic ignored "-Wdeprecated-declarations"
-#include <openssl/sha.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
-digest::digest()
+template<class Hash>
+basic_digest<Hash>::basic_digest()
 {
 	memset(m_digest, 0, 32);
 }
 
-digest::digest(const string& str)
+template<class Hash>
+basic_digest<Hash>::basic_digest(const string& str)
 {
-    SHA256_CTX sha256;
-    SHA256_Init(&sha256);
-    SHA256_Update(&sha256, str.data(), str.size());
-    SHA256_Final(m_digest, &sha256);
+	STAT_INC(stat_digest);
+	STAT_TIMER(timer_digest);
+	hash_piece piece = { str.data(), str.size() };
+	Hash::hash(&piece, 1, m_digest);
 }
 
-digest::digest(const digest& d1, const digest& d2)
+template<class Hash>
+basic_digest<Hash>::basic_digest(const basic_digest& d1, const basic_digest& d2)
 {
-    SHA256_CTX sha256;
-    SHA256_Init(&sha256);
-    SHA256_Update(&sha256, d1.m_digest, 32);
-    SHA256_Update(&sha256, d2.m_digest, 32);
-    SHA256_Final(m_digest, &sha256);
+	STAT_INC(stat_digest);
+	STAT_TIMER(timer_digest);
+	hash_piece pieces[2] = { { d1.m_digest, 32 }, { d2.m_digest, 32 } };
+	Hash::hash(pieces, 2, m_digest);
 }
 
-bool digest::operator<(const digest& rhs) const
+// Load the i'th 64 bit word so that integer order is byte order
+static inline uint64_t load_be(const uint8_t* p, size_t i)
 {
-	return memcmp(m_digest, rhs.m_digest, 32) < 0;
+	uint64_t v;
+	memcpy(&v, p + 8 * i, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	v = __builtin_bswap64(v);
+#endif
+	return v;
 }
 
-bool digest::operator==(const digest& rhs) const
+template<class Hash>
+bool basic_digest<Hash>::operator<(const basic_digest& rhs) const
 {
-	return memcmp(m_digest, rhs.m_digest, 32) == 0;
+	for(size_t i = 0; i < 4; i++) {
+		uint64_t a = load_be(m_digest, i);
+		uint64_t b = load_be(rhs.m_digest, i);
+		if (a != b)
+			return a < b;
+	}
+	return false;
 }
 
-uint32_t digest::first_diff(const digest& rhs) const
+template<class Hash>
+bool basic_digest<Hash>::operator==(const basic_digest& rhs) const
 {
-	// First find the byte that differs
-	for(uint32_t i = 0; i < 32; i++) {
-		if (m_digest[i] != rhs.m_digest[i]) {
-			// Find the first bit that differs
-			uint8_t x = m_digest[i];
-			uint8_t y = rhs.m_digest[i];
-			for(int32_t j = 0; j < 8; j++) {
-				uint32_t mask = ~((1 << (7-j)) - 1);
-				if ((x & mask) != (y & mask)) {
-					return (i*8) + j;
-				}
-			}	
-			// If the byte differed, no bits differing is impossible
-			assert(false);
-		}
+	// No early out, all four words in flight at once
+	uint64_t a[4], b[4];
+	memcpy(a, m_digest, 32);
+	memcpy(b, rhs.m_digest, 32);
+	return ((a[0] ^ b[0]) | (a[1] ^ b[1]) | (a[2] ^ b[2]) | (a[3] ^ b[3])) == 0;
+}
+
+template<class Hash>
+uint32_t basic_digest<Hash>::first_diff(const basic_digest& rhs) const
+{
+	for(uint32_t i = 0; i < 4; i++) {
+		uint64_t x = load_be(m_digest, i) ^ load_be(rhs.m_digest, i);
+		if (x)
+			return i * 64 + __builtin_clzll(x);
 	}
 	// Looks like a perfect match
 	return 32*8;
 }
 
-uint32_t digest::get_bit(uint32_t i) const
+template<class Hash>
+uint32_t basic_digest<Hash>::get_bit(uint32_t i) const
 {
 	assert(i < 32*8);
-	return (m_digest[i/8] & (1 << (7 - (i % 8)))) ? 1 : 0;
+	return (m_digest[i / 8] >> (7 - (i % 8))) & 1;
 }
 
-static char hex_digits[] = "0123456789ABCDEF";
-
-string digest::as_string() const
+// Writes 2 * len uppercase hex digits
+static void to_hex(const uint8_t* in, size_t len, char* out)
 {
-	string s;
-	for(size_t i = 0; i < 4; i++) {	
-		s += hex_digits[m_digest[i] / 16];
-		s += hex_digits[m_digest[i] % 16];
+	size_t i = 0;
+#ifdef __SSE2__
+	// Split 16 bytes into nibbles, map to ASCII, interleave high and low
+	const __m128i mask = _mm_set1_epi8(0x0f);
+	const __m128i nine = _mm_set1_epi8(9);
+	const __m128i zero = _mm_set1_epi8('0');
+	const __m128i gap = _mm_set1_epi8('A' - '0' - 10);
+	for(; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*) (in + i));
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+		__m128i lo = _mm_and_si128(v, mask);
+		hi = _mm_add_epi8(_mm_add_epi8(hi, zero), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), gap));
+		lo = _mm_add_epi8(_mm_add_epi8(lo, zero), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), gap));
+		_mm_storeu_si128((__m128i*) (out + 2 * i), _mm_unpacklo_epi8(hi, lo));
+		_mm_storeu_si128((__m128i*) (out + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+	}
+#endif
+	static const char digits[] = "0123456789ABCDEF";
+	for(; i < len; i++) {
+		out[2 * i] = digits[in[i] >> 4];
+		out[2 * i + 1] = digits[in[i] & 0xf];
 	}
-	return s;
 }
 
+template<class Hash>
+string basic_digest<Hash>::as_string() const
+{
+	char buf[8];
+	to_hex(m_digest, 4, buf);
+	return string(buf, sizeof(buf));
+}
+
+template<class Hash>
+string basic_digest<Hash>::as_hex() const
+{
+	char buf[64];
+	to_hex(m_digest, 32, buf);
+	return string(buf, sizeof(buf));
+}
+
+template class basic_digest<sha256_hash>;
+template class basic_digest<blake3_hash>;
+template class basic_digest<cheap_hash>;
@@ -2,26 +2,36 @@
 #pragma once
 
 #include "types.h"
+#include "hash.h"
 
-class digest : comparable<digest>
+// A 32 byte hash, made with the Hash policy from hash.h.  Digests of
+// different policies are different types, so they can't be mixed up.
+template<class Hash>
+class basic_digest : comparable<basic_digest<Hash>>
 {
 public:
+	typedef Hash hash_type;
 	// Make a 'zero' digest
-	digest();
+	basic_digest();
 	// Make a hash from a string
-	digest(const string& str);
+	basic_digest(const string& str);
 	// Makes a hash of the concatenation of two hashes
-	digest(const digest& d1, const digest& d2);
+	basic_digest(const basic_digest& d1, const basic_digest& d2);
 	// Compare hashes
-	bool operator<(const digest& rhs) const;
-	bool operator==(const digest& rhs) const;
+	bool operator<(const basic_digest& rhs) const;
+	bool operator==(const basic_digest& rhs) const;
 	// Find the first bit that differs between two hashed
-	uint32_t first_diff(const digest& rhs) const;
+	uint32_t first_diff(const basic_digest& rhs) const;
+	// The first 64 bits, already well mixed, for tables and filters
+	uint64_t hash64() const { uint64_t r; memcpy(&r, m_digest, sizeof(r)); return r; }
 	// Returns 0 or 1 based on the bit at position 'which'
 	uint32_t get_bit(uint32_t which) const;
-	// Pretty print
+	// Pretty print, the first few bytes in hex
 	string as_string() const;
+	// All of it in hex
+	string as_hex() const;
 private:
 	uint8_t m_digest[32];
 };
 
+typedef basic_digest<sha256_hash> digest;
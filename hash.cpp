@@ -0,0 +1,306 @@
+
+#include "hash.h"
+
+#pragma clang diagnostic ignored "-Wdeprecated-declarations"
+#include <openssl/sha.h>
+
+void sha256_hash::hash(const hash_piece* pieces, size_t count, void* out)
+{
+	SHA256_CTX ctx;
+	SHA256_Init(&ctx);
+	for(size_t i = 0; i < count; i++)
+		SHA256_Update(&ctx, pieces[i].data, pieces[i].size);
+	SHA256_Final((unsigned char*) out, &ctx);
+}
+
+// fast_hash's mixing in four differently seeded lanes, run over the
+// pieces 8 bytes at a time as if they were one string
+void cheap_hash::hash(const hash_piece* pieces, size_t count, void* out)
+{
+	uint64_t h[4];
+	for(size_t lane = 0; lane < 4; lane++)
+		h[lane] = (lane + 1) * 0x9e3779b97f4a7c15ull;
+	auto mix = [&](uint64_t v) {
+		for(size_t lane = 0; lane < 4; lane++) {
+			h[lane] = (h[lane] ^ v) * 0xff51afd7ed558ccdull;
+			h[lane] ^= h[lane] >> 32;
+		}
+	};
+	uint64_t word = 0;
+	size_t fill = 0, len = 0;
+	for(size_t i = 0; i < count; i++) {
+		const char* p = (const char*) pieces[i].data;
+		size_t left = pieces[i].size;
+		len += left;
+		while(left) {
+			if (fill == 0 && left >= sizeof(word)) {
+				uint64_t v;
+				memcpy(&v, p, sizeof(v));
+				mix(v);
+				p += sizeof(v);
+				left -= sizeof(v);
+				continue;
+			}
+			size_t n = min(left, sizeof(word) - fill);
+			memcpy((char*) &word + fill, p, n);
+			p += n;
+			left -= n;
+			fill += n;
+			if (fill == sizeof(word)) {
+				mix(word);
+				word = 0;
+				fill = 0;
+			}
+		}
+	}
+	mix(word ^ len * 0xc4ceb9fe1a85ec53ull);
+	for(size_t lane = 0; lane < 4; lane++)
+		h[lane] ^= h[lane] >> 29;
+	memcpy(out, h, sizeof(h));
+}
+
+// BLAKE3, following the reference implementation's structure.  The input
+// is split into 1KB chunks, each hashed in 64 byte blocks, and the chunk
+// chaining values are combined by a binary tree of parent nodes whose left
+// subtrees are always a power of two chunks.  Knowing the whole input up
+// front, subtrees are hashed recursively rather than with a CV stack.
+
+static const size_t k_block = 64;
+static const size_t k_chunk = 1024;
+static const uint32_t k_chunk_start = 1, k_chunk_end = 2, k_parent = 4, k_root = 8;
+static const uint32_t k_iv[8] = {
+	0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+	0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19,
+};
+// Message word order for each round, the permutation applied repeatedly
+static const uint8_t k_schedule[7][16] = {
+	{ 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+	{ 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+	{ 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+	{ 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+	{ 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+	{ 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+	{ 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 },
+};
+
+// Several independent compressions in one go, a lane each.  GCC and clang
+// turn four lanes into SSE2 or NEON, eight into AVX2 where the CPU has it.
+typedef uint32_t u32x4 __attribute__((vector_size(16)));
+#ifdef __x86_64__
+typedef uint32_t u32x8 __attribute__((vector_size(32)));
+// u32x8 only crosses function boundaries inside chunk_cv8, all inlined
+#pragma GCC diagnostic ignored "-Wpsabi"
+#endif
+
+static inline uint32_t load_le32(const uint8_t* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	return v;
+}
+
+static inline void store_le32(uint8_t* p, uint32_t v)
+{
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	v = __builtin_bswap32(v);
+#endif
+	memcpy(p, &v, sizeof(v));
+}
+
+// W is uint32_t, or u32x4 for four lanes
+template<class W>
+static inline __attribute__((always_inline)) W rotr(W x, int n) { return (x >> n) | (x << (32 - n)); }
+
+// Inlined so v's indexes are constants and it lives in registers
+template<class W>
+static inline __attribute__((always_inline)) void mix(W* v, size_t a, size_t b, size_t c, size_t d, W x, W y)
+{
+	v[a] = v[a] + v[b] + x;
+	v[d] = rotr(v[d] ^ v[a], 16);
+	v[c] = v[c] + v[d];
+	v[b] = rotr(v[b] ^ v[c], 12);
+	v[a] = v[a] + v[b] + y;
+	v[d] = rotr(v[d] ^ v[a], 8);
+	v[c] = v[c] + v[d];
+	v[b] = rotr(v[b] ^ v[c], 7);
+}
+
+// Compress one block into the chaining value cv
+template<class W>
+static inline __attribute__((always_inline)) void compress(W* cv, const W* block, W counter_lo, W counter_hi, W block_len, W flags)
+{
+	W v[16] = {
+		cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+		W() + k_iv[0], W() + k_iv[1], W() + k_iv[2], W() + k_iv[3],
+		counter_lo, counter_hi, block_len, flags,
+	};
+	for(size_t round = 0; round < 7; round++) {
+		const uint8_t* s = k_schedule[round];
+		mix(v, 0, 4, 8, 12, block[s[0]], block[s[1]]);
+		mix(v, 1, 5, 9, 13, block[s[2]], block[s[3]]);
+		mix(v, 2, 6, 10, 14, block[s[4]], block[s[5]]);
+		mix(v, 3, 7, 11, 15, block[s[6]], block[s[7]]);
+		mix(v, 0, 5, 10, 15, block[s[8]], block[s[9]]);
+		mix(v, 1, 6, 11, 12, block[s[10]], block[s[11]]);
+		mix(v, 2, 7, 8, 13, block[s[12]], block[s[13]]);
+		mix(v, 3, 4, 9, 14, block[s[14]], block[s[15]]);
+	}
+	for(size_t i = 0; i < 8; i++)
+		cv[i] = v[i] ^ v[i + 8];
+}
+
+// Chaining value of one chunk of up to k_chunk bytes
+static void chunk_cv(const uint8_t* p, size_t len, uint64_t chunk, uint32_t extra, uint32_t* cv)
+{
+	memcpy(cv, k_iv, sizeof(k_iv));
+	size_t blocks = len ? (len + k_block - 1) / k_block : 1;
+	for(size_t b = 0; b < blocks; b++) {
+		size_t n = min(k_block, len - b * k_block);
+		uint8_t buf[k_block] = {};
+		if (n)
+			memcpy(buf, p + b * k_block, n);
+		uint32_t m[16];
+		for(size_t i = 0; i < 16; i++)
+			m[i] = load_le32(buf + 4 * i);
+		uint32_t flags = (b == 0 ? k_chunk_start : 0) | (b + 1 == blocks ? k_chunk_end | extra : 0);
+		compress<uint32_t>(cv, m, uint32_t(chunk), uint32_t(chunk >> 32), uint32_t(n), flags);
+	}
+}
+
+// Chaining values of Lanes whole chunks, one per lane
+template<class V, size_t Lanes>
+static inline __attribute__((always_inline)) void chunk_cvs(const uint8_t* p, uint64_t chunk, uint32_t (*cvs)[8])
+{
+	V cv[8], lo = V(), hi = V();
+	for(size_t i = 0; i < 8; i++)
+		cv[i] = V() + k_iv[i];
+	for(size_t lane = 0; lane < Lanes; lane++) {
+		lo[lane] = uint32_t(chunk + lane);
+		hi[lane] = uint32_t((chunk + lane) >> 32);
+	}
+	for(size_t b = 0; b < k_chunk / k_block; b++) {
+		// Word i of every lane's block goes in m[i]
+		V m[16];
+		uint32_t* words = (uint32_t*) m;
+		for(size_t lane = 0; lane < Lanes; lane++) {
+			const uint8_t* block = p + lane * k_chunk + b * k_block;
+			for(size_t i = 0; i < 16; i++)
+				words[i * Lanes + lane] = load_le32(block + 4 * i);
+		}
+		uint32_t flags = (b == 0 ? k_chunk_start : 0) | (b + 1 == k_chunk / k_block ? k_chunk_end : 0);
+		compress<V>(cv, m, lo, hi, V() + uint32_t(k_block), V() + flags);
+	}
+	for(size_t lane = 0; lane < Lanes; lane++)
+		for(size_t i = 0; i < 8; i++)
+			cvs[lane][i] = cv[i][lane];
+}
+
+static void chunk_cv4(const uint8_t* p, uint64_t chunk, uint32_t (*cvs)[8])
+{
+	chunk_cvs<u32x4, 4>(p, chunk, cvs);
+}
+
+#ifdef __x86_64__
+__attribute__((target("avx2")))
+static void chunk_cv8(const uint8_t* p, uint64_t chunk, uint32_t (*cvs)[8])
+{
+	chunk_cvs<u32x8, 8>(p, chunk, cvs);
+}
+
+// Chunks hashed at once, 8 with AVX2
+static size_t pick_lanes()
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") ? 8 : 4;
+}
+static const size_t k_lanes = pick_lanes();
+#else
+static const size_t k_lanes = 4;
+#endif
+
+static void parent_cv(const uint32_t* left, const uint32_t* right, uint32_t extra, uint32_t* cv)
+{
+	uint32_t m[16];
+	memcpy(m, left, 32);
+	memcpy(m + 8, right, 32);
+	memcpy(cv, k_iv, sizeof(k_iv));
+	compress<uint32_t>(cv, m, 0, 0, uint32_t(k_block), k_parent | extra);
+}
+
+// Bytes in the left subtree, the most whole chunks in a power of two that
+// leaves at least one byte for the right
+static size_t left_len(size_t len)
+{
+	size_t chunks = (len - 1) / k_chunk;
+	size_t pow2 = 1;
+	while(pow2 * 2 <= chunks)
+		pow2 *= 2;
+	return pow2 * k_chunk;
+}
+
+static void subtree_cv(const uint8_t* p, size_t len, uint64_t chunk, uint32_t* cv)
+{
+	if (len <= k_chunk) {
+		chunk_cv(p, len, chunk, 0, cv);
+		return;
+	}
+	if (len == k_lanes * k_chunk) {
+		// A whole subtree of chunks at once, then pair them up
+		uint32_t cvs[8][8];
+#ifdef __x86_64__
+		if (k_lanes == 8)
+			chunk_cv8(p, chunk, cvs);
+		else
+#endif
+			chunk_cv4(p, chunk, cvs);
+		for(size_t n = k_lanes; n > 1; n /= 2)
+			for(size_t i = 0; i < n / 2; i++)
+				parent_cv(cvs[2 * i], cvs[2 * i + 1], 0, cvs[i]);
+		memcpy(cv, cvs[0], 32);
+		return;
+	}
+	size_t left = left_len(len);
+	uint32_t l[8], r[8];
+	subtree_cv(p, left, chunk, l);
+	subtree_cv(p + left, len - left, chunk + left / k_chunk, r);
+	parent_cv(l, r, 0, cv);
+}
+
+void blake3_hash::hash(const hash_piece* pieces, size_t count, void* out)
+{
+	// The tree needs the input in one piece
+	size_t len = 0;
+	for(size_t i = 0; i < count; i++)
+		len += pieces[i].size;
+	uint8_t small[256];
+	string big;
+	const uint8_t* p = (const uint8_t*) (count ? pieces[0].data : small);
+	if (count > 1) {
+		uint8_t* dst = small;
+		if (len > sizeof(small)) {
+			big.resize(len);
+			dst = (uint8_t*) &big[0];
+		}
+		p = dst;
+		for(size_t i = 0; i < count; i++) {
+			if (pieces[i].size)
+				memcpy(dst, pieces[i].data, pieces[i].size);
+			dst += pieces[i].size;
+		}
+	}
+	uint32_t cv[8];
+	if (len <= k_chunk) {
+		chunk_cv(p, len, 0, k_root, cv);
+	} else {
+		size_t left = left_len(len);
+		uint32_t l[8], r[8];
+		subtree_cv(p, left, 0, l);
+		subtree_cv(p + left, len - left, left / k_chunk, r);
+		parent_cv(l, r, k_root, cv);
+	}
+	for(size_t i = 0; i < 8; i++)
+		store_le32((uint8_t*) out + 4 * i, cv[i]);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "types.h"
+
+// The hash functions digest, ptree and merkle_cow can be built on.  Each
+// is a policy class whose hash() takes the input in pieces, so callers
+// needn't copy things together, and writes 32 bytes:
+//   static void hash(const hash_piece* pieces, size_t count, void* out);
+//   static const char* name();
+
+// A piece of hash input, the hash covers the pieces one after another
+struct hash_piece
+{
+	const void* data;
+	size_t size;
+};
+
+// SHA-256 through OpenSSL, the default and what existing roots use
+struct sha256_hash
+{
+	static void hash(const hash_piece* pieces, size_t count, void* out);
+	static const char* name() { return "sha256"; }
+};
+
+// BLAKE3 with its 32 byte default output.  Large inputs are hashed four
+// 1KB chunks at a time in vector registers, or eight with AVX2.
+struct blake3_hash
+{
+	static void hash(const hash_piece* pieces, size_t count, void* out);
+	static const char* name() { return "blake3"; }
+};
+
+// fast_hash's mixing in four lanes.  Not cryptographic, and the output
+// depends on byte order, but well enough mixed for ptree's bit tests.  For
+// tests and benchmarks that want the trees without the cost of real
+// hashing.
+struct cheap_hash
+{
+	static void hash(const hash_piece* pieces, size_t count, void* out);
+	static const char* name() { return "cheap"; }
+};
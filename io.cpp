@@ -1,31 +1,83 @@
 
 #include "io.h"
 
-const static size_t k_bufsize = 16 * 1024;
+#include <unistd.h>
+#include <limits.h>
+#include <sys/uio.h>
+
+// Largest single call to base_read/base_write
+const static size_t k_max_call = 1 << 30;
+
+read_wrapper::read_wrapper(size_t bufsize)
+	: m_buf(bufsize ? new char[bufsize] : nullptr)
+	, m_bufsize(bufsize)
+	, m_pos(0)
+	, m_end(0)
+{}
+
+read_wrapper::~read_wrapper()
+{
+	delete[] m_buf;
+}
+
+int read_wrapper::checked_read(char* buf, size_t len)
+{
+	int r = base_read(buf, int(min(len, k_max_call)));
+	if (r < 0)
+		throw io_exception("IO error on read");
+	return r;
+}
 
 size_t read_wrapper::read(char* buf, size_t len)
 {
 	size_t tot_read = 0;
 	while(len)
 	{
-		int r = base_read(buf, len);
-		if (r < 0)
-			throw io_exception("IO error on read");
+		if (m_pos < m_end) {
+			// Serve from the buffer
+			size_t n = min(len, m_end - m_pos);
+			memcpy(buf, m_buf + m_pos, n);
+			m_pos += n;
+			tot_read += n;
+			buf += n;
+			len -= n;
+			continue;
+		}
+		int r;
+		if (len >= m_bufsize) {
+			// Big reads go straight to the caller
+			r = checked_read(buf, len);
+			tot_read += r;
+			buf += r;
+			len -= r;
+		} else {
+			r = checked_read(m_buf, m_bufsize);
+			m_pos = 0;
+			m_end = r;
+		}
 		if (r == 0)
 			return tot_read;
-		tot_read += r;
-		buf += r;
-		len -= r;
 	}
 
 	return tot_read;
 }
 
-void write_wrapper::write(const char* buf, size_t len)
+write_wrapper::write_wrapper(size_t bufsize)
+	: m_buf(bufsize ? new char[bufsize] : nullptr)
+	, m_bufsize(bufsize)
+	, m_used(0)
+{}
+
+write_wrapper::~write_wrapper()
+{
+	delete[] m_buf;
+}
+
+void write_wrapper::write_all(const char* buf, size_t len)
 {
 	while(len > 0)
 	{
-		int r = base_write(buf, len);
+		int r = base_write(buf, int(min(len, k_max_call)));
 		if (r <= 0)
 			throw io_exception("IO error during write");
 		len -= r;
@@ -33,15 +85,299 @@ void write_wrapper::write(const char* buf, size_t len)
 	}
 }
 
+void write_wrapper::write(const char* buf, size_t len)
+{
+	if (len == 0) return;
+	if (m_used + len <= m_bufsize) {
+		memcpy(m_buf + m_used, buf, len);
+		m_used += len;
+		return;
+	}
+	drain();
+	if (len >= m_bufsize) {
+		write_all(buf, len);
+	} else {
+		memcpy(m_buf, buf, len);
+		m_used = len;
+	}
+}
+
+void write_wrapper::drain()
+{
+	size_t used = m_used;
+	m_used = 0;
+	write_all(m_buf, used);
+}
+
+void write_wrapper::drain_quietly()
+{
+	try {
+		drain();
+	} catch(const io_exception&) {}
+}
+
 void write_wrapper::flush()
 {
+	drain();
 	if (base_flush() < 0)
 		throw io_exception("Error during flush");
 }
 
 void write_wrapper::close()
 {
+	drain();
 	if (base_close() < 0)
 		throw io_exception("Error during close");
 }
 
+fd_reader::fd_reader(int fd, bool owned, size_t bufsize)
+	: read_wrapper(bufsize)
+	, m_fd(fd)
+	, m_owned(owned)
+{}
+
+fd_reader::~fd_reader()
+{
+	if (m_owned)
+		::close(m_fd);
+}
+
+int fd_reader::base_read(char* buf, int len)
+{
+	ssize_t r;
+	do { r = ::read(m_fd, buf, len); } while(r < 0 && errno == EINTR);
+	return int(r);
+}
+
+fd_writer::fd_writer(int fd, bool owned, size_t bufsize)
+	: write_wrapper(bufsize)
+	, m_fd(fd)
+	, m_owned(owned)
+{}
+
+fd_writer::~fd_writer()
+{
+	drain_quietly();
+	if (m_owned && m_fd >= 0)
+		::close(m_fd);
+}
+
+int fd_writer::base_write(const char* buf, int len)
+{
+	ssize_t r;
+	do { r = ::write(m_fd, buf, len); } while(r < 0 && errno == EINTR);
+	return int(r);
+}
+
+int sync_fd(int fd)
+{
+	if (fdatasync(fd) < 0 && errno != EINVAL && errno != EROFS)
+		return -1;
+	return 0;
+}
+
+int fd_writer::base_flush()
+{
+	return sync_fd(m_fd);
+}
+
+int fd_writer::base_close()
+{
+	if (!m_owned) return 0;
+	int fd = m_fd;
+	m_fd = -1;
+	return ::close(fd);
+}
+
+fd_gather_writer::fd_gather_writer(int fd, bool owned, size_t limit)
+	: m_fd(fd)
+	, m_owned(owned)
+	, m_limit(limit)
+	, m_pending(0)
+	, m_syscalls(0)
+	, m_chunk_used(0)
+	, m_chunk_count(0)
+{}
+
+fd_gather_writer::~fd_gather_writer()
+{
+	try {
+		drain();
+	} catch(const io_exception&) {}
+	if (m_owned && m_fd >= 0)
+		::close(m_fd);
+}
+
+void fd_gather_writer::write(const char* buf, size_t len)
+{
+	if (len >= k_bufsize) {
+		// Too big to be worth copying, send it out with whatever is queued
+		add(buf, len);
+		drain();
+		return;
+	}
+	if (m_chunk_count == 0 || m_chunk_used + len > k_bufsize) {
+		if (m_chunk_count == m_chunks.size())
+			m_chunks.emplace_back(new char[k_bufsize]);
+		m_chunk_count++;
+		m_chunk_used = 0;
+	}
+	char* dst = m_chunks[m_chunk_count - 1].get() + m_chunk_used;
+	memcpy(dst, buf, len);
+	m_chunk_used += len;
+	add(dst, len);
+}
+
+void fd_gather_writer::write_ref(const char* buf, size_t len)
+{
+	add(buf, len);
+}
+
+void fd_gather_writer::add(const char* buf, size_t len)
+{
+	if (len == 0) return;
+	// Extend the last fragment when this one follows it in memory
+	if (m_frags.size() && m_frags.back().first + m_frags.back().second == buf)
+		m_frags.back().second += len;
+	else
+		m_frags.emplace_back(buf, len);
+	m_pending += len;
+	if (m_pending >= m_limit || m_frags.size() >= IOV_MAX)
+		drain();
+}
+
+void fd_gather_writer::drain()
+{
+	size_t done = 0;
+	while(done < m_frags.size()) {
+		struct iovec iov[IOV_MAX];
+		int count = int(min(m_frags.size() - done, size_t(IOV_MAX)));
+		for(int i = 0; i < count; i++) {
+			iov[i].iov_base = (void*) m_frags[done + i].first;
+			iov[i].iov_len = m_frags[done + i].second;
+		}
+		ssize_t r;
+		do { r = ::writev(m_fd, iov, count); } while(r < 0 && errno == EINTR);
+		m_syscalls++;
+		if (r <= 0)
+			throw io_exception("IO error during write");
+		// Skip what was written, a short write leaves part of a fragment
+		while(r > 0) {
+			pair<const char*, size_t>& f = m_frags[done];
+			size_t n = min(size_t(r), f.second);
+			f.first += n;
+			f.second -= n;
+			r -= n;
+			if (f.second == 0) done++;
+		}
+	}
+	m_frags.clear();
+	m_pending = 0;
+	m_chunk_count = 0;
+	m_chunk_used = 0;
+}
+
+void fd_gather_writer::flush()
+{
+	drain();
+	if (sync_fd(m_fd) < 0)
+		throw io_exception("Error during flush");
+}
+
+void fd_gather_writer::close()
+{
+	drain();
+	if (!m_owned) return;
+	int fd = m_fd;
+	m_fd = -1;
+	if (::close(fd) < 0)
+		throw io_exception("Error during close");
+}
+
+void read_exact(readable& in, char* buf, size_t len)
+{
+	if (in.read(buf, len) != len)
+		throw io_exception("Unexpected EOF");
+}
+
+void write_varint(writable& out, uint64_t value)
+{
+	char buf[10];
+	size_t len = 0;
+	while(value >= 0x80) {
+		buf[len++] = char(value | 0x80);
+		value >>= 7;
+	}
+	buf[len++] = char(value);
+	out.write(buf, len);
+}
+
+uint64_t read_varint(readable& in)
+{
+	uint64_t value = 0;
+	for(size_t shift = 0; shift < 64; shift += 7) {
+		uint8_t c;
+		read_exact(in, (char*) &c, 1);
+		value |= uint64_t(c & 0x7f) << shift;
+		if (!(c & 0x80))
+			return value;
+	}
+	throw io_exception("Invalid varint");
+}
+
+void pread_exact(int fd, char* buf, size_t len, uint64_t offset)
+{
+	while(len) {
+		ssize_t r = pread(fd, buf, len, off_t(offset));
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r <= 0)
+			throw io_exception("Error reading file");
+		buf += r;
+		len -= r;
+		offset += r;
+	}
+}
+
+void put_u32(char* out, uint32_t v)
+{
+	for(int i = 0; i < 4; i++) out[i] = char(v >> (8 * i));
+}
+
+uint32_t get_u32(const char* in)
+{
+	uint32_t v = 0;
+	for(int i = 0; i < 4; i++) v |= uint32_t(uint8_t(in[i])) << (8 * i);
+	return v;
+}
+
+void put_u64(char* out, uint64_t v)
+{
+	put_u32(out, uint32_t(v));
+	put_u32(out + 4, uint32_t(v >> 32));
+}
+
+uint64_t get_u64(const char* in)
+{
+	return get_u32(in) | (uint64_t(get_u32(in + 4)) << 32);
+}
+
+// CRC32C (Castagnoli), table driven
+uint32_t crc32c(uint32_t crc, const char* buf, size_t len)
+{
+	static uint32_t table[256];
+	static bool init = []() {
+		for(uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for(int j = 0; j < 8; j++)
+				c = (c >> 1) ^ (c & 1 ? 0x82f63b78 : 0);
+			table[i] = c;
+		}
+		return true;
+	}();
+	(void) init;
+	crc = ~crc;
+	for(size_t i = 0; i < len; i++)
+		crc = table[(crc ^ uint8_t(buf[i])) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
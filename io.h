@@ -20,18 +20,31 @@ public:
 	virtual size_t read(char* buf, size_t len) = 0;
 };
 
-/* A helper class to wrap objects with unix read semantics (-1 on err, not full reads, etc) */
+// Default buffer size for the wrappers below
+const static size_t k_bufsize = 16 * 1024;
+
+/* A helper class to wrap objects with unix read semantics (-1 on err, not full reads, etc) 
+   Reads ahead into a buffer of 'bufsize' bytes, 0 means unbuffered */
 class read_wrapper : public readable
 {
 public:
-	read_wrapper();
+	read_wrapper(size_t bufsize = k_bufsize);
 	~read_wrapper();
 	size_t read(char* buf, size_t len);
 
 private:
 	virtual int base_read(char* buf, int len) = 0;
+	int checked_read(char* buf, size_t len);
+
+	char* m_buf;
+	size_t m_bufsize;
+	size_t m_pos;  // Next unread byte in m_buf
+	size_t m_end;  // End of valid data in m_buf
 };
 
+// Writers may buffer, so call flush() or close() before destroying one,
+// that's where errors are reported.  Destructors write out what's buffered
+// as best they can, in every build type, and drop any error.
 class writable
 {
 public:
@@ -47,17 +60,111 @@ public:
 	virtual void close() {} 
 };
 
-/* A helper class to wrap objects with unix write semantics */
+/* A helper class to wrap objects with unix write semantics
+   Small writes are gathered in a buffer of 'bufsize' bytes, 0 means unbuffered.
+   base_write is gone by the time ~write_wrapper runs, so derived classes
+   call drain_quietly() from their destructors */
 class write_wrapper : public writable
 {
 public:
+	write_wrapper(size_t bufsize = k_bufsize);
+	~write_wrapper();
 	void write(const char* buf, size_t len);
 	void flush();
 	void close();
 
+protected:
+	// Write out the buffer without calling base_flush
+	void drain();
+	// drain() for destructors, errors are dropped
+	void drain_quietly();
+
 private:
 	virtual int base_write(const char *buf, int len) = 0;
 	virtual int base_close() { return 0; }
 	virtual int base_flush() { return 0; }
+	void write_all(const char* buf, size_t len);
+
+	char* m_buf;
+	size_t m_bufsize;
+	size_t m_used;
 };
 
+// Sync a file to disk, returns -1 on error.  Quietly skips things that
+// can't be synced, like pipes.
+int sync_fd(int fd);
+
+// Buffered read ahead from a file descriptor
+class fd_reader : public read_wrapper
+{
+public:
+	fd_reader(int fd, bool owned = true, size_t bufsize = k_bufsize);
+	~fd_reader();
+
+private:
+	int base_read(char* buf, int len);
+	int m_fd;
+	bool m_owned;
+};
+
+// Buffered writes to a file descriptor, flush() also syncs the file to disk
+class fd_writer : public write_wrapper
+{
+public:
+	fd_writer(int fd, bool owned = true, size_t bufsize = k_bufsize);
+	~fd_writer();
+
+private:
+	int base_write(const char *buf, int len);
+	int base_flush();
+	int base_close();
+	int m_fd;
+	bool m_owned;
+};
+
+// Gathers many small fragments and writes them with few writev calls.
+// write() copies, write_ref() only records the pointer, so that data must
+// stay valid until the next flush() or close() returns.  Pending data goes
+// out once 'limit' bytes or IOV_MAX fragments are queued, and on flush(),
+// which also syncs the file to disk.
+class fd_gather_writer : public writable
+{
+public:
+	fd_gather_writer(int fd, bool owned = true, size_t limit = 64 * k_bufsize);
+	~fd_gather_writer();
+	void write(const char* buf, size_t len);
+	void write_ref(const char* buf, size_t len);
+	void flush();
+	void close();
+
+	// Number of writev calls made so far
+	size_t syscalls() const { return m_syscalls; }
+
+private:
+	void add(const char* buf, size_t len);
+	void drain();
+
+	int m_fd;
+	bool m_owned;
+	size_t m_limit;
+	size_t m_pending;  // Bytes queued
+	size_t m_syscalls;
+	vector<pair<const char*, size_t>> m_frags;
+	vector<unique_ptr<char[]>> m_chunks;  // Storage for copied fragments
+	size_t m_chunk_used;  // Bytes used in m_chunks.back()
+	size_t m_chunk_count;  // Chunks in use, the rest are kept for reuse
+};
+
+// Helpers for simple binary encodings, reads throw on a short read
+void read_exact(readable& in, char* buf, size_t len);
+void pread_exact(int fd, char* buf, size_t len, uint64_t offset);
+void write_varint(writable& out, uint64_t value);
+uint64_t read_varint(readable& in);
+// Little endian fixed width integers
+void put_u32(char* out, uint32_t v);
+uint32_t get_u32(const char* in);
+void put_u64(char* out, uint64_t v);
+uint64_t get_u64(const char* in);
+
+// CRC32C of buf, continuing from crc (start with 0)
+uint32_t crc32c(uint32_t crc, const char* buf, size_t len);
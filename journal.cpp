@@ -0,0 +1,257 @@
+
+#include "journal.h"
+
+const static char k_put = 1;
+const static char k_erase = 2;
+const static size_t k_header = 8;
+const static size_t k_max_record = 1 << 30;
+const static char k_checkpoint_magic[4] = { 'M', 'C', 'K', '1' };
+
+// Appends to a string
+class append_writer : public writable
+{
+public:
+	append_writer(string& out) : m_out(out) {}
+	void write(const char* buf, size_t len) { m_out.append(buf, len); }
+private:
+	string& m_out;
+};
+
+// Reads from a buffer
+class buffer_reader : public readable
+{
+public:
+	buffer_reader(const string& in) : m_in(in), m_pos(0) {}
+	size_t read(char* buf, size_t len) {
+		len = min(len, m_in.size() - m_pos);
+		memcpy(buf, m_in.data() + m_pos, len);
+		m_pos += len;
+		return len;
+	}
+	bool at_end() const { return m_pos == m_in.size(); }
+private:
+	const string& m_in;
+	size_t m_pos;
+};
+
+// Checksums everything written through it
+class crc_writer : public writable
+{
+public:
+	crc_writer(writable& out) : m_out(out), m_crc(0) {}
+	void write(const char* buf, size_t len) { m_crc = crc32c(m_crc, buf, len); m_out.write(buf, len); }
+	uint32_t crc() const { return m_crc; }
+private:
+	writable& m_out;
+	uint32_t m_crc;
+};
+
+// Checksums everything read through it
+class crc_reader : public readable
+{
+public:
+	crc_reader(readable& in) : m_in(in), m_crc(0) {}
+	size_t read(char* buf, size_t len) { len = m_in.read(buf, len); m_crc = crc32c(m_crc, buf, len); return len; }
+	uint32_t crc() const { return m_crc; }
+private:
+	readable& m_in;
+	uint32_t m_crc;
+};
+
+journal::journal(writable& out, uint64_t next_seq, size_t max_batch)
+	: m_out(out)
+	, m_max_batch(max_batch)
+	, m_next_seq(next_seq)
+	, m_durable_seq(next_seq - 1)
+	, m_busy(false)
+	, m_failed(false)
+{
+	assert(next_seq > 0);
+}
+
+uint64_t journal::log_put(const string& key, const string& value)
+{
+	return append(k_put, key, &value);
+}
+
+uint64_t journal::log_erase(const string& key)
+{
+	return append(k_erase, key, nullptr);
+}
+
+uint64_t journal::append(char type, const string& key, const string* value)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_failed)
+		throw io_exception("Journal failed");
+	uint64_t seq = m_next_seq++;
+	// Leave room for the header and fill it in once the payload is known
+	size_t start = m_pending.size();
+	m_pending.resize(start + k_header);
+	append_writer w(m_pending);
+	w.write(&type, 1);
+	write_varint(w, seq);
+	write_varint(w, key.size());
+	w.write(key.data(), key.size());
+	if (value) {
+		write_varint(w, value->size());
+		w.write(value->data(), value->size());
+	}
+	size_t len = m_pending.size() - start - k_header;
+	assert(len <= k_max_record);
+	put_u32(&m_pending[start], uint32_t(len));
+	put_u32(&m_pending[start + 4], crc32c(0, m_pending.data() + start + k_header, len));
+	if (m_pending.size() >= m_max_batch && !m_busy)
+		write_pending(lock, false);
+	return seq;
+}
+
+// Called with the lock held and no other writer active.  Drops the lock
+// while doing IO so new records can be logged meanwhile.
+void journal::write_pending(std::unique_lock<std::mutex>& lock, bool do_flush)
+{
+	assert(!m_busy);
+	m_busy = true;
+	string batch;
+	batch.swap(m_pending);
+	uint64_t target = m_next_seq - 1;
+	lock.unlock();
+	try {
+		if (batch.size())
+			m_out.write(batch.data(), batch.size());
+		if (do_flush)
+			m_out.flush();
+	} catch(...) {
+		lock.lock();
+		m_failed = true;
+		m_busy = false;
+		m_cond.notify_all();
+		throw;
+	}
+	lock.lock();
+	if (do_flush)
+		m_durable_seq = target;
+	m_busy = false;
+	m_cond.notify_all();
+}
+
+void journal::sync(uint64_t seq)
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	assert(seq < m_next_seq);
+	while(m_durable_seq < seq) {
+		if (m_failed)
+			throw io_exception("Journal failed");
+		if (m_busy)
+			m_cond.wait(lock);
+		else
+			write_pending(lock, true);
+	}
+}
+
+void journal::sync()
+{
+	sync(last_seq());
+}
+
+uint64_t journal::last_seq() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_next_seq - 1;
+}
+
+uint64_t journal::durable_seq() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_durable_seq;
+}
+
+void write_checkpoint(writable& out, const merkle_cow& tree, uint64_t seq)
+{
+	crc_writer w(out);
+	w.write(k_checkpoint_magic, sizeof(k_checkpoint_magic));
+	write_varint(w, seq);
+	tree.serialize(w);
+	char buf[4];
+	put_u32(buf, w.crc());
+	out.write(buf, sizeof(buf));
+	out.flush();
+}
+
+uint64_t read_checkpoint(readable& in, merkle_cow& tree)
+{
+	crc_reader r(in);
+	char magic[sizeof(k_checkpoint_magic)];
+	read_exact(r, magic, sizeof(magic));
+	if (memcmp(magic, k_checkpoint_magic, sizeof(magic)) != 0)
+		throw io_exception("Not a checkpoint");
+	uint64_t seq = read_varint(r);
+	merkle_cow loaded;
+	loaded.deserialize(r);
+	uint32_t crc = r.crc();
+	char buf[4];
+	read_exact(in, buf, sizeof(buf));
+	if (get_u32(buf) != crc)
+		throw io_exception("Checkpoint checksum mismatch");
+	tree = loaded;
+	return seq;
+}
+
+recover_info replay_journal(readable& in, merkle_cow& tree, uint64_t tree_seq)
+{
+	recover_info info = { tree_seq, tree_seq, 0, 0 };
+	string payload;
+	while(true) {
+		char header[k_header];
+		if (in.read(header, k_header) != k_header)
+			break;  // Clean end or torn header
+		uint32_t len = get_u32(header);
+		if (len == 0 || len > k_max_record)
+			break;
+		payload.resize(len);
+		if (in.read(&payload[0], len) != len)
+			break;  // Torn record
+		if (crc32c(0, payload.data(), len) != get_u32(header + 4))
+			break;  // Corrupt record
+		char type;
+		uint64_t seq;
+		string key, value;
+		buffer_reader r(payload);
+		try {
+			read_exact(r, &type, 1);
+			seq = read_varint(r);
+			key.resize(read_varint(r));
+			read_exact(r, &key[0], key.size());
+			if (type == k_put) {
+				value.resize(read_varint(r));
+				read_exact(r, &value[0], value.size());
+			}
+		} catch(const io_exception&) {
+			break;
+		}
+		if ((type != k_put && type != k_erase) || !r.at_end())
+			break;
+		// Records already in the checkpoint are skipped, but still valid
+		if (seq > tree_seq) {
+			if (seq != info.last_seq + 1)
+				throw io_exception("Journal does not continue from checkpoint");
+			if (type == k_put)
+				tree.put(make_shared<string>(key), make_shared<string>(value));
+			else
+				tree.put(make_shared<string>(key), shared_ptr<string>());
+			info.last_seq = seq;
+			info.records++;
+		}
+		info.valid_bytes += k_header + len;
+	}
+	return info;
+}
+
+recover_info recover(readable* checkpoint, readable& log, merkle_cow& tree)
+{
+	uint64_t seq = 0;
+	tree = merkle_cow();
+	if (checkpoint)
+		seq = read_checkpoint(*checkpoint, tree);
+	return replay_journal(log, tree, seq);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "merkle_cow.h"
+#include <mutex>
+#include <condition_variable>
+
+// An append-only write ahead journal of merkle_cow updates.  Every record
+// gets a sequence number and a checksum.  Records are buffered in memory
+// and made durable in groups: the first caller of sync() writes everything
+// pending and flushes once, other callers wait for it.
+//
+// Record layout: u32 payload length, u32 CRC32C of payload, then payload of
+// type byte, varint seq, varint key length, key, and for puts varint value
+// length and value.  All fixed width integers are little endian.
+class journal
+{
+public:
+	// Append to out, whose flush() must make the data durable (fsync).
+	// next_seq continues numbering, use recover_info::last_seq + 1.
+	// Once max_batch bytes are pending, appends write them out early.
+	journal(writable& out, uint64_t next_seq = 1, size_t max_batch = 64 * 1024);
+
+	// Log an update, returns its sequence number, does not wait
+	uint64_t log_put(const string& key, const string& value);
+	uint64_t log_erase(const string& key);
+
+	// Wait until every record up to seq is durable
+	void sync(uint64_t seq);
+	// Wait until every record logged so far is durable
+	void sync();
+
+	// Highest sequence number logged, and highest known durable
+	uint64_t last_seq() const;
+	uint64_t durable_seq() const;
+
+private:
+	uint64_t append(char type, const string& key, const string* value);
+	void write_pending(std::unique_lock<std::mutex>& lock, bool do_flush);
+
+	writable& m_out;
+	size_t m_max_batch;
+	mutable std::mutex m_mutex;
+	std::condition_variable m_cond;
+	string m_pending;  // Encoded records not yet written
+	uint64_t m_next_seq;  // Sequence of the next record
+	uint64_t m_durable_seq;  // Last record flushed
+	bool m_busy;  // Some thread is writing to m_out
+	bool m_failed;  // A write failed, the journal is unusable
+};
+
+// What recovery found
+struct recover_info
+{
+	uint64_t checkpoint_seq;  // Sequence covered by the checkpoint, 0 if none
+	uint64_t last_seq;  // Last sequence applied, from checkpoint or journal
+	size_t records;  // Journal records replayed
+	size_t valid_bytes;  // Journal length up to the last good record
+};
+
+// Write a snapshot of tree that includes every update up to seq.  Since
+// the tree is copy on write, rehash it under the writers' lock, then take
+// a copy and checkpoint the copy while updates continue.  The copy must
+// already be hashed, see merkle_cow::rehash.
+void write_checkpoint(writable& out, const merkle_cow& tree, uint64_t seq);
+
+// Load a checkpoint, returns its sequence, throws io_exception if corrupt
+uint64_t read_checkpoint(readable& in, merkle_cow& tree);
+
+// Replay journal records after tree_seq onto tree.  Stops quietly at a torn
+// or corrupt record, the journal should be truncated to valid_bytes before
+// appending to it again.  Throws io_exception if records are missing
+// between tree_seq and the journal.
+recover_info replay_journal(readable& in, merkle_cow& tree, uint64_t tree_seq);
+
+// Load a checkpoint (if any) then replay the journal tail
+recover_info recover(readable* checkpoint, readable& log, merkle_cow& tree);
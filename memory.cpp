@@ -0,0 +1,46 @@
+
+#include "memory.h"
+
+mem_usage& mem_usage::operator+=(const mem_usage& rhs)
+{
+	nodes += rhs.nodes;
+	node_bytes += rhs.node_bytes;
+	control_bytes += rhs.control_bytes;
+	heap_bytes += rhs.heap_bytes;
+	key_bytes += rhs.key_bytes;
+	value_bytes += rhs.value_bytes;
+	return *this;
+}
+
+bool mem_tracker::visit(const void* p, const mem_usage& own)
+{
+	auto r = m_seen.emplace(p, entry{m_root, own});
+	if (r.second)
+		return true;
+	entry& e = r.first->second;
+	if (e.owner == m_root || e.owner == k_shared)
+		return false;
+	// First seen from another root, so it and everything below it is
+	// shared, the walk goes on to mark them
+	e.owner = k_shared;
+	return true;
+}
+
+mem_usage mem_tracker::total() const
+{
+	mem_usage r;
+	for(const auto& kvp : m_seen)
+		r += kvp.second.own;
+	return r;
+}
+
+mem_usage mem_tracker::unique(size_t root) const
+{
+	assert(root < m_roots);
+	mem_usage r;
+	for(const auto& kvp : m_seen) {
+		if (kvp.second.owner == root)
+			r += kvp.second.own;
+	}
+	return r;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "blob.h"
+
+// Memory accounting for copy on write trees.  Snapshots share most of
+// their nodes, so a tracker walks any number of roots, counts each node and
+// out of line blob once, and keeps track of which root reached it.
+// Payload bytes (key_bytes and value_bytes) are what leaves hold, and are
+// part of the node and heap bytes rather than in addition to them.
+struct mem_usage
+{
+	size_t nodes = 0;
+	size_t node_bytes = 0;  // The node objects
+	size_t control_bytes = 0;  // shared_ptr control blocks next to them
+	size_t heap_bytes = 0;  // Out of line blob storage
+	size_t key_bytes = 0;
+	size_t value_bytes = 0;
+
+	size_t total() const { return node_bytes + control_bytes + heap_bytes; }
+	mem_usage& operator+=(const mem_usage& rhs);
+};
+
+class mem_tracker
+{
+public:
+	// Roughly what make_shared adds to each node: a vtable pointer and
+	// the use and weak counts (libstdc++ and libc++ on 64 bit)
+	const static size_t k_control_bytes = 2 * sizeof(void*);
+
+	// Walk another snapshot, Tree needs account(mem_tracker&)
+	template<class Tree>
+	void add(const Tree& tree) { m_root = m_roots++; tree.account(*this); }
+	// Everything reachable from any root added so far
+	mem_usage total() const;
+	// What only the i'th root added reaches, freed if just it is dropped
+	mem_usage unique(size_t root) const;
+
+	// For the trees: count 'own' for p unless already counted.  Returns
+	// false if the walk needn't look below p, because everything there
+	// is already counted with the right owner.
+	bool visit(const void* p, const mem_usage& own);
+	// Bytes of a key or value
+	template<class T>
+	static size_t payload(const T&) { return sizeof(T); }
+	template<size_t Inline>
+	static size_t payload(const blob<Inline>& b) { return b.size(); }
+	template<class A, class B>
+	static size_t payload(const pair<A, B>& p) { return payload(p.first) + payload(p.second); }
+	// Count any out of line storage of a key or value
+	template<class T>
+	void account(const T&) {}
+	template<size_t Inline>
+	void account(const blob<Inline>& b);
+	template<class A, class B>
+	void account(const pair<A, B>& p) { account(p.first); account(p.second); }
+
+private:
+	const static size_t k_shared = SIZE_MAX;
+	struct entry {
+		size_t owner;  // Root that reached it, or k_shared
+		mem_usage own;
+	};
+	unordered_map<const void*, entry> m_seen;
+	size_t m_roots = 0;
+	size_t m_root = 0;  // Root being walked
+};
+
+template<size_t Inline>
+void mem_tracker::account(const blob<Inline>& b)
+{
+	if (!b.heap_block())
+		return;
+	mem_usage own;
+	own.heap_bytes = b.heap_bytes();
+	visit(b.heap_block(), own);
+}
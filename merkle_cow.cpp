@@ -1,60 +1,280 @@
 
 #include "merkle_cow.h"
+#include "utils.h"
+#include "paged.h"
 #include <arpa/inet.h>
-#pragma clang diagnostic ignored "-Wdeprecated-declarations"
-#include <openssl/sha.h>
 
-static void hash_kvp(hash_t& out, const merkle_cow::key_type& key, const merkle_cow::mapped_type& value)
+template<class Hash>
+static void hash_kvp(hash_t& out, const char* key, size_t key_len, const char* value, size_t value_len)
 {
-	SHA256_CTX ctx;
-	SHA256_Init(&ctx);
-	uint32_t klen = htonl(uint32_t(key->size()));
-	SHA256_Update(&ctx, (const char *) &klen, sizeof(uint32_t));
-	SHA256_Update(&ctx, key->data(), key->size());
-	SHA256_Update(&ctx, value->data(), value->size());
-	SHA256_Final((unsigned char*) out.data(), &ctx);
+	STAT_INC(stat_leaf_hash);
+	uint32_t klen = htonl(uint32_t(key_len));
+	hash_piece pieces[3] = { { &klen, sizeof(klen) }, { key, key_len }, { value, value_len } };
+	Hash::hash(pieces, 3, out.data());
 }
 
-merkle_cow::policy::value_t merkle_cow::policy::compute_total(const value_t* vals, size_t count)
+// Recent leaf hashes, two way set associative.  Entries hold the full key
+// and value and are compared exactly, so a hit is always right.
+template<class Hash>
+class leaf_hash_cache
 {
-	SHA256_CTX ctx;
-	SHA256_Init(&ctx);
-	for(size_t i = 0; i < count; i++) {
-		SHA256_Update(&ctx, (const char *) vals[i].second.data(), vals[i].second.size()); 
+	typedef blob<23> key_t;
+	typedef blob<15> data_t;
+	struct entry {
+		key_t key;
+		data_t value;
+		hash_t hash;
+	};
+public:
+	void resize(size_t entries)
+	{
+		size_t sets = 1;
+		while(sets * 2 < entries) sets *= 2;
+		m_entries.assign(entries ? sets * 2 : 0, entry());
+		m_mask = sets - 1;
 	}
+
+	void get(const key_t& key, const data_t& value, hash_t& out)
+	{
+		if (m_entries.empty()) {
+			hash_kvp<Hash>(out, key.data(), key.size(), value.data(), value.size());
+			return;
+		}
+		uint64_t h = fast_hash(value.data(), value.size(), fast_hash(key.data(), key.size(), 0));
+		entry* set = &m_entries[(h & m_mask) * 2];
+		for(size_t i = 0; i < 2; i++) {
+			if (set[i].key == key && set[i].value == value) {
+				out = set[i].hash;
+				if (i == 1) swap(set[0], set[1]);  // Most recent first
+				return;
+			}
+		}
+		hash_kvp<Hash>(out, key.data(), key.size(), value.data(), value.size());
+		set[1] = std::move(set[0]);
+		set[0].key = key;
+		set[0].value = value;
+		set[0].hash = out;
+	}
+
+private:
+	vector<entry> m_entries;
+	size_t m_mask;
+};
+
+// One per hash and thread
+template<class Hash>
+static leaf_hash_cache<Hash>& t_hash_cache()
+{
+	static thread_local leaf_hash_cache<Hash> cache;
+	return cache;
+}
+
+// Shape constants are passed by reference in places
+template<size_t Fanout, class Hash>
+const size_t basic_merkle_cow<Fanout, Hash>::node_min;
+template<size_t Fanout, class Hash>
+const size_t basic_merkle_cow<Fanout, Hash>::node_max;
+template<size_t Fanout, class Hash>
+const size_t basic_merkle_cow<Fanout, Hash>::node_max_steal;
+
+template<size_t Fanout, class Hash>
+void basic_merkle_cow<Fanout, Hash>::set_hash_cache(size_t entries)
+{
+	t_hash_cache<Hash>().resize(entries);
+}
+
+template<size_t Fanout, class Hash>
+bool basic_merkle_cow<Fanout, Hash>::policy::leaf_pending(const value_t& v)
+{
+	static const hash_t zero = {};
+	return v.second == zero;
+}
+
+template<size_t Fanout, class Hash>
+void basic_merkle_cow<Fanout, Hash>::policy::prepare_leaf(const key_t& k, value_t& v)
+{
+	t_hash_cache<Hash>().get(k, v.first, v.second);
+}
+
+template<size_t Fanout, class Hash>
+uint32_t basic_merkle_cow<Fanout, Hash>::hash_id()
+{
+	hash_t none = {};
+	return get_u32(node_hash(&none, 0).data());
+}
+
+template<size_t Fanout, class Hash>
+typename basic_merkle_cow<Fanout, Hash>::policy::value_t 
+basic_merkle_cow<Fanout, Hash>::policy::compute_total(const value_t* vals, size_t count)
+{
+	// Gather the hashes so the hash sees one contiguous buffer
+	hash_t buf[max_size];
+	for(size_t i = 0; i < count; i++)
+		buf[i] = vals[i].second;
 	value_t r;
-	SHA256_Final((unsigned char*) r.second.data(), &ctx);
+	r.second = node_hash(buf, count);
 	return r;
 }
 
-bool merkle_cow::policy::less(const key_t& a, const key_t& b)
+template<size_t Fanout, class Hash>
+hash_t basic_merkle_cow<Fanout, Hash>::leaf_hash(const slice& key, const slice& value)
 {
-	return *a < *b;
+	hash_t r;
+	hash_kvp<Hash>(r, key.data(), key.size(), value.data(), value.size());
+	return r;
 }
 
+template<size_t Fanout, class Hash>
+hash_t basic_merkle_cow<Fanout, Hash>::node_hash(const hash_t* hashes, size_t count)
+{
+	hash_t r;
+	hash_piece piece = { hashes, count * sizeof(hash_t) };
+	Hash::hash(&piece, 1, r.data());
+	return r;
+}
 
-merkle_cow::mapped_type merkle_cow::put(const key_type& key, const mapped_type& value) {
+template<size_t Fanout, class Hash>
+void basic_merkle_cow<Fanout, Hash>::policy::serialize_value(writable& out, const value_t& v)
+{
+	write_varint(out, v.first.size());
+	out.write(v.first.data(), v.first.size());
+	out.write(v.second.data(), v.second.size());
+}
+
+template<size_t Fanout, class Hash>
+void basic_merkle_cow<Fanout, Hash>::policy::deserialize_value(readable& in, value_t& v)
+{
+	string s(read_varint(in), '\0');
+	read_exact(in, &s[0], s.size());
+	v.first = data_t(s);
+	read_exact(in, v.second.data(), v.second.size());
+}
+
+template<size_t Fanout, class Hash>
+typename basic_merkle_cow<Fanout, Hash>::mapped_type 
+basic_merkle_cow<Fanout, Hash>::put(const key_type& key, const mapped_type& value) {
 	bool new_exists;
-	bnode_t::value_t new_val;
+	typename bnode_t::value_t new_val;
 	if (value) {
 		new_exists = true;
-		new_val.first = value;
-		hash_kvp(new_val.second, key, value);
+		make_value(new_val, value->data(), value->size());
 	} else {
 		new_exists = false;
 	}
 	mapped_type r;
-	m_tree.update(key, [&](bnode_t::value_t& val, bool& exists) -> bool {
+	bool changed = m_tree.update(to_key(key), [&](typename bnode_t::value_t& val, bool& exists) -> bool {
 		if (exists) {
-			r = val.first;
+			r = make_shared<string>(val.first.str());
 		}
 		if (!exists && !new_exists) { return false; }	
-		if (exists && new_exists && *val.first == *new_val.first) { return false; }
+		if (exists && new_exists && val.first == new_val.first) { return false; }
 		exists = new_exists;
 		if (new_exists) {
 			val = new_val;
 		}
 		return true;
 	});
+	if (m_filter && changed && new_exists && !r) {
+		m_filter->insert(fast_hash(key->data(), key->size()));
+		if (m_filter->full())
+			set_filter(m_filter->bits_per_key());
+	}
+	return r;
+}
+
+template<size_t Fanout, class Hash>
+void basic_merkle_cow<Fanout, Hash>::write_batch(const vector<pair<slice, slice>>& writes)
+{
+	for(const auto& w : writes) {
+		const slice& value = w.second;
+		typename policy::value_t new_val;
+		if (!value.is_null())
+			make_value(new_val, value.data(), value.size());
+		bool added = false;
+		m_tree.update(typename policy::key_t(w.first.data(), w.first.size()), 
+			[&](typename bnode_t::value_t& val, bool& exists) -> bool {
+				if (value.is_null()) {
+					if (!exists) return false;
+					exists = false;
+					return true;
+				}
+				if (exists && val.first == new_val.first) return false;
+				added = !exists;
+				exists = true;
+				val = new_val;
+				return true;
+			}, true);
+		if (m_filter && added)
+			m_filter->insert(fast_hash(w.first.data(), w.first.size()));
+	}
+	if (m_filter && m_filter->full())
+		set_filter(m_filter->bits_per_key());
+}
+
+template<size_t Fanout, class Hash>
+void basic_merkle_cow<Fanout, Hash>::set_filter(size_t bits_per_key)
+{
+	m_filter.reset();
+	if (bits_per_key == 0)
+		return;
+	// Room to double before the next rebuild
+	auto f = make_shared<bloom_filter>(max(size_t(1024), 2 * m_tree.size()), bits_per_key);
+	for(auto it = begin(); it != end(); ++it)
+		f->insert(fast_hash(it.key().data(), it.key().size()));
+	m_filter = f;
+}
+
+template<size_t Fanout, class Hash>
+void basic_merkle_cow<Fanout, Hash>::make_value(typename policy::value_t& out, const char* value, size_t value_len)
+{
+	// The leaf hash waits until a total is needed
+	out.first = typename policy::data_t(value, value_len);
+	out.second = hash_t();
+}
+
+template<size_t Fanout, class Hash>
+hash_t basic_merkle_cow<Fanout, Hash>::root_hash() const
+{
+	hash_t r = {};
+	if (m_tree.height())
+		r = m_tree.root()->total().second;
 	return r;
 }
+
+template<size_t Fanout, class Hash>
+void basic_merkle_cow<Fanout, Hash>::write_nodes(writable& out) const
+{
+	assert(rehash(0));
+	node_file_writer w(out, node_max, hash_id());
+	uint64_t root = m_tree.height() ? write_node(w, *m_tree.root(), m_tree.height() - 1) : 0;
+	w.finish(root, m_tree.height(), m_tree.size(), root_hash());
+}
+
+// Children first, so the parent can record where they went
+template<size_t Fanout, class Hash>
+uint64_t basic_merkle_cow<Fanout, Hash>::write_node(node_file_writer& w, const bnode_t& n, size_t height)
+{
+	vector<uint64_t> children;
+	if (height) {
+		for(size_t i = 0; i < n.size(); i++)
+			children.push_back(write_node(w, *n.ptr(i), height - 1));
+	}
+	w.begin_node(height, n.total().second);
+	for(size_t i = 0; i < n.size(); i++) {
+		typename policy::key_t key = n.key(i);
+		if (height == 0)
+			w.add_leaf(slice(key), slice(n.val(i).first));
+		else
+			w.add_child(slice(key), children[i], n.ptr(i)->count(), n.val(i).second);
+	}
+	return w.end_node();
+}
+
+template class basic_merkle_cow<4>;
+template class basic_merkle_cow<8>;
+template class basic_merkle_cow<16>;
+template class basic_merkle_cow<32>;
+template class basic_merkle_cow<64>;
+template class basic_merkle_cow<128>;
+template class basic_merkle_cow<16, blake3_hash>;
+template class basic_merkle_cow<16, cheap_hash>;
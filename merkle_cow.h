@@ -3,23 +3,43 @@
 
 #include "btree.h"
 #include "biter.h"
+#include "slice.h"
+#include "bloom.h"
+#include "utils.h"
+#include "hash.h"
 #include <boost/iterator/iterator_facade.hpp>
 
 typedef array<char, 32> hash_t;
+class node_file_writer;
 
 // Don't support mutable iterators because proxies annoy me
-class merkle_cow
+// Fanout is the maximum number of entries per node, nodes are kept at least
+// half full.  Hash is a policy from hash.h for leaf and node hashes.
+// merkle_cow.cpp instantiates SHA-256 with powers of two from 4 to 128, and
+// the other hashes with 16.
+template<size_t Fanout, class Hash = sha256_hash>
+class basic_merkle_cow
 {
 private:
 	struct policy {
-		static const size_t min_size = 8;
-		static const size_t max_size = 16;
-		typedef shared_ptr<string> string_ptr_t;
-		typedef string_ptr_t key_t;
-		typedef pair<string_ptr_t, hash_t> value_t;
+		static const size_t min_size = Fanout / 2;
+		static const size_t max_size = Fanout;
+		static const size_t max_steal = 1;
+		// Keys of up to 23 bytes and values of up to 15 are stored inline
+		typedef blob<23> key_t;
+		typedef blob<15> data_t;
+		// Leaf hashes are left as all zeros until a total needs them
+		typedef pair<data_t, hash_t> value_t;
+		// Nodes store the common prefix of their keys once
+		typedef prefix_keys<policy> keys_t;
 		static value_t compute_total(const value_t* vals, size_t count);
-		static bool less(const key_t& a, const key_t& b);
-		static void serialize(writable& out, const key_t& a, const value_t& b);
+		// Compares keys to each other or to slices, so lookups don't build keys
+		template<class A, class B>
+		static bool less(const A& a, const B& b) { return key_t::compare(a.data(), a.size(), b.data(), b.size()) < 0; }
+		static bool leaf_pending(const value_t& v);
+		static void prepare_leaf(const key_t& k, value_t& v);
+		static void serialize_value(writable& out, const value_t& v);
+		static void deserialize_value(readable& in, value_t& v);
         };
 	typedef btree<policy> btree_t;
 	typedef bnode<policy> bnode_t;
@@ -38,53 +58,223 @@ public:
                 boost::bidirectional_traversal_tag>
         {
                 friend class boost::iterator_core_access;
-		friend class merkle_cow;
+		friend class basic_merkle_cow;
 	public:
 		const_iterator() {}
 		void increment() { m_iter.increment(); update(); }
                 void decrement() { m_iter.decrement(); update(); }
 		bool equal(const_iterator const& rhs) const { return m_iter == rhs.m_iter; }
-		const value_type& dereference() const { return m_pair; }
+		const value_type& dereference() const { 
+			if (!m_pair.first && !m_iter.is_end()) {
+				m_pair.first = make_shared<string>(key().str());
+				m_pair.second = make_shared<string>(value().str());
+			}
+			return m_pair; 
+		}
+
+		// The current entry without copying it into strings.  The key is
+		// good until the iterator moves, the value as long as the tree.
+		slice key() const { 
+			if (m_key.is_null()) m_key = m_iter.get_key();
+			return slice(m_key); 
+		}
+		slice value() const { return slice(m_iter.get_value().first); }
 	private:
 		const_iterator(const btree_t& tree)
 			: m_iter(tree.root(), tree.height())
 		{}
 
+		// Entries are only turned into strings or keys on demand
 		void update() {
-			if (m_iter.is_end()) {
-				m_pair = value_type();
-			} else {
-				m_pair.first = m_iter.get_key();
-				m_pair.second = m_iter.get_value().first;
-			}
+			m_pair = value_type();
+			m_key = typename policy::key_t();
 		}
 	
 		biter_t m_iter;
-		value_type m_pair;	
+		mutable value_type m_pair;	
+		mutable typename policy::key_t m_key;  // Null until key() is called
 	};
 	
+	// Make an empty tree
+	basic_merkle_cow() {}
+
 	// Read only iterator style access
 	const_iterator begin() const { 
 		const_iterator it(m_tree); it.m_iter.set_begin(); it.update(); return it; 
 	}
-	const_iterator find(const key_type& key) const { 
+	// Lookups take a slice, so searching needs no key object or allocation
+	const_iterator find(const slice& key) const { 
+		if (!may_contain(key)) return end();
 		const_iterator it(m_tree); it.m_iter.set_find(key); it.update(); return it; 
 	}
-	const_iterator lower_bound(const key_type& key) const { 
+	const_iterator lower_bound(const slice& key) const { 
 		const_iterator it(m_tree); it.m_iter.set_lower_bound(key); it.update(); return it; 
 	}
-	const_iterator upper_bound(const key_type& key) const { 
+	const_iterator upper_bound(const slice& key) const { 
 		const_iterator it(m_tree); it.m_iter.set_upper_bound(key); it.update(); return it; 
 	}
+	const_iterator find(const key_type& key) const { return find(slice(*key)); }
+	const_iterator lower_bound(const key_type& key) const { return lower_bound(slice(*key)); }
+	const_iterator upper_bound(const key_type& key) const { return upper_bound(slice(*key)); }
 	const_iterator end() const { const_iterator it(m_tree); return it; }
 
 	// Set key to value, overwrite as needed, return previous value
 	// Value of emptry string represents 'no-value'
 	mapped_type put(const key_type& key, const mapped_type& value);
 
-	// Get value, empty string means not found
-	string get(const key_type& key) const;
+	// put() for many keys at once, a null value erases.  Nodes shared with
+	// other snapshots are copied once for the whole batch rather than once
+	// per key, nodes on paths shared by several keys most of all, so keys
+	// in order are best.  The result is the same as putting them in turn.
+	void write_batch(const vector<pair<slice, slice>>& writes);
+
+	// Erase every key in [lo, hi), returns the number of keys erased
+	size_t erase_range(const key_type& lo, const key_type& hi) { return m_tree.erase_range(to_key(lo), to_key(hi)); }
+
+	// Keep a bloom_filter of the keys, so most lookups of absent keys
+	// don't descend the tree.  It is built from the current keys, put and
+	// write_batch keep it up to date and rebuild it bigger when it fills,
+	// and copies share it.  Trees made by split_at, join, the set operations and
+	// deserialize start without one.  0 bits per key drops it.
+	void set_filter(size_t bits_per_key = 10);
+	const bloom_filter* filter() const { return m_filter.get(); }
+
+	// Split into the keys before 'key' and the keys at or after it
+	pair<basic_merkle_cow, basic_merkle_cow> split_at(const key_type& key) const { 
+		pair<btree_t, btree_t> r = m_tree.split_at(to_key(key));
+		return pair<basic_merkle_cow, basic_merkle_cow>(basic_merkle_cow(r.first), basic_merkle_cow(r.second));
+	}
+
+	// Join two trees, every key in left must be before every key in right
+	static basic_merkle_cow join(const basic_merkle_cow& left, const basic_merkle_cow& right) {
+		return basic_merkle_cow(btree_t::join(left.m_tree, right.m_tree));
+	}
+
+	// Keys in either tree.  For keys in both, resolver(key, a, b) returns
+	// the value to keep, or null to drop the key.  Pointer identical
+	// subtrees are shared without asking, so it must return the common value
+	// when a and b agree.
+	template<class Resolver>
+	static basic_merkle_cow set_union(const basic_merkle_cow& a, const basic_merkle_cow& b, const Resolver& resolver) {
+		return basic_merkle_cow(btree_t::set_union(a.m_tree, b.m_tree, resolve_wrapper<Resolver>(resolver)));
+	}
+
+	// Keys in both trees, resolver works as in set_union
+	template<class Resolver>
+	static basic_merkle_cow set_intersection(const basic_merkle_cow& a, const basic_merkle_cow& b, const Resolver& resolver) {
+		return basic_merkle_cow(btree_t::set_intersection(a.m_tree, b.m_tree, resolve_wrapper<Resolver>(resolver)));
+	}
+
+	// Keys in a but not in b
+	static basic_merkle_cow set_difference(const basic_merkle_cow& a, const basic_merkle_cow& b) {
+		return basic_merkle_cow(btree_t::set_difference(a.m_tree, b.m_tree));
+	}
+
+	// All of base, with the values in top written over it
+	static basic_merkle_cow overlay(const basic_merkle_cow& base, const basic_merkle_cow& top) {
+		return basic_merkle_cow(btree_t::set_union(base.m_tree, top.m_tree, 
+			[](const typename policy::key_t&, const typename policy::value_t&, const typename policy::value_t& b, 
+				typename policy::value_t& out) { out = b; return true; }));
+	}
+
+	// Get a value without copying it, a null slice means not found.  The
+	// slice points into the tree, see slice.h for how long it lives.
+	slice get(const slice& key) const {
+		if (!may_contain(key)) return slice();
+		const typename policy::value_t* v = m_tree.get(key);
+		return v ? slice(v->first) : slice();
+	}
+
+	// get() for many keys, interleaving the lookups to overlap their cache
+	// misses.  Worth it for batches of more than a few keys.
+	vector<slice> multi_get(const vector<slice>& keys) const {
+		vector<slice> out(keys.size());
+		// Only the keys the filter can't rule out go down the tree
+		vector<slice> look;
+		vector<size_t> where;
+		const vector<slice>* todo = &keys;
+		if (m_filter) {
+			for(size_t i = 0; i < keys.size(); i++) {
+				if (may_contain(keys[i])) {
+					look.push_back(keys[i]);
+					where.push_back(i);
+				}
+			}
+			todo = &look;
+		}
+		vector<const typename policy::value_t*> vals(todo->size());
+		m_tree.multi_get(todo->data(), todo->size(), vals.data());
+		for(size_t i = 0; i < vals.size(); i++)
+			if (vals[i]) out[m_filter ? where[i] : i] = slice(vals[i]->first);
+		return out;
+	}
+
+	// Merkle root of the whole tree, all zeros when empty.  Puts only mark
+	// the changed paths, this hashes every changed node once.
+	hash_t root_hash() const;
+
+	// Hash at most 'budget' changed nodes towards the root, so the work of
+	// root_hash can be spread out.  Returns true once the root is current.
+	// Hashing writes into nodes that copies share, so do it (or call
+	// root_hash) before handing a copy to another thread, not on the copy.
+	bool rehash(size_t budget = SIZE_MAX) const { return m_tree.rehash(budget); }
+
+	// Keep up to 'entries' recent leaf hashes for the calling thread, so
+	// keys that flip between a few values don't rehash them.  0 disables,
+	// which is the default.
+	static void set_hash_cache(size_t entries);
+
+	// What root_hash is built from, for other stores of the same tree (see
+	// paged_merkle_cow): the hash of one entry, a node's hash from its
+	// entries' or children's hashes, and the node sizes that set the shape
+	static hash_t leaf_hash(const slice& key, const slice& value);
+	static hash_t node_hash(const hash_t* hashes, size_t count);
+	// Tells trees hashed differently apart, the first bytes of the hash
+	// of nothing
+	static uint32_t hash_id();
+	static const size_t node_min = policy::min_size;
+	static const size_t node_max = policy::max_size;
+	static const size_t node_max_steal = policy::max_steal;
+
+	// Memory held, pass trees to mem_tracker::add
+	void account(mem_tracker& t) const { m_tree.account(t); }
+
+	// Write out or read back a snapshot of the whole tree.  Call rehash
+	// first, writing doesn't hash.
+	void serialize(writable& out) const { m_tree.serialize(out); }
+	// Write every node to a node file that paged_merkle_cow can read a
+	// node at a time, see paged.h
+	void write_nodes(writable& out) const;
+	void deserialize(readable& in) { m_tree.deserialize(in); m_filter.reset(); }
 	
 private:
+	// Adapts a resolver on public types to one on the tree's own values
+	template<class Resolver>
+	struct resolve_wrapper {
+		resolve_wrapper(const Resolver& resolver) : m_resolver(resolver) {}
+		bool operator()(const typename policy::key_t& k, const typename policy::value_t& a, 
+			const typename policy::value_t& b, typename policy::value_t& out) const {
+			mapped_type va = make_shared<string>(a.first.str());
+			mapped_type vb = make_shared<string>(b.first.str());
+			mapped_type r = m_resolver(make_shared<string>(k.str()), va, vb);
+			if (!r) return false;
+			if (*r == *va) out = a;
+			else if (*r == *vb) out = b;
+			else make_value(out, r->data(), r->size());
+			return true;
+		}
+		const Resolver& m_resolver;
+	};
+
+	explicit basic_merkle_cow(const btree_t& tree) : m_tree(tree) {}
+	bool may_contain(const slice& key) const { 
+		return !m_filter || m_filter->may_contain(fast_hash(key.data(), key.size()));
+	}
+	static void make_value(typename policy::value_t& out, const char* value, size_t value_len);
+	static uint64_t write_node(node_file_writer& w, const bnode_t& n, size_t height);
+	static typename policy::key_t to_key(const key_type& key) { return typename policy::key_t(key->data(), key->size()); }
 	btree_t m_tree;
+	shared_ptr<bloom_filter> m_filter;  // Superset of the keys, if set
 };
+
+typedef basic_merkle_cow<16> merkle_cow;
@@ -0,0 +1,825 @@
+
+#include "paged.h"
+#include <unistd.h>
+#include <sys/stat.h>
+
+static const size_t k_record_header = 8;  // Payload length and CRC
+static const size_t k_node_header = 2 + 32;  // Height, count and hash
+static const size_t k_child = 8 + 8 + 32;  // Offset, count and hash
+static const size_t k_footer = 8 + 8 + 4 + 4 + 4 + 32 + 4 + 4;
+static const size_t k_footer_crc = k_footer - 8;  // Where the CRC goes
+static const char k_magic[4] = { 'M', 'C', 'N', '2' };
+
+paged_node::paged_node(string payload, size_t max_entries)
+	: data(std::move(payload))
+{
+	const char* p = data.data();
+	const char* end = p + data.size();
+	auto need = [&](size_t len) {
+		if (size_t(end - p) < len)
+			throw io_exception("Truncated node");
+	};
+	need(k_node_header);
+	height = uint8_t(p[0]);
+	size_t count = uint8_t(p[1]);
+	if (count > max_entries)
+		throw io_exception("Node too big for the tree");
+	memcpy(hash.data(), p + 2, hash.size());
+	p += k_node_header;
+	for(size_t i = 0; i < count; i++) {
+		need(4);
+		size_t klen = get_u32(p);
+		need(4 + klen);
+		keys.push_back(slice(p + 4, klen));
+		p += 4 + klen;
+		if (height == 0) {
+			need(4);
+			size_t vlen = get_u32(p);
+			need(4 + vlen);
+			values.push_back(slice(p + 4, vlen));
+			p += 4 + vlen;
+		} else {
+			need(k_child);
+			children.push_back(get_u64(p));
+			counts.push_back(get_u64(p + 8));
+			hash_t h;
+			memcpy(h.data(), p + 16, h.size());
+			hashes.push_back(h);
+			p += k_child;
+		}
+	}
+	if (count == 0 || p != end)
+		throw io_exception("Invalid node");
+}
+
+size_t paged_node::bytes() const
+{
+	return sizeof(paged_node) + data.capacity()
+		+ (keys.capacity() + values.capacity()) * sizeof(slice)
+		+ (children.capacity() + counts.capacity()) * sizeof(uint64_t)
+		+ hashes.capacity() * sizeof(hash_t);
+}
+
+static void append_u32(string& s, uint32_t v)
+{
+	char buf[4];
+	put_u32(buf, v);
+	s.append(buf, sizeof(buf));
+}
+
+static void append_u64(string& s, uint64_t v)
+{
+	char buf[8];
+	put_u64(buf, v);
+	s.append(buf, sizeof(buf));
+}
+
+void node_file_writer::begin_node(size_t height, const hash_t& hash)
+{
+	assert(height < 256);
+	m_payload.clear();
+	m_payload += char(height);
+	m_payload += char(0);  // Entries so far
+	m_payload.append(hash.data(), hash.size());
+}
+
+void node_file_writer::add_leaf(const slice& key, const slice& value)
+{
+	assert(m_payload[0] == 0 && uint8_t(m_payload[1]) < 255);
+	append_u32(m_payload, uint32_t(key.size()));
+	m_payload.append(key.data(), key.size());
+	append_u32(m_payload, uint32_t(value.size()));
+	m_payload.append(value.data(), value.size());
+	m_payload[1] = char(uint8_t(m_payload[1]) + 1);
+}
+
+void node_file_writer::add_child(const slice& key, uint64_t offset, uint64_t count, const hash_t& hash)
+{
+	assert(m_payload[0] != 0 && uint8_t(m_payload[1]) < 255);
+	append_u32(m_payload, uint32_t(key.size()));
+	m_payload.append(key.data(), key.size());
+	append_u64(m_payload, offset);
+	append_u64(m_payload, count);
+	m_payload.append(hash.data(), hash.size());
+	m_payload[1] = char(uint8_t(m_payload[1]) + 1);
+}
+
+uint64_t node_file_writer::end_node()
+{
+	char header[k_record_header];
+	put_u32(header, uint32_t(m_payload.size()));
+	put_u32(header + 4, crc32c(0, m_payload.data(), m_payload.size()));
+	m_out.write(header, sizeof(header));
+	m_out.write(m_payload.data(), m_payload.size());
+	uint64_t offset = m_offset;
+	m_offset += sizeof(header) + m_payload.size();
+	return offset;
+}
+
+void node_file_writer::finish(uint64_t root, size_t height, uint64_t size, const hash_t& root_hash)
+{
+	m_out.flush();
+	char footer[k_footer];
+	put_u64(footer, root);
+	put_u64(footer + 8, size);
+	put_u32(footer + 16, uint32_t(height));
+	put_u32(footer + 20, uint32_t(m_fanout));
+	put_u32(footer + 24, m_hash_id);
+	memcpy(footer + 28, root_hash.data(), root_hash.size());
+	put_u32(footer + k_footer_crc, crc32c(0, footer, k_footer_crc));
+	memcpy(footer + k_footer_crc + 4, k_magic, sizeof(k_magic));
+	m_out.write(footer, sizeof(footer));
+	m_offset += sizeof(footer);
+	m_out.flush();
+}
+
+paged_ptr node_cache::find(uint64_t offset)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_entries.find(offset);
+	if (it == m_entries.end()) {
+		m_counters.misses++;
+		return paged_ptr();
+	}
+	m_counters.hits++;
+	entry& e = it->second;
+	if (e.queue == q_main)
+		m_main.splice(m_main.begin(), m_main, e.pos);
+	else if (e.queue == q_in)
+		e.used = true;
+	return e.node;
+}
+
+paged_ptr node_cache::insert(uint64_t offset, const paged_ptr& node)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_entries.find(offset);
+	if (it != m_entries.end())
+		return it->second.node;
+	entry e;
+	e.node = node;
+	e.bytes = node->bytes();
+	e.used = false;
+	auto ghost = m_ghost_pos.find(offset);
+	if (node->height >= m_pin_height) {
+		e.queue = q_pinned;
+		m_counters.pinned_bytes += e.bytes;
+	} else if (ghost != m_ghost_pos.end()) {
+		// Wanted again soon after leaving the FIFO, so it's hot
+		m_ghosts.erase(ghost->second);
+		m_ghost_pos.erase(ghost);
+		m_main.push_front(offset);
+		e.queue = q_main;
+		e.pos = m_main.begin();
+		m_counters.bytes += e.bytes;
+	} else {
+		m_in.push_front(offset);
+		e.queue = q_in;
+		e.pos = m_in.begin();
+		m_in_bytes += e.bytes;
+		m_counters.bytes += e.bytes;
+	}
+	m_entries.emplace(offset, e);
+	m_counters.nodes++;
+	evict();
+	return node;
+}
+
+void node_cache::erase(uint64_t offset)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_entries.find(offset);
+	if (it == m_entries.end())
+		return;
+	entry& e = it->second;
+	if (e.queue == q_pinned) {
+		m_counters.pinned_bytes -= e.bytes;
+	} else {
+		if (e.queue == q_in) {
+			m_in.erase(e.pos);
+			m_in_bytes -= e.bytes;
+		} else {
+			m_main.erase(e.pos);
+		}
+		m_counters.bytes -= e.bytes;
+	}
+	m_entries.erase(it);
+	m_counters.nodes--;
+}
+
+void node_cache::set_pin_height(size_t height)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (height == m_pin_height)
+		return;
+	m_pin_height = height;
+	for(auto& kvp : m_entries) {
+		entry& e = kvp.second;
+		bool pin = e.node->height >= height;
+		if (pin == (e.queue == q_pinned))
+			continue;
+		if (pin) {
+			if (e.queue == q_in) {
+				m_in.erase(e.pos);
+				m_in_bytes -= e.bytes;
+			} else {
+				m_main.erase(e.pos);
+			}
+			m_counters.bytes -= e.bytes;
+			m_counters.pinned_bytes += e.bytes;
+			e.queue = q_pinned;
+		} else {
+			// Was near the top, so likely hot
+			m_counters.pinned_bytes -= e.bytes;
+			m_counters.bytes += e.bytes;
+			m_main.push_front(kvp.first);
+			e.pos = m_main.begin();
+			e.queue = q_main;
+		}
+	}
+	evict();
+}
+
+// Called with the lock held
+void node_cache::evict()
+{
+	while(m_counters.bytes > m_budget) {
+		// The FIFO gives up nodes while over its quarter, the LRU otherwise
+		bool from_in = !m_in.empty() && (m_in_bytes > m_budget / 4 || m_main.empty());
+		std::list<uint64_t>& queue = from_in ? m_in : m_main;
+		uint64_t victim = queue.back();
+		auto it = m_entries.find(victim);
+		entry& e = it->second;
+		if (from_in) {
+			m_in_bytes -= e.bytes;
+			if (e.used) {
+				// Used again while waiting, keep it
+				m_main.splice(m_main.begin(), m_in, e.pos);
+				e.queue = q_main;
+				continue;
+			}
+			m_ghosts.push_front(victim);
+			m_ghost_pos[victim] = m_ghosts.begin();
+		}
+		queue.pop_back();
+		m_counters.bytes -= e.bytes;
+		m_entries.erase(it);
+		m_counters.evictions++;
+		m_counters.nodes--;
+	}
+	// Remember about as many evicted nodes as are cached
+	while(m_ghosts.size() > max(size_t(64), m_entries.size())) {
+		m_ghost_pos.erase(m_ghosts.back());
+		m_ghosts.pop_back();
+	}
+}
+
+node_cache::counters node_cache::stats() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_counters;
+}
+
+dirty_node::dirty_node(const paged_node& n)
+	: height(n.height)
+{
+	for(size_t i = 0; i < n.keys.size(); i++) {
+		keys.push_back(n.keys[i].str());
+		if (height == 0) {
+			values.push_back(n.values[i].str());
+		} else {
+			paged_ref c;
+			c.offset = n.children[i];
+			c.count = n.counts[i];
+			c.hash = n.hashes[i];
+			children.push_back(std::move(c));
+		}
+	}
+}
+
+// The last footer with a good CRC, and the file length up to its end.  A
+// commit torn by a crash leaves nodes, or part of a footer, after it.
+static bool last_footer(int fd, uint64_t file_size, char* footer, uint64_t& end)
+{
+	const size_t k_block = 64 * 1024;
+	string buf;
+	// Footers ending at or before e are still to check, a block at a time
+	uint64_t e = file_size;
+	while(e >= k_footer) {
+		uint64_t lo = e > k_block ? e - k_block : 0;
+		buf.resize(e - lo);
+		pread_exact(fd, &buf[0], buf.size(), lo);
+		for(uint64_t c = e; c >= lo + k_footer; c--) {
+			const char* f = buf.data() + (c - k_footer - lo);
+			if (memcmp(f + k_footer_crc + 4, k_magic, sizeof(k_magic)) == 0
+				&& get_u32(f + k_footer_crc) == crc32c(0, f, k_footer_crc)) {
+				memcpy(footer, f, k_footer);
+				end = c;
+				return true;
+			}
+		}
+		if (lo == 0)
+			break;
+		// Overlap, so a footer across the boundary is seen whole
+		e = lo + k_footer - 1;
+	}
+	return false;
+}
+
+size_t dirty_node::bytes() const
+{
+	size_t r = sizeof(dirty_node) + children.capacity() * sizeof(paged_ref)
+		+ (keys.capacity() + values.capacity()) * sizeof(string);
+	for(size_t i = 0; i < keys.size(); i++)
+		r += keys[i].size() + (height ? 0 : values[i].size());
+	return r;
+}
+
+template<class Tree>
+basic_paged_merkle_cow<Tree>::basic_paged_merkle_cow(int fd, bool owned, size_t cache_bytes, size_t pinned_levels)
+	: m_fd(fd)
+	, m_owned(owned)
+	, m_height(0)
+	, m_size(0)
+	, m_file_size(0)
+	, m_pinned_levels(pinned_levels)
+	, m_cache_bytes(cache_bytes)
+	, m_dirty_bytes(0)
+	, m_changed(false)
+	, m_root_hash()
+	, m_cache(cache_bytes)
+{
+	try {
+		struct stat st;
+		char footer[k_footer];
+		if (fstat(fd, &st) < 0 || (st.st_size && !last_footer(fd, st.st_size, footer, m_file_size)))
+			throw io_exception("Not a node file");
+		if (m_file_size) {
+			if (get_u32(footer + 20) != Tree::node_max || get_u32(footer + 24) != Tree::hash_id())
+				throw io_exception("Node file from a different kind of tree");
+			m_root.offset = get_u64(footer);
+			m_size = get_u64(footer + 8);
+			m_root.count = m_size;
+			m_height = get_u32(footer + 16);
+			memcpy(m_root_hash.data(), footer + 28, m_root_hash.size());
+			m_root.hash = m_root_hash;
+		}
+	} catch(const io_exception&) {
+		if (owned) ::close(fd);
+		throw;
+	}
+	update_pins();
+}
+
+template<class Tree>
+basic_paged_merkle_cow<Tree>::~basic_paged_merkle_cow()
+{
+	if (m_owned)
+		::close(m_fd);
+}
+
+template<class Tree>
+paged_ptr basic_paged_merkle_cow<Tree>::load(uint64_t offset, size_t height) const
+{
+	paged_ptr n = m_cache.find(offset);
+	if (n)
+		return n;
+	char header[k_record_header];
+	if (offset + k_record_header > m_file_size)
+		throw io_exception("Invalid node offset");
+	pread_exact(m_fd, header, sizeof(header), offset);
+	size_t len = get_u32(header);
+	if (offset + sizeof(header) + len > m_file_size)
+		throw io_exception("Invalid node length");
+	string payload(len, '\0');
+	pread_exact(m_fd, &payload[0], len, offset + sizeof(header));
+	if (crc32c(0, payload.data(), len) != get_u32(header + 4))
+		throw io_exception("Node checksum mismatch");
+	auto node = make_shared<const paged_node>(std::move(payload), Tree::node_max);
+	if (node->height != height)
+		throw io_exception("Node at the wrong height");
+	return m_cache.insert(offset, node);
+}
+
+// Changed nodes keep their keys as strings, these search them as the file
+// nodes' slices are searched
+static size_t upper_index(const vector<string>& keys, const slice& key)
+{
+	return std::upper_bound(keys.begin(), keys.end(), key,
+		[](const slice& a, const string& b) { return a < slice(b); }) - keys.begin();
+}
+
+static size_t lower_index(const vector<string>& keys, const slice& key)
+{
+	return std::lower_bound(keys.begin(), keys.end(), key,
+		[](const string& a, const slice& b) { return slice(a) < b; }) - keys.begin();
+}
+
+template<class Tree>
+bool basic_paged_merkle_cow<Tree>::get(const slice& key, string& value) const
+{
+	if (m_height == 0)
+		return false;
+	// Changed nodes are above any unchanged ones
+	const paged_ref* ref = &m_root;
+	size_t height = m_height - 1;
+	for(; ref->dirty; height--) {
+		const dirty_node& d = *ref->dirty;
+		if (height == 0) {
+			size_t i = lower_index(d.keys, key);
+			if (i == d.size() || slice(d.keys[i]) != key)
+				return false;
+			value = d.values[i];
+			return true;
+		}
+		size_t i = upper_index(d.keys, key);
+		if (i == 0)
+			return false;
+		ref = &d.children[i - 1];
+	}
+	paged_ptr n = load(ref->offset, height);
+	while(n->height) {
+		size_t i = std::upper_bound(n->keys.begin(), n->keys.end(), key) - n->keys.begin();
+		if (i == 0)
+			return false;  // Before the first key
+		n = load(n->children[i - 1], n->height - 1);
+	}
+	size_t i = std::lower_bound(n->keys.begin(), n->keys.end(), key) - n->keys.begin();
+	if (i == n->keys.size() || n->keys[i] != key)
+		return false;
+	value = n->values[i].str();
+	return true;
+}
+
+template<class Tree>
+void basic_paged_merkle_cow<Tree>::scan(const slice& from, const function<bool(const slice&, const slice&)>& fn) const
+{
+	if (m_height)
+		scan_ref(m_root, m_height - 1, from, true, fn);
+}
+
+template<class Tree>
+bool basic_paged_merkle_cow<Tree>::scan_ref(const paged_ref& ref, size_t height, const slice& from, bool bounded,
+	const function<bool(const slice&, const slice&)>& fn) const
+{
+	if (!ref.dirty)
+		return scan_node(*load(ref.offset, height), from, bounded, fn);
+	const dirty_node& d = *ref.dirty;
+	if (height == 0) {
+		for(size_t i = bounded ? lower_index(d.keys, from) : 0; i < d.size(); i++) {
+			if (!fn(d.keys[i], d.values[i]))
+				return false;
+		}
+		return true;
+	}
+	size_t start = 0;
+	if (bounded) {
+		start = upper_index(d.keys, from);
+		if (start) start--;
+	}
+	for(size_t i = start; i < d.size(); i++) {
+		if (!scan_ref(d.children[i], height - 1, from, bounded && i == start, fn))
+			return false;
+	}
+	return true;
+}
+
+// Only the leftmost path is bounded by 'from', everything right of it is
+// in range
+template<class Tree>
+bool basic_paged_merkle_cow<Tree>::scan_node(const paged_node& n, const slice& from, bool bounded,
+	const function<bool(const slice&, const slice&)>& fn) const
+{
+	if (n.height == 0) {
+		size_t i = bounded ? std::lower_bound(n.keys.begin(), n.keys.end(), from) - n.keys.begin() : 0;
+		for(; i < n.keys.size(); i++) {
+			if (!fn(n.keys[i], n.values[i]))
+				return false;
+		}
+		return true;
+	}
+	size_t start = 0;
+	if (bounded) {
+		start = std::upper_bound(n.keys.begin(), n.keys.end(), from) - n.keys.begin();
+		if (start) start--;
+	}
+	for(size_t i = start; i < n.children.size(); i++) {
+		if (!scan_node(*load(n.children[i], n.height - 1), from, bounded && i == start, fn))
+			return false;
+	}
+	return true;
+}
+
+template<class Tree>
+bool basic_paged_merkle_cow<Tree>::put(const slice& key, const slice& value)
+{
+	string old;
+	if (get(key, old) && slice(old) == value)
+		return false;
+	update(key, &value);
+	return true;
+}
+
+template<class Tree>
+bool basic_paged_merkle_cow<Tree>::erase(const slice& key)
+{
+	string old;
+	if (!get(key, old))
+		return false;
+	update(key, nullptr);
+	return true;
+}
+
+// The node to change in place of ref's, copied out of the file if it's
+// still there
+template<class Tree>
+dirty_node& basic_paged_merkle_cow<Tree>::edit(paged_ref& ref, size_t height)
+{
+	ref.hashed = false;
+	if (!ref.dirty) {
+		ref.dirty = make_shared<dirty_node>(*load(ref.offset, height));
+		// Once this commits nothing reaches the old copy
+		m_cache.erase(ref.offset);
+		m_dirty_bytes += ref.dirty->bytes();
+	}
+	return *ref.dirty;
+}
+
+// Keys below a changed node
+static uint64_t count_keys(const dirty_node& n)
+{
+	if (n.height == 0)
+		return n.size();
+	uint64_t r = 0;
+	for(const paged_ref& c : n.children)
+		r += c.count;
+	return r;
+}
+
+static paged_ref dirty_ref(const dirty_ptr& n)
+{
+	paged_ref r;
+	r.dirty = n;
+	r.count = count_keys(*n);
+	r.hashed = false;
+	return r;
+}
+
+template<class Tree>
+void basic_paged_merkle_cow<Tree>::update(const slice& key, const slice* value)
+{
+	m_changed = true;
+	if (m_height == 0) {
+		dirty_ptr n = make_shared<dirty_node>(0);
+		n->keys.push_back(key.str());
+		n->values.push_back(value->str());
+		m_dirty_bytes += n->bytes();
+		m_root = dirty_ref(n);
+		m_height = 1;
+		m_size = 1;
+	} else {
+		dirty_node& r = edit(m_root, m_height - 1);
+		dirty_ptr split;
+		switch(update(r, key, value, nullptr, split)) {
+		case ur_insert:
+			m_size++;
+			break;
+		case ur_erase:
+			m_size--;
+			break;
+		case ur_split: {
+			// Root just split, make new root
+			dirty_ptr n = make_shared<dirty_node>(m_height);
+			n->keys.push_back(r.keys[0]);
+			n->keys.push_back(split->keys[0]);
+			n->children.push_back(dirty_ref(m_root.dirty));
+			n->children.push_back(dirty_ref(split));
+			m_dirty_bytes += n->bytes();
+			m_root = dirty_ref(n);
+			m_height++;
+			m_size++;
+			break;
+		}
+		case ur_singular: {
+			// Down to one child, which becomes the root
+			paged_ref child = r.children[0];
+			m_root = child;
+			m_height--;
+			m_size--;
+			break;
+		}
+		case ur_empty:
+			m_root = paged_ref();
+			m_height = 0;
+			m_size = 0;
+			break;
+		default:
+			break;
+		}
+		m_root.count = m_size;
+	}
+	update_pins();
+	if (m_dirty_bytes > m_cache_bytes)
+		commit();
+}
+
+// Move from's entries [first, last) into to at 'at'
+template<class T>
+static void move_range(vector<T>& from, size_t first, size_t last, vector<T>& to, size_t at)
+{
+	to.insert(to.begin() + at, std::make_move_iterator(from.begin() + first),
+		std::make_move_iterator(from.begin() + last));
+	from.erase(from.begin() + first, from.begin() + last);
+}
+
+static void move_entries(dirty_node& from, size_t first, size_t last, dirty_node& to, size_t at)
+{
+	move_range(from.keys, first, last, to.keys, at);
+	if (from.height == 0)
+		move_range(from.values, first, last, to.values, at);
+	else
+		move_range(from.children, first, last, to.children, at);
+}
+
+template<class Tree>
+typename basic_paged_merkle_cow<Tree>::update_result basic_paged_merkle_cow<Tree>::update(dirty_node& n, const slice& key,
+	const slice* value, paged_ref* peer, dirty_ptr& split)
+{
+	if (n.height == 0) {
+		// put and erase skip updates that change nothing
+		size_t i = lower_index(n.keys, key);
+		bool exists = i < n.size() && slice(n.keys[i]) == key;
+		if (!value) {
+			assert(exists);
+			n.keys.erase(n.keys.begin() + i);
+			n.values.erase(n.values.begin() + i);
+			return erase_fixup(n, peer);
+		}
+		if (exists) {
+			n.values[i] = value->str();
+			return ur_modify;
+		}
+		n.keys.insert(n.keys.begin() + i, key.str());
+		n.values.insert(n.values.begin() + i, value->str());
+		m_dirty_bytes += 2 * sizeof(string) + key.size() + value->size();
+		split = maybe_split(n);
+		return split ? ur_split : ur_insert;
+	}
+	// The child the update goes to, and the next one over as its peer
+	size_t i = upper_index(n.keys, key);
+	if (i) i--;
+	size_t pi = bnode_peer(i, n.size());
+	dirty_ptr overflow;
+	update_result r = update(edit(n.children[i], n.height - 1), key, value, &n.children[pi], overflow);
+	if (r == ur_merge) {
+		// Everything moved into the peer, drop the child
+		n.children[pi].count = count_keys(*n.children[pi].dirty);
+		n.keys[pi] = n.children[pi].dirty->keys[0];
+		n.keys.erase(n.keys.begin() + i);
+		n.children.erase(n.children.begin() + i);
+		return erase_fixup(n, peer);
+	}
+	n.children[i].count = count_keys(*n.children[i].dirty);
+	n.keys[i] = n.children[i].dirty->keys[0];
+	if (r == ur_split) {
+		n.keys.insert(n.keys.begin() + i + 1, overflow->keys[0]);
+		n.children.insert(n.children.begin() + i + 1, dirty_ref(overflow));
+		split = maybe_split(n);
+		return split ? ur_split : ur_insert;
+	}
+	if (r == ur_steal) {
+		n.children[pi].count = count_keys(*n.children[pi].dirty);
+		n.keys[pi] = n.children[pi].dirty->keys[0];
+		return ur_erase;
+	}
+	return r;
+}
+
+template<class Tree>
+dirty_ptr basic_paged_merkle_cow<Tree>::maybe_split(dirty_node& n)
+{
+	if (n.size() <= Tree::node_max)
+		return dirty_ptr();
+	dirty_ptr r = make_shared<dirty_node>(n.height);
+	move_entries(n, bnode_split_keep(n.size()), n.size(), *r, 0);
+	m_dirty_bytes += sizeof(dirty_node);
+	return r;
+}
+
+template<class Tree>
+typename basic_paged_merkle_cow<Tree>::update_result basic_paged_merkle_cow<Tree>::erase_fixup(dirty_node& n, paged_ref* peer)
+{
+	if (n.size() >= Tree::node_min)
+		return ur_erase;
+	// The root has no peer
+	if (!peer) {
+		if (n.size() == 0)
+			return ur_empty;
+		if (n.height != 0 && n.size() == 1)
+			return ur_singular;
+		return ur_erase;
+	}
+	dirty_node& p = edit(*peer, n.height);
+	bool peer_first = slice(p.keys[0]) < slice(n.keys[0]);
+	if (p.size() > Tree::node_min) {
+		size_t count = bnode_steal_count(Tree::node_max_steal, n.size(), p.size());
+		if (peer_first)
+			move_entries(p, p.size() - count, p.size(), n, 0);
+		else
+			move_entries(p, 0, count, n, n.size());
+		return ur_steal;
+	}
+	// Merge into the peer
+	if (peer_first)
+		move_entries(n, 0, n.size(), p, p.size());
+	else
+		move_entries(n, 0, n.size(), p, 0);
+	return ur_merge;
+}
+
+// Children first, each changed node once
+template<class Tree>
+void basic_paged_merkle_cow<Tree>::hash_ref(paged_ref& ref)
+{
+	if (ref.hashed)
+		return;
+	dirty_node& n = *ref.dirty;
+	hash_t hashes[Tree::node_max];
+	for(size_t i = 0; i < n.size(); i++) {
+		if (n.height == 0) {
+			hashes[i] = Tree::leaf_hash(n.keys[i], n.values[i]);
+		} else {
+			hash_ref(n.children[i]);
+			hashes[i] = n.children[i].hash;
+		}
+	}
+	ref.hash = Tree::node_hash(hashes, n.size());
+	ref.hashed = true;
+}
+
+template<class Tree>
+const hash_t& basic_paged_merkle_cow<Tree>::root_hash()
+{
+	if (m_height == 0) {
+		m_root_hash = hash_t();
+	} else {
+		hash_ref(m_root);
+		m_root_hash = m_root.hash;
+	}
+	return m_root_hash;
+}
+
+// Children first, so the parent can record where they went.  Written nodes
+// go to the cache as if just loaded.
+template<class Tree>
+void basic_paged_merkle_cow<Tree>::write_ref(node_file_writer& w, paged_ref& ref)
+{
+	if (!ref.dirty)
+		return;
+	dirty_node& n = *ref.dirty;
+	for(paged_ref& c : n.children)
+		write_ref(w, c);
+	w.begin_node(n.height, ref.hash);
+	for(size_t i = 0; i < n.size(); i++) {
+		if (n.height == 0)
+			w.add_leaf(n.keys[i], n.values[i]);
+		else
+			w.add_child(n.keys[i], n.children[i].offset, n.children[i].count, n.children[i].hash);
+	}
+	ref.offset = w.end_node();
+	m_cache.insert(ref.offset, make_shared<const paged_node>(w.payload(), Tree::node_max));
+	ref.dirty.reset();
+}
+
+template<class Tree>
+void basic_paged_merkle_cow<Tree>::commit()
+{
+	if (!m_changed)
+		return;
+	root_hash();
+	// Cut off whatever a torn commit left after the last footer
+	if (ftruncate(m_fd, m_file_size) < 0 || lseek(m_fd, m_file_size, SEEK_SET) < 0)
+		throw io_exception("Unable to append to node file");
+	fd_writer out(m_fd, false);
+	node_file_writer w(out, Tree::node_max, Tree::hash_id(), m_file_size);
+	write_ref(w, m_root);
+	w.finish(m_height ? m_root.offset : 0, m_height, m_size, m_root_hash);
+	m_file_size = w.offset();
+	m_dirty_bytes = 0;
+	m_changed = false;
+}
+
+template<class Tree>
+void basic_paged_merkle_cow<Tree>::update_pins()
+{
+	m_cache.set_pin_height(m_height > m_pinned_levels ? m_height - m_pinned_levels : 0);
+}
+
+template class basic_paged_merkle_cow<basic_merkle_cow<4>>;
+template class basic_paged_merkle_cow<basic_merkle_cow<8>>;
+template class basic_paged_merkle_cow<basic_merkle_cow<16>>;
+template class basic_paged_merkle_cow<basic_merkle_cow<32>>;
+template class basic_paged_merkle_cow<basic_merkle_cow<64>>;
+template class basic_paged_merkle_cow<basic_merkle_cow<128>>;
+template class basic_paged_merkle_cow<basic_merkle_cow<16, blake3_hash>>;
+template class basic_paged_merkle_cow<basic_merkle_cow<16, cheap_hash>>;
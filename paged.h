@@ -0,0 +1,241 @@
+#pragma once
+
+#include "merkle_cow.h"
+#include <list>
+#include <mutex>
+
+// merkle_cow trees in a node file, for state bigger than RAM.
+// merkle_cow::write_nodes writes every node, children before parents, and
+// paged_merkle_cow reads them back on demand through a node_cache with a
+// byte budget.  Inner nodes refer to their children by file offset, so a
+// child is only loaded when a lookup reaches it.  paged_merkle_cow can also
+// start from an empty file and take puts and erases, appending the nodes
+// they change, so the tree never has to be in memory as a whole.
+//
+// Each node is a record of u32 payload length and u32 CRC32C of the
+// payload.  The payload is u8 height (0 for leaves), u8 entry count (at
+// most the tree's fanout) and the node's 32 byte hash, then per entry a u32
+// key length and the key, then for leaves a u32 value length and the
+// value, or for inner nodes the child's u64 offset, u64 key count and 32
+// byte hash.  The file ends with a footer of u64 root offset, u64 key
+// count, u32 height, u32 fanout, u32 hash id (see merkle_cow::hash_id),
+// the root hash, u32 CRC32C of the footer before it and the magic "MCN2".
+// All integers are little endian.
+//
+// Each commit appends the nodes it changed, syncs, then appends another
+// footer and syncs again.  The last footer with a good CRC is the tree, so
+// a commit torn by a crash leaves the file as the commit before it left
+// it, and the next commit cuts the torn tail off.  Nodes no footer reaches
+// any more are left where they are.
+
+// A node as read from the file, the slices point into data
+struct paged_node
+{
+	size_t height;
+	hash_t hash;
+	string data;  // The record payload
+	vector<slice> keys;
+	vector<slice> values;  // Leaves only
+	vector<uint64_t> children;  // Inner nodes only, file offsets
+	vector<uint64_t> counts;  // Keys below each child
+	vector<hash_t> hashes;  // Of each child
+
+	// Parses a record payload, throws io_exception if it's malformed or
+	// has more than max_entries entries
+	paged_node(string payload, size_t max_entries);
+	paged_node(const paged_node&) = delete;
+	// Memory held, what the cache budget counts
+	size_t bytes() const;
+};
+typedef shared_ptr<const paged_node> paged_ptr;
+
+// Writes a node file, see write_nodes
+class node_file_writer
+{
+public:
+	// For a tree of the given fanout and hash_id.  offset is where out
+	// starts in the file, when appending to one.
+	node_file_writer(writable& out, size_t fanout, uint32_t hash_id, uint64_t offset = 0)
+		: m_out(out), m_fanout(fanout), m_hash_id(hash_id), m_offset(offset) {}
+	void begin_node(size_t height, const hash_t& hash);
+	void add_leaf(const slice& key, const slice& value);
+	void add_child(const slice& key, uint64_t offset, uint64_t count, const hash_t& hash);
+	// Writes the node, returns its offset
+	uint64_t end_node();
+	// The record payload of the last node written
+	const string& payload() const { return m_payload; }
+	// Bytes written, including the starting offset
+	uint64_t offset() const { return m_offset; }
+	// Flushes the nodes, then writes the footer and flushes again, so the
+	// footer can't reach the disk before the nodes it points to
+	void finish(uint64_t root, size_t height, uint64_t size, const hash_t& root_hash);
+
+private:
+	writable& m_out;
+	size_t m_fanout;
+	uint32_t m_hash_id;
+	uint64_t m_offset;  // Bytes written
+	string m_payload;
+};
+
+// Nodes by file offset, kept within a byte budget with 2Q replacement
+// (Johnson and Shasha, VLDB '94).  New nodes wait in a FIFO holding a
+// quarter of the budget.  Only nodes used again, while in it or soon after
+// leaving it, move to the main LRU, so a scan that reads each node once
+// can't flush the hot set.  Nodes at or above the pin height are pinned,
+// never evicted and don't count against the budget.  Nodes handed out
+// stay valid after eviction, the cache only drops its reference.
+class node_cache
+{
+public:
+	struct counters
+	{
+		size_t hits = 0;
+		size_t misses = 0;
+		size_t evictions = 0;
+		size_t bytes = 0;  // Unpinned nodes held
+		size_t pinned_bytes = 0;
+		size_t nodes = 0;
+	};
+
+	node_cache(size_t budget) : m_budget(budget), m_pin_height(SIZE_MAX) {}
+	// The node, or null if it isn't cached
+	paged_ptr find(uint64_t offset);
+	// Add a node just loaded, returns the cached one if another thread
+	// added it first
+	paged_ptr insert(uint64_t offset, const paged_ptr& node);
+	// Drop a node, pinned or not, that the tree no longer reaches
+	void erase(uint64_t offset);
+	// Pin nodes at or above height from now on, and pin or unpin the
+	// cached ones to match, as the tree grows or shrinks
+	void set_pin_height(size_t height);
+	counters stats() const;
+
+private:
+	enum queue_t { q_in, q_main, q_pinned };
+	struct entry
+	{
+		paged_ptr node;
+		size_t bytes;
+		queue_t queue;
+		bool used;  // Hit while in m_in
+		std::list<uint64_t>::iterator pos;  // In m_in or m_main
+	};
+	void evict();
+
+	size_t m_budget;
+	size_t m_pin_height;
+	mutable std::mutex m_mutex;
+	unordered_map<uint64_t, entry> m_entries;
+	std::list<uint64_t> m_in;  // Seen once, newest first
+	size_t m_in_bytes = 0;
+	std::list<uint64_t> m_main;  // Seen again, most recent first
+	std::list<uint64_t> m_ghosts;  // Recently evicted from m_in, newest first
+	unordered_map<uint64_t, std::list<uint64_t>::iterator> m_ghost_pos;
+	counters m_counters;
+};
+
+// A node changed since the last commit, held in memory until commit
+// writes it out
+struct dirty_node;
+typedef shared_ptr<dirty_node> dirty_ptr;
+
+// A child as its parent sees it, in the file or changed and in memory
+struct paged_ref
+{
+	uint64_t offset = 0;
+	dirty_ptr dirty;  // Null once written
+	uint64_t count = 0;  // Keys below
+	hash_t hash = {};
+	bool hashed = true;  // hash is current, dirty nodes start out stale
+};
+
+struct dirty_node
+{
+	explicit dirty_node(size_t h) : height(h) {}
+	// A copy to change of a node from the file
+	explicit dirty_node(const paged_node& n);
+	size_t height;
+	vector<string> keys;
+	vector<string> values;  // Leaves only
+	vector<paged_ref> children;  // Inner nodes only
+	size_t size() const { return keys.size(); }
+	// Roughly the memory held, what the commit threshold counts
+	size_t bytes() const;
+};
+
+// A Tree (some basic_merkle_cow) in a node file that Tree::write_nodes
+// or an earlier commit wrote.  The top pinned_levels levels stay in memory
+// once loaded, everything else shares cache_bytes.  Puts and erases change
+// copies of the nodes along their path in memory, with Tree's splits,
+// steals and merges (see bnode_peer), so both give the same root_hash for
+// the same updates.  commit writes the changed nodes out.  Const methods
+// can run on several threads at once, the others need the tree to
+// themselves.
+template<class Tree>
+class basic_paged_merkle_cow
+{
+public:
+	// An empty file is an empty tree, for building one up with puts.
+	// Throws io_exception if the file holds some other kind of tree.
+	basic_paged_merkle_cow(int fd, bool owned, size_t cache_bytes, size_t pinned_levels = 2);
+	~basic_paged_merkle_cow();
+
+	size_t size() const { return m_size; }
+	size_t height() const { return m_height; }
+	// Hashes changed nodes as needed, which commit then writes out
+	const hash_t& root_hash();
+
+	// Value of key, false if it's absent
+	bool get(const slice& key, string& value) const;
+	// Calls fn(key, value) in key order from the first key at or after
+	// 'from', until fn returns false or the keys run out
+	void scan(const slice& from, const function<bool(const slice&, const slice&)>& fn) const;
+
+	// Set key to value, false if it already had that value.  Reads see the
+	// change at once, once changed nodes hold more than cache_bytes they
+	// are committed.
+	bool put(const slice& key, const slice& value);
+	// Remove key, false if it was absent
+	bool erase(const slice& key);
+	// Append the changed nodes and a footer, syncing after each.
+	// Reopening the file gets the tree as of the last commit to finish.
+	void commit();
+	// Memory held by changed nodes, roughly
+	size_t dirty_bytes() const { return m_dirty_bytes; }
+
+	node_cache::counters cache_stats() const { return m_cache.stats(); }
+
+private:
+	paged_ptr load(uint64_t offset, size_t height) const;
+	bool scan_ref(const paged_ref& ref, size_t height, const slice& from, bool bounded,
+		const function<bool(const slice&, const slice&)>& fn) const;
+	bool scan_node(const paged_node& n, const slice& from, bool bounded,
+		const function<bool(const slice&, const slice&)>& fn) const;
+	// Updates follow bnode::update, value is null to erase
+	enum update_result { ur_modify, ur_insert, ur_erase, ur_split, ur_steal, ur_merge, ur_singular, ur_empty };
+	dirty_node& edit(paged_ref& ref, size_t height);
+	void update(const slice& key, const slice* value);
+	update_result update(dirty_node& n, const slice& key, const slice* value, paged_ref* peer, dirty_ptr& split);
+	update_result erase_fixup(dirty_node& n, paged_ref* peer);
+	dirty_ptr maybe_split(dirty_node& n);
+	void hash_ref(paged_ref& ref);
+	void write_ref(node_file_writer& w, paged_ref& ref);
+	// Pin the top m_pinned_levels levels of the tree as it is now
+	void update_pins();
+
+	int m_fd;
+	bool m_owned;
+	paged_ref m_root;
+	size_t m_height;
+	size_t m_size;
+	uint64_t m_file_size;
+	size_t m_pinned_levels;
+	size_t m_cache_bytes;
+	size_t m_dirty_bytes;
+	bool m_changed;  // Since the last commit
+	hash_t m_root_hash;
+	mutable node_cache m_cache;
+};
+
+typedef basic_paged_merkle_cow<merkle_cow> paged_merkle_cow;
@@ -1,18 +1,88 @@
 
 #include "ptree.h"
+#include "stats.h"
 
 const digest k_empty;
 
-ptree_branch::ptree_branch(uint32_t split_pos, const ptree_ptr& p1, const ptree_ptr& p2)
-	: m_branches{ 
+template<class Hash>
+const typename basic_ptree_node<Hash>::digest_t basic_ptree_node<Hash>::k_empty;
+
+template<class Hash>
+const typename basic_ptree_node<Hash>::digest_t& basic_ptree_node<Hash>::merkle() const
+{
+	if (m_dirty) {
+		size_t budget = SIZE_MAX;
+		rehash(budget);
+	}
+	return m_merkle;
+}
+
+// Keys at or below n
+template<class Hash>
+static size_t count_of(const basic_ptree_node<Hash>* n)
+{
+	return n->is_leaf() ? 1 : static_cast<const basic_ptree_branch<Hash>*>(n)->count();
+}
+
+template<class Hash>
+basic_ptree_branch<Hash>::basic_ptree_branch(uint32_t split_pos, const ptr_t& p1, const ptr_t& p2)
+	: node_t(false)
+	, m_branches{ 
 		p1->prefix() < p2->prefix() ? p1 : p2, 
 		p1->prefix() < p2->prefix() ? p2 : p1 }
-	, m_prefix(m_branches[0]->prefix())
 	, m_split_pos(split_pos)
-	, m_merkle(m_branches[0]->merkle(), m_branches[1]->merkle())
-{}
+	, m_prefix(m_branches[0]->prefix())
+	, m_count(count_of(p1.get()) + count_of(p2.get()))
+{
+	STAT_INC(stat_ptree_alloc);
+}
+
+template<class Hash>
+basic_ptree_branch<Hash>::~basic_ptree_branch()
+{
+	reclaim_retire(std::move(m_branches[0]));
+	reclaim_retire(std::move(m_branches[1]));
+}
+
+template<class Hash>
+bool basic_ptree_branch<Hash>::rehash(size_t& budget) const
+{
+	if (!m_dirty)
+		return true;
+	for(const ptr_t& b : m_branches) {
+		if (b->dirty() && !b->rehash(budget))
+			return false;
+	}
+	if (budget == 0)
+		return false;
+	budget--;
+	m_merkle = digest_t(m_branches[0]->merkle(), m_branches[1]->merkle());
+	m_dirty = false;
+	return true;
+}
+
+template<class Hash>
+void basic_ptree_branch<Hash>::account(mem_tracker& t) const
+{
+	mem_usage own;
+	own.nodes = 1;
+	own.node_bytes = sizeof(basic_ptree_branch);
+	own.control_bytes = mem_tracker::k_control_bytes;
+	if (!t.visit(this, own))
+		return;
+	m_branches[0]->account(t);
+	m_branches[1]->account(t);
+}
+
+template<class Hash>
+void basic_ptree_branch<Hash>::key_hashes(vector<uint64_t>& out) const
+{
+	m_branches[0]->key_hashes(out);
+	m_branches[1]->key_hashes(out);
+}
 
-const digest& ptree_branch::get(const digest& key) const
+template<class Hash>
+const typename basic_ptree_branch<Hash>::digest_t& basic_ptree_branch<Hash>::get(const digest_t& key) const
 {
 	// See if I match prefix
 	uint32_t match_len = m_prefix.first_diff(key);
@@ -23,32 +93,44 @@ const digest& ptree_branch::get(const digest& key) const
 	return m_branches[key.get_bit(m_split_pos)]->get(key);
 }
 
-ptree_ptr ptree_branch::set(const digest& key, const digest& value) const
+template<class Hash>
+const basic_ptree_node<Hash>* basic_ptree_branch<Hash>::step(const digest_t& key, const digest_t*& out) const
 {
+	if (m_prefix.first_diff(key) < m_split_pos) {
+		out = &k_empty;
+		return nullptr;
+	}
+	return m_branches[key.get_bit(m_split_pos)].get();
+}
+
+template<class Hash>
+typename basic_ptree_branch<Hash>::ptr_t basic_ptree_branch<Hash>::set(const digest_t& key, const digest_t& value) const
+{
+	STAT_INC(stat_ptree_set);
 	// See if I match prefix
 	uint32_t match_len = m_prefix.first_diff(key);
 	if (match_len < m_split_pos) {
 		// If it's an erase, not found, return unchanged
 		if (value == k_empty) {
-			return shared_from_this();
+			return this->shared_from_this();
 		}
 
 		// Looks like a need to split further
-		return make_shared<ptree_branch>(
+		return make_node<basic_ptree_branch>(
 			match_len,
-			shared_from_this(), 
-			make_shared<ptree_leaf>(key, value));
+			this->shared_from_this(), 
+			make_node<basic_ptree_leaf<Hash>>(key, value));
 	}
 
 	// Determine which way to go
 	uint32_t dir = key.get_bit(m_split_pos);
 
 	// Recurse on down
-	ptree_ptr new_branch = m_branches[dir]->set(key, value);
+	ptr_t new_branch = m_branches[dir]->set(key, value);
 
 	// If no change, return self
 	if (new_branch.get() == m_branches[dir].get()) {
-		return shared_from_this();
+		return this->shared_from_this();
 	}
 
 	// If null, must have been a delete, return other branch
@@ -57,16 +139,51 @@ ptree_ptr ptree_branch::set(const digest& key, const digest& value) const
 	}
 
 	// Return new copy
-	return make_shared<ptree_branch>(m_split_pos, m_branches[1-dir], new_branch);
+	return make_node<basic_ptree_branch>(m_split_pos, m_branches[1-dir], new_branch);
 }
 
-ptree_leaf::ptree_leaf(const digest& key, const digest& value) 
-	: m_key(key)
+template<class Hash>
+basic_ptree_leaf<Hash>::basic_ptree_leaf(const digest_t& key, const digest_t& value) 
+	: node_t(true)
+	, m_key(key)
 	, m_value(value)
-	, m_merkle(key, value)
-{}
+{
+	STAT_INC(stat_ptree_alloc);
+}
+
+template<class Hash>
+bool basic_ptree_leaf<Hash>::rehash(size_t& budget) const
+{
+	if (!m_dirty)
+		return true;
+	if (budget == 0)
+		return false;
+	budget--;
+	m_merkle = digest_t(m_key, m_value);
+	m_dirty = false;
+	return true;
+}
  
-const digest& ptree_leaf::get(const digest& key) const
+template<class Hash>
+void basic_ptree_leaf<Hash>::account(mem_tracker& t) const
+{
+	mem_usage own;
+	own.nodes = 1;
+	own.node_bytes = sizeof(basic_ptree_leaf);
+	own.control_bytes = mem_tracker::k_control_bytes;
+	own.key_bytes = sizeof(m_key);
+	own.value_bytes = sizeof(m_value);
+	t.visit(this, own);
+}
+
+template<class Hash>
+void basic_ptree_leaf<Hash>::key_hashes(vector<uint64_t>& out) const
+{
+	out.push_back(m_key.hash64());
+}
+
+template<class Hash>
+const typename basic_ptree_leaf<Hash>::digest_t& basic_ptree_leaf<Hash>::get(const digest_t& key) const
 {
 	if (key != m_key) {
 		return k_empty; // Missed, return empty
@@ -74,53 +191,306 @@ const digest& ptree_leaf::get(const digest& key) const
 	return m_value;
 }
 
-ptree_ptr ptree_leaf::set(const digest& key, const digest& value) const
+template<class Hash>
+const basic_ptree_node<Hash>* basic_ptree_leaf<Hash>::step(const digest_t& key, const digest_t*& out) const
+{
+	out = (key == m_key ? &m_value : &k_empty);
+	return nullptr;
+}
+
+template<class Hash>
+typename basic_ptree_leaf<Hash>::ptr_t basic_ptree_leaf<Hash>::set(const digest_t& key, const digest_t& value) const
 {
 	if (key == m_key) {
 		// Found the node in question
 		if (value == k_empty) {
 			// It's an erase, return null
-			return ptree_ptr();
+			return ptr_t();
 		}
 		// Return a newly created node
-		return make_shared<ptree_leaf>(key, value);
+		return make_node<basic_ptree_leaf>(key, value);
 	}
 	// No match, if erase, return self
 	if (value == k_empty) {
-		return shared_from_this();
+		return this->shared_from_this();
 	}
 	// Otherwise, split and return 
 	uint32_t match_len = m_key.first_diff(key);
-	return make_shared<ptree_branch>(
+	return make_node<basic_ptree_branch<Hash>>(
 		match_len,
-		shared_from_this(), 
-		make_shared<ptree_leaf>(key, value));
+		this->shared_from_this(), 
+		make_node<basic_ptree_leaf>(key, value));
 }
 
-const digest& ptree::merkle() const
+template<class Hash>
+const typename basic_ptree<Hash>::digest_t& basic_ptree<Hash>::merkle() const
 {
 	if (!m_root) {
-		return k_empty;
+		return node_t::k_empty;
 	}
 	return m_root->merkle();
 }
 
-const digest& ptree::get(const digest& key) const
+template<class Hash>
+bool basic_ptree<Hash>::rehash(size_t budget) const
 {
-	if (!m_root) {
-		return k_empty;
+	return !m_root || m_root->rehash(budget);
+}
+
+template<class Hash>
+void basic_ptree<Hash>::account(mem_tracker& t) const
+{
+	if (m_root)
+		m_root->account(t);
+}
+
+template<class Hash>
+const typename basic_ptree<Hash>::digest_t& basic_ptree<Hash>::get(const digest_t& key) const
+{
+	if (!m_root || !may_contain(key)) {
+		return node_t::k_empty;
 	}
 	return m_root->get(key);
 }
 
-void ptree::set(const digest& key, const digest& value)
+template<class Hash>
+vector<typename basic_ptree<Hash>::digest_t> basic_ptree<Hash>::multi_get(const vector<digest_t>& keys) const
+{
+	vector<digest_t> out(keys.size());
+	if (!m_root)
+		return out;
+	const size_t group = 16;
+	const node_t* cur[group];
+	const digest_t* found[group];
+	for(size_t base = 0; base < keys.size(); base += group) {
+		size_t n = min(group, keys.size() - base);
+		size_t active = n;
+		for(size_t i = 0; i < n; i++) {
+			cur[i] = m_root.get();
+			if (!may_contain(keys[base + i])) {
+				cur[i] = nullptr;
+				found[i] = &node_t::k_empty;
+				active--;
+			}
+		}
+		// Round robin until every lookup is done
+		while(active) {
+			for(size_t i = 0; i < n; i++) {
+				if (!cur[i])
+					continue;
+				cur[i] = cur[i]->step(keys[base + i], found[i]);
+				if (cur[i]) {
+					// Nodes are a couple of cache lines
+					__builtin_prefetch(cur[i]);
+					__builtin_prefetch((const char*) cur[i] + 64);
+				} else {
+					active--;
+				}
+			}
+		}
+		for(size_t i = 0; i < n; i++)
+			out[base + i] = *found[i];
+	}
+	return out;
+}
+
+template<class Hash>
+void basic_ptree<Hash>::set(const digest_t& key, const digest_t& value)
 {
+	STAT_TIMER(timer_ptree_set);
 	if (!m_root) {
-		if (value != k_empty) {
-			m_root = make_shared<ptree_leaf>(key, value);
+		if (value != node_t::k_empty) {
+			m_root = make_node<basic_ptree_leaf<Hash>>(key, value);
 		}
+	} else {
+		m_root = m_root->set(key, value);
+	}
+	if (m_filter && value != node_t::k_empty) {
+		// Overwrites count as inserts too, so this rebuilds a little early
+		m_filter->insert(key.hash64());
+		if (m_filter->full())
+			set_filter(m_filter->bits_per_key());
+	}
+}
+
+template<class Hash>
+void basic_ptree<Hash>::set_filter(size_t bits_per_key)
+{
+	m_filter.reset();
+	if (bits_per_key == 0)
 		return;
+	vector<uint64_t> hashes;
+	if (m_root)
+		m_root->key_hashes(hashes);
+	// Room to double before the next rebuild
+	auto f = make_shared<bloom_filter>(max(size_t(1024), 2 * hashes.size()), bits_per_key);
+	for(uint64_t h : hashes)
+		f->insert(h);
+	m_filter = f;
+}
+
+template<class Hash>
+void basic_ptree_cursor<Hash>::start(const typename node_t::ptr_t& root)
+{
+	m_root = root;
+	m_depth = 0;
+	m_floor = 0;
+	push(root.get());
+}
+
+template<class Hash>
+void basic_ptree_cursor<Hash>::leftmost()
+{
+	const node_t* n = m_path[m_depth - 1];
+	while(!n->is_leaf()) {
+		n = static_cast<const branch_t*>(n)->m_branches[0].get();
+		push(n);
+	}
+}
+
+template<class Hash>
+void basic_ptree_cursor<Hash>::skip()
+{
+	// Climb until we come up out of a left branch, then take the right one
+	while(m_depth - 1 > m_floor) {
+		const node_t* child = m_path[--m_depth];
+		const branch_t* parent = static_cast<const branch_t*>(m_path[m_depth - 1]);
+		if (parent->m_branches[0].get() == child) {
+			push(parent->m_branches[1].get());
+			leftmost();
+			return;
+		}
+	}
+	m_depth = 0;
+}
+
+template<class Hash>
+void basic_ptree_cursor<Hash>::next()
+{
+	assert(valid());
+	skip();
+}
+
+template<class Hash>
+size_t basic_ptree<Hash>::size() const
+{
+	return m_root ? count_of(m_root.get()) : 0;
+}
+
+template<class Hash>
+typename basic_ptree<Hash>::cursor basic_ptree<Hash>::begin() const
+{
+	cursor c;
+	if (m_root) {
+		c.start(m_root);
+		c.leftmost();
+	}
+	return c;
+}
+
+template<class Hash>
+typename basic_ptree<Hash>::cursor basic_ptree<Hash>::lower_bound(const digest_t& key) const
+{
+	cursor c;
+	if (!m_root)
+		return c;
+	c.start(m_root);
+	while(true) {
+		const node_t* n = c.m_path[c.m_depth - 1];
+		uint32_t diff = n->prefix().first_diff(key);
+		if (n->is_leaf() || diff < static_cast<const basic_ptree_branch<Hash>*>(n)->m_split_pos) {
+			// key leaves this subtree at bit diff, so it comes before all
+			// of it or after all of it
+			if (diff == 256 || key.get_bit(diff) == 0)
+				c.leftmost();
+			else
+				c.skip();
+			return c;
+		}
+		const basic_ptree_branch<Hash>* b = static_cast<const basic_ptree_branch<Hash>*>(n);
+		c.push(b->m_branches[key.get_bit(b->m_split_pos)].get());
+	}
+}
+
+template<class Hash>
+const basic_ptree_node<Hash>* basic_ptree<Hash>::find_prefix(const digest_t& key, uint32_t bits, basic_ptree_cursor<Hash>* path) const
+{
+	assert(bits <= 256);
+	const node_t* n = m_root.get();
+	while(n) {
+		if (path)
+			path->push(n);
+		uint32_t diff = n->prefix().first_diff(key);
+		if (n->is_leaf())
+			return diff >= bits ? n : nullptr;
+		const basic_ptree_branch<Hash>* b = static_cast<const basic_ptree_branch<Hash>*>(n);
+		if (diff < min(b->m_split_pos, bits))
+			return nullptr;
+		// Everything below shares more than 'bits' bits
+		if (b->m_split_pos >= bits)
+			return n;
+		n = b->m_branches[key.get_bit(b->m_split_pos)].get();
+	}
+	return nullptr;
+}
+
+template<class Hash>
+typename basic_ptree<Hash>::cursor basic_ptree<Hash>::prefix(const digest_t& key, uint32_t bits) const
+{
+	cursor c;
+	if (!m_root)
+		return c;
+	c.m_root = m_root;
+	if (!find_prefix(key, bits, &c)) {
+		c.m_depth = 0;
+		return c;
+	}
+	c.m_floor = c.m_depth - 1;
+	c.leftmost();
+	return c;
+}
+
+template<class Hash>
+size_t basic_ptree<Hash>::count(const digest_t& key, uint32_t bits) const
+{
+	const node_t* n = find_prefix(key, bits, nullptr);
+	return n ? count_of(n) : 0;
+}
+
+template<class Hash>
+size_t basic_ptree<Hash>::rank(const digest_t& key) const
+{
+	size_t r = 0;
+	const node_t* n = m_root.get();
+	while(n) {
+		uint32_t diff = n->prefix().first_diff(key);
+		if (n->is_leaf() || diff < static_cast<const basic_ptree_branch<Hash>*>(n)->m_split_pos) {
+			// All of this subtree is before key or none of it is
+			if (diff != 256 && key.get_bit(diff))
+				r += count_of(n);
+			return r;
+		}
+		const basic_ptree_branch<Hash>* b = static_cast<const basic_ptree_branch<Hash>*>(n);
+		uint32_t dir = key.get_bit(b->m_split_pos);
+		if (dir)
+			r += count_of(b->m_branches[0].get());
+		n = b->m_branches[dir].get();
 	}
-	m_root = m_root->set(key, value);
+	return r;
 }
 
+template class basic_ptree_node<sha256_hash>;
+template class basic_ptree_branch<sha256_hash>;
+template class basic_ptree_leaf<sha256_hash>;
+template class basic_ptree<sha256_hash>;
+template class basic_ptree_cursor<sha256_hash>;
+template class basic_ptree_node<blake3_hash>;
+template class basic_ptree_branch<blake3_hash>;
+template class basic_ptree_leaf<blake3_hash>;
+template class basic_ptree<blake3_hash>;
+template class basic_ptree_cursor<blake3_hash>;
+template class basic_ptree_node<cheap_hash>;
+template class basic_ptree_branch<cheap_hash>;
+template class basic_ptree_leaf<cheap_hash>;
+template class basic_ptree<cheap_hash>;
+template class basic_ptree_cursor<cheap_hash>;
@@ -1,63 +1,208 @@
-
-#pragma once 
+#pragma once
 
 #include "types.h"
 #include "crypto.h"
+#include "memory.h"
+#include "bloom.h"
+#include "reclaim.h"
 
-class ptree_node;
-typedef shared_ptr<const ptree_node> ptree_ptr;
-extern const digest k_empty;
+template<class Hash> class basic_ptree;
+template<class Hash> class basic_ptree_cursor;
+
+// Everything here is templated on the Hash policy (see hash.h) that makes
+// the digests, and so the merkle hashes.  ptree.cpp instantiates the ones
+// in hash.h, the plain names below are the SHA-256 versions.
 
-class ptree_node : public enable_shared_from_this<ptree_node>
+// Merkle hashes are computed on first use, so new paths aren't hashed once
+// per set, and rehash can spread the work out.
+template<class Hash>
+class basic_ptree_node : public enable_shared_from_this<basic_ptree_node<Hash>>
 {
 public:
-	virtual ~ptree_node() {}
-	virtual const digest& prefix() const = 0;
-	virtual const digest& merkle() const = 0;
-	virtual const digest& get(const digest& key) const = 0;
-	virtual ptree_ptr set(const digest& key, const digest& value) const = 0;
+	typedef basic_digest<Hash> digest_t;
+	typedef shared_ptr<const basic_ptree_node> ptr_t;
+	// The all zero digest, values of absent keys
+	static const digest_t k_empty;
+
+	basic_ptree_node(bool leaf) : m_dirty(true), m_leaf(leaf) {}
+	virtual ~basic_ptree_node() {}
+	// Leaves are basic_ptree_leaf, everything else basic_ptree_branch
+	bool is_leaf() const { return m_leaf; }
+	virtual const digest_t& prefix() const = 0;
+	const digest_t& merkle() const;
+	virtual const digest_t& get(const digest_t& key) const = 0;
+	// One level of a lookup: the child to go on to, or null once 'out'
+	// holds the result
+	virtual const basic_ptree_node* step(const digest_t& key, const digest_t*& out) const = 0;
+	virtual ptr_t set(const digest_t& key, const digest_t& value) const = 0;
+	// Hash at most 'budget' stale nodes at or below this one, deepest
+	// first.  Returns true once merkle() is current.
+	virtual bool rehash(size_t& budget) const = 0;
+	bool dirty() const { return m_dirty; }
+	// Count this node and everything below it, see mem_tracker
+	virtual void account(mem_tracker& t) const = 0;
+	// digest::hash64 of every key below this node
+	virtual void key_hashes(vector<uint64_t>& out) const = 0;
+
+protected:
+	mutable digest_t m_merkle;
+	mutable bool m_dirty;  // m_merkle is not computed yet
+	bool m_leaf;
 };
 
-class ptree_branch : public ptree_node
+template<class Hash>
+class basic_ptree_branch : public basic_ptree_node<Hash>
 {
+	typedef basic_ptree_node<Hash> node_t;
+	typedef typename node_t::digest_t digest_t;
+	typedef typename node_t::ptr_t ptr_t;
+	using node_t::k_empty;
+	using node_t::m_merkle;
+	using node_t::m_dirty;
+	friend class basic_ptree<Hash>;
+	friend class basic_ptree_cursor<Hash>;
 public:
-	ptree_branch(uint32_t split_pos, const ptree_ptr& p1, const ptree_ptr& p2);
-	const digest& prefix() const { return m_prefix; }
-	const digest& merkle() const { return m_merkle; }
-	const digest& get(const digest& key) const;
-	ptree_ptr set(const digest& key, const digest& value) const;
+	basic_ptree_branch(uint32_t split_pos, const ptr_t& p1, const ptr_t& p2);
+	// Hands both children to reclaim_retire
+	~basic_ptree_branch();
+	const digest_t& prefix() const { return m_prefix; }
+	size_t count() const { return m_count; }
+	const digest_t& get(const digest_t& key) const;
+	const node_t* step(const digest_t& key, const digest_t*& out) const;
+	ptr_t set(const digest_t& key, const digest_t& value) const;
+	bool rehash(size_t& budget) const;
+	void account(mem_tracker& t) const;
+	void key_hashes(vector<uint64_t>& out) const;
 
 private:
-	ptree_ptr m_branches[2];
+	// Keys below share their first m_split_pos bits, bit m_split_pos
+	// picks the branch
+	ptr_t m_branches[2];
 	uint32_t  m_split_pos;
-	digest    m_prefix;
-	digest    m_merkle;
+	digest_t  m_prefix;  // Smallest key below
+	size_t    m_count;  // Keys below
 };
 
-class ptree_leaf : public ptree_node 
+template<class Hash>
+class basic_ptree_leaf : public basic_ptree_node<Hash>
 {
+	typedef basic_ptree_node<Hash> node_t;
+	typedef typename node_t::digest_t digest_t;
+	typedef typename node_t::ptr_t ptr_t;
+	using node_t::k_empty;
+	using node_t::m_merkle;
+	using node_t::m_dirty;
+	friend class basic_ptree_cursor<Hash>;
 public:
-	ptree_leaf(const digest& key, const digest& value);
-	const digest& prefix() const { return m_key; }
-	const digest& merkle() const { return m_merkle; }
-	const digest& get(const digest& key) const;
-	ptree_ptr set(const digest& key, const digest& value) const;
+	basic_ptree_leaf(const digest_t& key, const digest_t& value);
+	const digest_t& prefix() const { return m_key; }
+	const digest_t& get(const digest_t& key) const;
+	const node_t* step(const digest_t& key, const digest_t*& out) const;
+	ptr_t set(const digest_t& key, const digest_t& value) const;
+	bool rehash(size_t& budget) const;
+	void account(mem_tracker& t) const;
+	void key_hashes(vector<uint64_t>& out) const;
 
 private:
-	digest m_key;  
-	digest m_value; 
-	digest m_merkle;
+	digest_t m_key;
+	digest_t m_value;
 };
 
-class ptree 
+// An ordered walk over the keys of a ptree, made by basic_ptree::begin,
+// lower_bound and prefix.  It holds the root, so the snapshot it walks
+// stays alive and unchanged, and keeps its path in a fixed array, so making
+// and moving one never allocates.
+template<class Hash>
+class basic_ptree_cursor
 {
+	friend class basic_ptree<Hash>;
+	typedef basic_ptree_node<Hash> node_t;
+	typedef basic_ptree_branch<Hash> branch_t;
+	typedef basic_ptree_leaf<Hash> leaf_t;
 public:
+	typedef basic_digest<Hash> digest_t;
+
+	// Starts out past the end
+	basic_ptree_cursor() : m_depth(0), m_floor(0) {}
+	// False once past the last key, or the last with the prefix
+	bool valid() const { return m_depth != 0; }
+	const digest_t& key() const { return leaf()->m_key; }
+	const digest_t& value() const { return leaf()->m_value; }
+	// On to the next key in order
+	void next();
+
+private:
+	const leaf_t* leaf() const { assert(valid()); return static_cast<const leaf_t*>(m_path[m_depth - 1]); }
+	void start(const typename node_t::ptr_t& root);
+	void push(const node_t* n) { m_path[m_depth++] = n; }
+	// Down to the first key below the last node
+	void leftmost();
+	// On to the first key after everything below the last node
+	void skip();
+
+	typename node_t::ptr_t m_root;
+	uint32_t m_depth;  // Nodes in m_path
+	uint32_t m_floor;  // Index of the top node, prefix cursors stay below it
+	// From the root down.  Split positions grow going down, so there's at
+	// most a branch per bit and then a leaf.
+	const node_t* m_path[257];
+};
+
+template<class Hash>
+class basic_ptree
+{
+	typedef basic_ptree_node<Hash> node_t;
+	typedef typename node_t::ptr_t ptr_t;
+public:
+	typedef basic_digest<Hash> digest_t;
+	typedef basic_ptree_cursor<Hash> cursor;
+
 	// Constructors, etc, are default
-	const digest& merkle() const;
-	const digest& get(const digest& key) const;
-	void set(const digest& key, const digest& value);
-	
+	// Hashes changed nodes, writing into nodes that copies share, so call
+	// it (or rehash) before handing a copy to another thread
+	const digest_t& merkle() const;
+	const digest_t& get(const digest_t& key) const;
+	// get() for many keys, the lookups descend together a level at a
+	// time, prefetching each one's next node so their cache misses overlap
+	vector<digest_t> multi_get(const vector<digest_t>& keys) const;
+	void set(const digest_t& key, const digest_t& value);
+	// Spread out the hashing merkle() would do, see ptree_node::rehash
+	bool rehash(size_t budget) const;
+	// Memory held, pass trees to mem_tracker::add
+	void account(mem_tracker& t) const;
+	// Keep a bloom_filter of the keys so most gets of absent keys return
+	// without descending, see merkle_cow::set_filter.  Sets keep it up to
+	// date and copies share it.  0 bits per key drops it.
+	void set_filter(size_t bits_per_key = 10);
+	const bloom_filter* filter() const { return m_filter.get(); }
+
+	// Ordered access.  Branches record their split bit, smallest key and
+	// key count, so searches and counts skip whole subtrees.
+	size_t size() const;
+	// The first key
+	cursor begin() const;
+	// The first key at or after key
+	cursor lower_bound(const digest_t& key) const;
+	// The keys whose first 'bits' bits match key's, in order
+	cursor prefix(const digest_t& key, uint32_t bits) const;
+	// How many keys prefix() would visit
+	size_t count(const digest_t& key, uint32_t bits) const;
+	// How many keys are before key
+	size_t rank(const digest_t& key) const;
+
 private:
-	ptree_ptr m_root;
+	// The node holding exactly the keys with key's first 'bits' bits, null
+	// if there are none
+	const node_t* find_prefix(const digest_t& key, uint32_t bits, basic_ptree_cursor<Hash>* path) const;
+	bool may_contain(const digest_t& key) const { return !m_filter || m_filter->may_contain(key.hash64()); }
+	ptr_t m_root;
+	shared_ptr<bloom_filter> m_filter;  // Superset of the keys, if set
 };
 
+typedef basic_ptree_node<sha256_hash> ptree_node;
+typedef basic_ptree_branch<sha256_hash> ptree_branch;
+typedef basic_ptree_leaf<sha256_hash> ptree_leaf;
+typedef basic_ptree<sha256_hash> ptree;
+typedef basic_ptree_cursor<sha256_hash> ptree_cursor;
+typedef ptree_node::ptr_t ptree_ptr;
+extern const digest k_empty;
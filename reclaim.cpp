@@ -0,0 +1,222 @@
+
+#include "reclaim.h"
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+
+std::atomic<int> g_reclaim_mode(reclaim_inline);
+thread_local size_t t_reclaim_queued = 0;
+
+// Nodes handed to the background thread at once
+const static size_t k_batch = 256;
+
+namespace {
+
+struct retire_queue
+{
+	~retire_queue();
+	vector<shared_ptr<const void>> nodes;
+	bool draining = false;  // A drain further up the stack frees what's pushed
+};
+
+// The background thread and the batches waiting for it
+class reclaim_worker
+{
+public:
+	~reclaim_worker();
+	void start();
+	void stop();
+	// Takes all of nodes
+	void hand_off(vector<shared_ptr<const void>>& nodes);
+	// Until everything handed off so far is freed
+	void wait_idle();
+
+private:
+	void run();
+	std::mutex m_mutex;
+	std::condition_variable m_work;
+	std::condition_variable m_idle;
+	vector<vector<shared_ptr<const void>>> m_batches;
+	bool m_busy = false;  // Freeing a batch outside the lock
+	bool m_stop = false;
+	std::thread m_thread;
+};
+
+}
+
+// Set once the thread's queue is destroyed, nodes dropped after that (by
+// later thread_local or static destructors) are freed directly
+static thread_local bool t_gone = false;
+static thread_local retire_queue t_queue;
+
+static reclaim_worker& worker()
+{
+	static reclaim_worker w;
+	return w;
+}
+
+retire_queue::~retire_queue()
+{
+	// Nodes retired meanwhile land back here
+	draining = true;
+	while(!nodes.empty()) {
+		shared_ptr<const void> p = std::move(nodes.back());
+		nodes.pop_back();
+	}
+	t_reclaim_queued = 0;
+	t_gone = true;
+}
+
+reclaim_worker::~reclaim_worker()
+{
+	// Trees dropped by later static destructors free their own nodes
+	g_reclaim_mode.store(reclaim_inline);
+	stop();
+}
+
+void reclaim_worker::start()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_thread.joinable())
+		return;
+	m_stop = false;
+	m_thread = std::thread([this]() { run(); });
+}
+
+void reclaim_worker::stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (!m_thread.joinable())
+			return;
+		m_stop = true;
+	}
+	m_work.notify_one();
+	m_thread.join();
+}
+
+void reclaim_worker::hand_off(vector<shared_ptr<const void>>& nodes)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_batches.push_back(std::move(nodes));
+	}
+	nodes.clear();
+	m_work.notify_one();
+}
+
+void reclaim_worker::wait_idle()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (!m_thread.joinable())
+		return;
+	m_idle.wait(lock, [this]() { return m_batches.empty() && !m_busy; });
+}
+
+void reclaim_worker::run()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while(true) {
+		m_work.wait(lock, [this]() { return m_stop || !m_batches.empty(); });
+		// Stopping frees whatever was handed off first
+		if (m_batches.empty())
+			break;
+		vector<vector<shared_ptr<const void>>> batches;
+		swap(batches, m_batches);
+		m_busy = true;
+		lock.unlock();
+		retire_queue& q = t_queue;
+		for(auto& b : batches)
+			for(auto& p : b)
+				q.nodes.push_back(std::move(p));
+		batches.clear();
+		reclaim_drain();
+		lock.lock();
+		m_busy = false;
+		m_idle.notify_all();
+	}
+	m_idle.notify_all();
+}
+
+void set_reclaim_mode(reclaim_mode mode)
+{
+	reclaim_mode old = get_reclaim_mode();
+	if (mode == reclaim_background)
+		worker().start();
+	g_reclaim_mode.store(mode);
+	if (old == reclaim_background && mode != reclaim_background)
+		worker().stop();
+	if (mode == reclaim_inline)
+		reclaim_drain();
+}
+
+reclaim_mode get_reclaim_mode()
+{
+	return reclaim_mode(g_reclaim_mode.load());
+}
+
+void reclaim_retire(shared_ptr<const void>&& p)
+{
+	// Null, or still shared with another snapshot, so dropping it here frees
+	// at most the node itself
+	if (!p || t_gone || p.use_count() > 1) {
+		p.reset();
+		return;
+	}
+	retire_queue& q = t_queue;
+	q.nodes.push_back(std::move(p));
+	t_reclaim_queued = q.nodes.size();
+	if (q.draining)
+		return;
+	switch(g_reclaim_mode.load(std::memory_order_relaxed)) {
+	case reclaim_inline:
+		reclaim_drain();
+		break;
+	case reclaim_deferred:
+		break;
+	case reclaim_background:
+		if (q.nodes.size() >= k_batch) {
+			worker().hand_off(q.nodes);
+			t_reclaim_queued = 0;
+		}
+		break;
+	}
+}
+
+size_t reclaim_drain(size_t budget)
+{
+	if (t_gone)
+		return 0;
+	retire_queue& q = t_queue;
+	bool was_draining = q.draining;
+	q.draining = true;
+	size_t done = 0;
+	while(done < budget && !q.nodes.empty()) {
+		// Freeing it pushes its children, the loop gets to them
+		shared_ptr<const void> p = std::move(q.nodes.back());
+		q.nodes.pop_back();
+		p.reset();
+		done++;
+	}
+	q.draining = was_draining;
+	t_reclaim_queued = q.nodes.size();
+	return done;
+}
+
+size_t reclaim_pending()
+{
+	return t_reclaim_queued;
+}
+
+void reclaim_flush()
+{
+	if (get_reclaim_mode() != reclaim_background) {
+		reclaim_drain();
+		return;
+	}
+	if (!t_gone && !t_queue.nodes.empty()) {
+		worker().hand_off(t_queue.nodes);
+		t_reclaim_queued = 0;
+	}
+	worker().wait_idle();
+}
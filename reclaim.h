@@ -0,0 +1,56 @@
+#pragma once
+
+#include "types.h"
+#include <atomic>
+
+// Freeing of dropped tree nodes.  Dropping the last reference to an old
+// root would otherwise free everything only it reaches in one recursive
+// cascade of destructors, on whatever thread let go.  Instead, bnode and
+// ptree_branch destructors hand their children to reclaim_retire, which
+// frees them in a loop from a queue, so the stack never grows with the
+// tree, and depending on the mode frees them later or on another thread:
+//   reclaim_inline: at once, on the thread that dropped them (the default)
+//   reclaim_deferred: each make_node frees up to k_reclaim_per_alloc, so a
+//     writer pays a little per node it makes and never a whole tree at once
+//   reclaim_background: batches go to a thread that frees them
+// Queues are per thread, nodes wait on the thread that dropped them until
+// it makes nodes, drains, or hands off a full batch.
+enum reclaim_mode {
+	reclaim_inline,
+	reclaim_deferred,
+	reclaim_background,
+};
+
+// Retired nodes freed per node made, in reclaim_deferred mode.  More than
+// one, so a writer whose updates copy and drop the same number of nodes
+// works through a dropped snapshot's backlog as it goes.
+const static size_t k_reclaim_per_alloc = 4;
+
+// Switch modes, starting or stopping the background thread.  Leaving
+// reclaim_background waits for the thread to free what it has.  Switch while
+// other threads aren't dropping trees.
+void set_reclaim_mode(reclaim_mode mode);
+reclaim_mode get_reclaim_mode();
+
+// Called by node destructors with a child they held
+void reclaim_retire(shared_ptr<const void>&& p);
+// Free up to budget of this thread's retired nodes, returns how many
+size_t reclaim_drain(size_t budget = SIZE_MAX);
+// Nodes retired on this thread and not yet freed or handed off
+size_t reclaim_pending();
+// Free everything this thread has retired: hand it to the background
+// thread and wait for that to finish, or in the other modes drain it here
+void reclaim_flush();
+
+extern thread_local size_t t_reclaim_queued;
+extern std::atomic<int> g_reclaim_mode;
+
+// How the trees make nodes, make_shared plus the deferred mode's share of
+// freeing, so freed memory is ready for the allocation that follows
+template<class T, class... Args>
+shared_ptr<T> make_node(Args&&... args)
+{
+	if (t_reclaim_queued && g_reclaim_mode.load(std::memory_order_relaxed) == reclaim_deferred)
+		reclaim_drain(k_reclaim_per_alloc);
+	return make_shared<T>(std::forward<Args>(args)...);
+}
@@ -0,0 +1,38 @@
+#pragma once
+
+#include "blob.h"
+
+// A non-owning view of some bytes.  Slices handed out by a tree point into
+// its nodes, so they stay valid as long as that snapshot of the tree (or a
+// copy of it) is alive and unmodified.  A default constructed slice is
+// 'null', which is distinct from an empty one.
+class slice : comparable<slice>
+{
+public:
+	slice() : m_data(nullptr), m_size(0) {}
+	slice(const char* data, size_t size) : m_data(data), m_size(size) {}
+	slice(const char* str) : m_data(str), m_size(strlen(str)) {}
+	slice(const string& str) : m_data(str.data()), m_size(str.size()) {}
+	template<size_t Inline>
+	slice(const blob<Inline>& b) : m_data(b.is_null() ? nullptr : b.data()), m_size(b.size()) {}
+
+	bool is_null() const { return m_data == nullptr; }
+	const char* data() const { return m_data; }
+	size_t size() const { return m_size; }
+	string str() const { return m_data ? string(m_data, m_size) : string(); }
+
+	// Byte-wise ordering, same as std::string
+	bool operator<(const slice& rhs) const { return compare(rhs) < 0; }
+	bool operator==(const slice& rhs) const { return m_size == rhs.m_size && (m_size == 0 || memcmp(m_data, rhs.m_data, m_size) == 0); }
+	int compare(const slice& rhs) const
+	{
+		size_t n = min(m_size, rhs.m_size);
+		int r = n ? memcmp(m_data, rhs.m_data, n) : 0;
+		if (r != 0) return r;
+		return m_size < rhs.m_size ? -1 : (m_size > rhs.m_size ? 1 : 0);
+	}
+
+private:
+	const char* m_data;
+	size_t m_size;
+};
@@ -0,0 +1,107 @@
+
+#include "stats.h"
+#include <mutex>
+#include <chrono>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+static const char* counter_names[stat_counter_count] = {
+	"node_alloc", "node_copy", "node_hash", "leaf_hash", "split", "steal", "merge",
+	"update", "ptree_alloc", "ptree_set", "digest",
+};
+
+static const char* timer_names[stat_timer_count] = {
+	"update", "node_hash", "ptree_set", "digest",
+};
+
+const char* stat_name(stat_counter c) { return counter_names[c]; }
+const char* stat_name(stat_timer t) { return timer_names[t]; }
+
+stats_snapshot stats_snapshot::operator-(const stats_snapshot& rhs) const
+{
+	stats_snapshot r;
+	for(size_t i = 0; i < stat_counter_count; i++)
+		r.counts[i] = counts[i] - rhs.counts[i];
+	for(size_t i = 0; i < stat_timer_count; i++) {
+		r.cycles[i] = cycles[i] - rhs.cycles[i];
+		r.timed[i] = timed[i] - rhs.timed[i];
+	}
+	return r;
+}
+
+string stats_snapshot::as_string() const
+{
+	string r;
+	for(size_t i = 0; i < stat_counter_count; i++)
+		r += string(counter_names[i]) + " " + to_string(counts[i]) + "\n";
+	for(size_t i = 0; i < stat_timer_count; i++) {
+		r += string(timer_names[i]) + "_cycles " + to_string(cycles[i]) + "\n";
+		r += string(timer_names[i]) + "_timed " + to_string(timed[i]) + "\n";
+	}
+	return r;
+}
+
+uint64_t stat_ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// Live threads, and what finished threads left behind
+static std::mutex& registry_mutex()
+{
+	static std::mutex m;
+	return m;
+}
+static set<thread_stats*>& registry()
+{
+	static set<thread_stats*> live;
+	return live;
+}
+static stats_snapshot& retired()
+{
+	static stats_snapshot r = stats_snapshot();
+	return r;
+}
+
+static void add_to(stats_snapshot& out, const thread_stats& t)
+{
+	for(size_t i = 0; i < stat_counter_count; i++)
+		out.counts[i] += t.counts[i].load(std::memory_order_relaxed);
+	for(size_t i = 0; i < stat_timer_count; i++) {
+		out.cycles[i] += t.cycles[i].load(std::memory_order_relaxed);
+		out.timed[i] += t.timed[i].load(std::memory_order_relaxed);
+	}
+}
+
+thread_local thread_stats t_stats;
+
+thread_stats::thread_stats()
+{
+	for(auto& c : counts) c.store(0, std::memory_order_relaxed);
+	for(auto& c : cycles) c.store(0, std::memory_order_relaxed);
+	for(auto& c : timed) c.store(0, std::memory_order_relaxed);
+	std::lock_guard<std::mutex> lock(registry_mutex());
+	registry().insert(this);
+}
+
+thread_stats::~thread_stats()
+{
+	std::lock_guard<std::mutex> lock(registry_mutex());
+	add_to(retired(), *this);
+	registry().erase(this);
+}
+
+stats_snapshot get_stats()
+{
+	std::lock_guard<std::mutex> lock(registry_mutex());
+	stats_snapshot r = retired();
+	for(thread_stats* t : registry())
+		add_to(r, *t);
+	return r;
+}
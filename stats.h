@@ -0,0 +1,104 @@
+#pragma once
+
+#include "types.h"
+#include <atomic>
+
+// Hot path instrumentation.  Building with MERKLE_STATS counts events per
+// thread, MERKLE_STATS_TIMERS also times a few regions in CPU cycles (TSC
+// ticks on x86, nanoseconds elsewhere).  Without them the STAT_ macros
+// expand to nothing, and get_stats() reports zeros.
+#if defined(MERKLE_STATS_TIMERS) && !defined(MERKLE_STATS)
+#define MERKLE_STATS
+#endif
+
+enum stat_counter {
+	stat_node_alloc,  // bnodes created, by any means
+	stat_node_copy,  // bnodes copied to be written
+	stat_node_hash,  // bnode totals computed
+	stat_leaf_hash,  // merkle_cow leaf hashes computed (cache misses)
+	stat_split,  // bnode splits from inserts and joins
+	stat_steal,  // Erases refilled from a peer
+	stat_merge,  // Erases that merged into a peer
+	stat_update,  // btree::update calls
+	stat_ptree_alloc,  // ptree nodes created
+	stat_ptree_set,  // ptree_branch::set calls
+	stat_digest,  // digests hashed from data
+	stat_counter_count
+};
+
+enum stat_timer {
+	timer_update,  // btree::update
+	timer_node_hash,  // One bnode total with its leaf hashes, not its children's
+	timer_ptree_set,  // ptree::set, the whole descent
+	timer_digest,  // digest constructors that hash
+	stat_timer_count
+};
+
+// Totals of every counter and timer
+struct stats_snapshot
+{
+	uint64_t counts[stat_counter_count];
+	uint64_t cycles[stat_timer_count];  // Time spent in each region
+	uint64_t timed[stat_timer_count];  // Times each region was entered
+
+	// Difference between two snapshots, what happened in between
+	stats_snapshot operator-(const stats_snapshot& rhs) const;
+	// One "name value" line per counter and timer
+	string as_string() const;
+};
+
+const char* stat_name(stat_counter c);
+const char* stat_name(stat_timer t);
+
+// Sums over all threads, live and finished.  Counters of live threads are
+// read while they run, so the result is only as consistent as that allows.
+stats_snapshot get_stats();
+
+// Each thread owns one of these, registered so get_stats can find it.
+// Only the owner writes, so relaxed loads and stores are enough.
+struct thread_stats
+{
+	thread_stats();
+	~thread_stats();
+	std::atomic<uint64_t> counts[stat_counter_count];
+	std::atomic<uint64_t> cycles[stat_timer_count];
+	std::atomic<uint64_t> timed[stat_timer_count];
+};
+extern thread_local thread_stats t_stats;
+
+inline void stat_bump(std::atomic<uint64_t>& a, uint64_t n)
+{
+	a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+uint64_t stat_ticks();
+
+// Adds the ticks from construction to destruction to a timer
+class stat_scope
+{
+public:
+	stat_scope(stat_timer t) : m_timer(t), m_start(stat_ticks()) {}
+	~stat_scope()
+	{
+		stat_bump(t_stats.cycles[m_timer], stat_ticks() - m_start);
+		stat_bump(t_stats.timed[m_timer], 1);
+	}
+
+private:
+	stat_timer m_timer;
+	uint64_t m_start;
+};
+
+#ifdef MERKLE_STATS
+#define STAT_ADD(c, n) stat_bump(t_stats.counts[c], n)
+#else
+#define STAT_ADD(c, n) do {} while(0)
+#endif
+#define STAT_INC(c) STAT_ADD(c, 1)
+
+// Times the rest of the enclosing scope
+#ifdef MERKLE_STATS_TIMERS
+#define STAT_TIMER(t) stat_scope stat_scope_##t(t)
+#else
+#define STAT_TIMER(t) do {} while(0)
+#endif
@@ -2,6 +2,18 @@
 #include "btree.h"
 #include "utils.h"
 #include "merkle_cow.h"
+#include "ptree.h"
+#include "journal.h"
+#include "aio.h"
+#include "compress.h"
+#include "stats.h"
+#include "paged.h"
+#include "txn.h"
+#include "reclaim.h"
+#include <thread>
+#include <random>
+#include <unistd.h>
+#include <fcntl.h>
 
 typedef array<char, 32> hash_t;
 shared_ptr<string> to_shared(const string& str) {
@@ -14,13 +26,1428 @@ public:
 	void write(const char* str, size_t len) {
 		m_value += string(str, len);
 	}
+	void flush() { m_flushes++; }
 	string value() { return m_value; }
+	size_t flushes() const { return m_flushes; }
 private:
 	string m_value;
+	size_t m_flushes = 0;
 };
 
+class string_reader : public readable
+{
+public:
+	string_reader(const string& value) : m_value(value), m_pos(0) {}
+	size_t read(char* buf, size_t len) {
+		len = min(len, m_value.size() - m_pos);
+		memcpy(buf, m_value.data() + m_pos, len);
+		m_pos += len;
+		return len;
+	}
+private:
+	string m_value;
+	size_t m_pos;
+};
+
+// An unlinked temp file, reopened with extra open flags if any are given.
+// -1 if the flags aren't supported here.
+int temp_fd(int flags = 0)
+{
+	char path[] = "/tmp/merkle_cow_test_XXXXXX";
+	int fd = mkstemp(path);
+	assert(fd >= 0);
+	if (flags) {
+		::close(fd);
+		fd = open(path, O_RDWR | flags);
+	}
+	unlink(path);
+	return fd;
+}
+
+// A tiny btree policy with small nodes to stress the tree structure
+struct int_policy {
+	static const size_t min_size = 3;
+	static const size_t max_size = 6;
+	static const size_t max_steal = 4;
+	typedef int key_t;
+	typedef int value_t;
+	typedef plain_keys<int_policy> keys_t;
+	static value_t compute_total(const value_t* vals, size_t count) {
+		value_t r = 0;
+		for(size_t i = 0; i < count; i++) r += vals[i];
+		return r;
+	}
+	static bool less(const key_t& a, const key_t& b) { return a < b; }
+};
+typedef btree<int_policy> int_tree;
+
+// Put a value into an int tree, 0 means erase
+void int_put(int_tree& tree, int k, int v)
+{
+	tree.update(k, [&](int& val, bool& exists) -> bool {
+		if (!exists && v == 0) return false;
+		exists = (v != 0);
+		val = v;
+		return true;
+	});
+}
+
+// Check node sizes, ordering, cached totals and counts, return the count
+template<class Policy>
+size_t check_node(const typename bnode<Policy>::ptr_t& node, size_t height, bool root)
+{
+	typedef bnode<Policy> node_t;
+	if (root)
+		node->total();  // Bring the lazily computed totals up to date
+	assert(node->size() <= node_t::max_size);
+	assert(node->size() >= (root ? (height > 1 ? 2 : 1) : node_t::min_size));
+	for(size_t i = 1; i < node->size(); i++)
+		assert(Policy::less(node->key(i - 1), node->key(i)));
+	if (height == 1)
+		return node->size();
+	size_t count = 0;
+	for(size_t i = 0; i < node->size(); i++) {
+		const typename node_t::ptr_t& child = node->ptr(i);
+		assert(!Policy::less(node->key(i), child->key(0)) && !Policy::less(child->key(0), node->key(i)));
+		assert(node->val(i) == child->total());
+		count += check_node<Policy>(child, height - 1, false);
+	}
+	assert(count == node->count());
+	return count;
+}
+
+// Check an int tree against a reference map, including totals
+void check_int_tree(const int_tree& tree, const map<int, int>& ref)
+{
+	assert(tree.size() == ref.size());
+	if (tree.height())
+		assert(check_node<int_policy>(tree.root(), tree.height(), true) == ref.size());
+	int total = 0;
+	biter<int_policy> it(tree.root(), tree.height());
+	it.set_begin();
+	for(const auto& kvp : ref) {
+		assert(!it.is_end());
+		assert(it.get_key() == kvp.first && it.get_value() == kvp.second);
+		total += kvp.second;
+		it.increment();
+	}
+	assert(it.is_end());
+	assert(ref.empty() || tree.root()->total() == total);
+}
+
+void check_int_tree()
+{
+	int_tree tree;
+	map<int, int> ref;
+	srand(2);
+	for(size_t i = 0; i < 20000; i++) {
+		int k = rand() % 500;
+		int v = (rand() % 3 == 0) ? 0 : rand() % 100 + 1;
+		int_put(tree, k, v);
+		if (v) ref[k] = v; else ref.erase(k);
+		if (i % 1000 == 0) check_int_tree(tree, ref);
+	}
+	check_int_tree(tree, ref);
+
+	// Erase random ranges, refilling as we go
+	for(size_t i = 0; i < 300; i++) {
+		for(size_t j = 0; j < 50; j++) {
+			int k = rand() % 500;
+			int_put(tree, k, k + 1);
+			ref[k] = k + 1;
+		}
+		int lo = rand() % 520 - 10;
+		int hi = lo + rand() % (i % 3 ? 20 : 400);
+		int_tree before = tree;
+		size_t erased = tree.erase_range(lo, hi);
+		assert(erased == (size_t) std::distance(ref.lower_bound(lo), ref.lower_bound(hi)));
+		ref.erase(ref.lower_bound(lo), ref.lower_bound(hi));
+		if (erased == 0)
+			assert(before.root() == tree.root());
+		check_int_tree(tree, ref);
+	}
+	tree.erase_range(-1, 1000);
+	assert(tree.size() == 0 && tree.height() == 0);
+
+	// Split into pieces of random sizes and join them back in random order
+	for(int k = 0; k < 2000; k++) {
+		int_put(tree, k, k + 1);
+		ref[k] = k + 1;
+	}
+	for(size_t i = 0; i < 200; i++) {
+		int at = rand() % 2100 - 50;
+		pair<int_tree, int_tree> halves = tree.split_at(at);
+		check_int_tree(halves.first, map<int, int>(ref.begin(), ref.lower_bound(at)));
+		check_int_tree(halves.second, map<int, int>(ref.lower_bound(at), ref.end()));
+		int at2 = rand() % 2100 - 50;
+		pair<int_tree, int_tree> pieces = halves.second.split_at(at2);
+		tree = int_tree::join(halves.first, int_tree::join(pieces.first, pieces.second));
+		check_int_tree(tree, ref);
+	}
+
+	// Set operations between a tree and a lightly edited copy of it
+	auto sum = [](int, int a, int b, int& out) { out = a + b; return true; };
+	for(size_t i = 0; i < 50; i++) {
+		int_tree other = tree;
+		map<int, int> other_ref = ref;
+		size_t edits = (i % 5 == 0) ? 3000 : 20;
+		for(size_t j = 0; j < edits; j++) {
+			int k = rand() % 2500;
+			int v = (rand() % 4 == 0) ? 0 : rand() % 100 + 1;
+			int_put(other, k, v);
+			if (v) other_ref[k] = v; else other_ref.erase(k);
+		}
+		map<int, int> u = ref, n, d;
+		for(const auto& kvp : other_ref) {
+			if (ref.count(kvp.first)) {
+				u[kvp.first] = ref[kvp.first] + kvp.second;
+				n[kvp.first] = ref[kvp.first] + kvp.second;
+			} else {
+				u[kvp.first] = kvp.second;
+			}
+		}
+		map<int, int> d2;
+		for(const auto& kvp : ref)
+			if (!other_ref.count(kvp.first)) d[kvp.first] = kvp.second;
+		for(const auto& kvp : other_ref)
+			if (!ref.count(kvp.first)) d2[kvp.first] = kvp.second;
+		// Shared subtrees are kept as is, so only compare keys there
+		int_tree ut = int_tree::set_union(tree, other, sum);
+		int_tree nt = int_tree::set_intersection(tree, other, sum);
+		check_node<int_policy>(ut.root(), ut.height(), true);
+		check_node<int_policy>(nt.root(), nt.height(), true);
+		assert(ut.size() == u.size() && nt.size() == n.size());
+		check_int_tree(int_tree::set_difference(tree, other), d);
+		check_int_tree(int_tree::set_difference(other, tree), d2);
+		auto take_b = [](int, int a, int b, int& out) { out = b; return true; };
+		map<int, int> nb;
+		for(const auto& kvp : other_ref)
+			if (ref.count(kvp.first)) nb[kvp.first] = kvp.second;
+		check_int_tree(int_tree::set_intersection(tree, other, take_b), nb);
+		tree = int_tree::set_union(tree, other, take_b);
+		for(const auto& kvp : other_ref) ref[kvp.first] = kvp.second;
+		check_int_tree(tree, ref);
+	}
+}
+
+// Run random puts and erases with short and long strings, and compare to std::map
+void check_against_map()
+{
+	merkle_cow mc;
+	map<string, string> ref;
+	srand(1);
+	for(size_t i = 0; i < 20000; i++) {
+		string key = to_string(rand() % 3000);
+		if (rand() % 2) key = string(20, 'k') + key;
+		string value = to_string(rand());
+		if (rand() % 2) value += string(30, 'v');
+		if (rand() % 3 == 0) {
+			auto prev = mc.put(to_shared(key), shared_ptr<string>());
+			assert((prev != nullptr) == (ref.count(key) != 0));
+			ref.erase(key);
+		} else {
+			auto prev = mc.put(to_shared(key), to_shared(value));
+			assert(!prev || *prev == ref[key]);
+			ref[key] = value;
+		}
+	}
+	auto it = mc.begin();
+	for(const auto& kvp : ref) {
+		assert(it != mc.end());
+		assert(*it->first == kvp.first && *it->second == kvp.second);
+		assert(*mc.find(to_shared(kvp.first))->second == kvp.second);
+		++it;
+	}
+	assert(it == mc.end());
+
+	// Zero copy lookups and iteration
+	auto sit = mc.begin();
+	for(const auto& kvp : ref) {
+		assert(sit.key() == kvp.first && sit.value() == kvp.second);
+		slice v = mc.get(kvp.first);
+		assert(!v.is_null() && v == kvp.second);
+		assert(v.data() == sit.value().data());
+		assert(mc.find(slice(kvp.first)).key() == kvp.first);
+		++sit;
+	}
+	assert(mc.get("no such key").is_null() && mc.get("").is_null());
+	assert(mc.find("no such key") == mc.end());
+	assert(mc.lower_bound("") == mc.begin());
+
+	// Bounds around long keys, present and not, compared in place
+	for(size_t i = 0; i < 3000; i += 7) {
+		string probe = string(20, 'k') + to_string(i) + (i % 2 ? "x" : "");
+		auto lb = ref.lower_bound(probe), ub = ref.upper_bound(probe);
+		auto mlb = mc.lower_bound(probe), mub = mc.upper_bound(probe);
+		assert(lb == ref.end() ? mlb == mc.end() : mlb.key() == lb->first);
+		assert(ub == ref.end() ? mub == mc.end() : mub.key() == ub->first);
+		assert((mc.find(probe) != mc.end()) == (ref.count(probe) != 0));
+	}
+
+	// Erase a range of long keys
+	string lo(20, 'k'), hi = string(20, 'k') + "5";
+	size_t erased = mc.erase_range(to_shared(lo), to_shared(hi));
+	assert(erased == (size_t) std::distance(ref.lower_bound(lo), ref.lower_bound(hi)));
+	ref.erase(ref.lower_bound(lo), ref.lower_bound(hi));
+
+	// Overlay a batch of writes
+	merkle_cow top;
+	map<string, string> top_ref;
+	for(size_t i = 0; i < 500; i++) {
+		string key = to_string(rand() % 5000);
+		top.put(to_shared(key), to_shared("top" + key));
+		top_ref[key] = "top" + key;
+	}
+	merkle_cow over = merkle_cow::overlay(mc, top);
+	merkle_cow joined = merkle_cow::set_union(mc, top, 
+		[](const shared_ptr<string>& k, const shared_ptr<string>& a, const shared_ptr<string>& b) { return b; });
+	for(const auto& kvp : top_ref) ref[kvp.first] = kvp.second;
+	assert(over.root_hash() == joined.root_hash());
+	mc = over;
+	auto oit = mc.begin();
+	for(const auto& kvp : ref) {
+		assert(*oit->first == kvp.first && *oit->second == kvp.second);
+		++oit;
+	}
+	assert(oit == mc.end());
+	size_t remaining = 0;
+	merkle_cow diff = merkle_cow::set_difference(mc, top);
+	for(auto dit = diff.begin(); dit != diff.end(); ++dit) {
+		assert(top_ref.count(*dit->first) == 0);
+		remaining++;
+	}
+	assert(remaining == ref.size() - top_ref.size());
+
+	// Split and join back together
+	auto halves = mc.split_at(to_shared("2"));
+	assert(halves.first.begin() != halves.first.end() && halves.second.begin() != halves.second.end());
+	assert(*(--halves.first.end())->first < "2" && !(*halves.second.begin()->first < "2"));
+	mc = merkle_cow::join(halves.first, halves.second);
+
+	// Check a serialization round trip
+	mc.rehash();
+	string_writer sw;
+	mc.serialize(sw);
+	string_reader sr(sw.value());
+	merkle_cow mc2;
+	mc2.deserialize(sr);
+	auto it2 = mc2.begin();
+	for(const auto& kvp : ref) {
+		assert(*it2->first == kvp.first && *it2->second == kvp.second);
+		++it2;
+	}
+	assert(it2 == mc2.end());
+}
+
+// The root hash must not change as the implementation does
+void check_root_hash()
+{
+	merkle_cow mc;
+	for(int i = 0; i < 5000; i++)
+		mc.put(to_shared(to_string(i*7919%10007)), to_shared(string(i%40, 'x') + to_string(i)));
+	for(int i = 0; i < 5000; i += 3)
+		mc.put(to_shared(to_string(i*7919%10007)), shared_ptr<string>());
+	hash_t h = mc.root_hash();
+	assert(hexify(string(h.data(), h.size())) == 
+		"34E9A9FA2395F7B00C24FAE14F01A53B78C3846DDD8215F61018CD1ADB345ADD");
+
+	// Hashing a batch in slices gets the same root, each stale node once
+	merkle_cow batch = mc;
+	for(int i = 0; i < 200; i++)
+		batch.put(to_shared(to_string(i * 31)), to_shared("batch"));
+	merkle_cow eager = mc;
+	for(int i = 0; i < 200; i++) {
+		eager.put(to_shared(to_string(i * 31)), to_shared("batch"));
+		eager.root_hash();
+	}
+	size_t slices = 0;
+	while(!batch.rehash(1)) slices++;
+	assert(slices > 0 && slices < 200 * 4);
+	assert(batch.rehash(0));
+	assert(batch.root_hash() == eager.root_hash());
+	assert(mc.root_hash() == h);
+
+	// Hot keys flipping between values give the same root with the cache
+	merkle_cow::set_hash_cache(64);
+	merkle_cow hot = mc;
+	for(int i = 0; i < 1000; i++) {
+		hot.put(to_shared(to_string(i % 10)), to_shared(to_string(i % 3)));
+		hot.root_hash();
+	}
+	merkle_cow::set_hash_cache(0);
+	merkle_cow cold = mc;
+	for(int i = 990; i < 1000; i++)
+		cold.put(to_shared(to_string(i % 10)), to_shared(to_string(i % 3)));
+	assert(hot.root_hash() == cold.root_hash());
+}
+
+// Lazy ptree hashing matches a tree built in another order
+// Fast digest primitives against byte at a time versions
+static digest raw_digest(const uint8_t* bytes)
+{
+	static_assert(sizeof(digest) == 32, "digest is just its bytes");
+	digest d;
+	memcpy((void*) &d, bytes, 32);
+	return d;
+}
+
+void check_digest()
+{
+	std::mt19937 rng(7);
+	for(int i = 0; i < 2000; i++) {
+		uint8_t a[32], b[32];
+		for(size_t j = 0; j < 32; j++)
+			a[j] = b[j] = rng();
+		// Differ at a random bit, sometimes not at all
+		uint32_t bit = rng() % 260;
+		if (bit < 256)
+			b[bit / 8] ^= 0x80 >> (bit % 8);
+		digest da = raw_digest(a);
+		digest db = raw_digest(b);
+		uint32_t expect = 256;
+		for(uint32_t k = 0; k < 256 && expect == 256; k++)
+			if (((a[k / 8] ^ b[k / 8]) >> (7 - k % 8)) & 1) expect = k;
+		assert(da.first_diff(db) == expect);
+		assert(db.first_diff(da) == expect);
+		assert((da == db) == (expect == 256));
+		assert((da < db) == (memcmp(a, b, 32) < 0));
+		assert((db < da) == (memcmp(b, a, 32) < 0));
+		for(uint32_t k = 0; k < 256; k++)
+			assert(da.get_bit(k) == uint32_t((a[k / 8] >> (7 - k % 8)) & 1));
+		string hex = hexify(string((const char*) a, 32));
+		assert(da.as_hex() == hex);
+		assert(da.as_string() == hex.substr(0, 8));
+	}
+}
+
+// Each hash policy, known answers and trees built on it
+template<class Hash>
+void check_hash_policy()
+{
+	typedef basic_digest<Hash> digest_t;
+	// Pieces hash the same as the whole
+	string all = "the quick brown fox jumps over the lazy dog";
+	hash_piece pieces[3] = { { all.data(), 4 }, { all.data() + 4, 0 }, { all.data() + 4, all.size() - 4 } };
+	char split[32];
+	Hash::hash(pieces, 3, split);
+	digest_t whole(all);
+	assert(memcmp(split, &whole, 32) == 0);
+
+	// Set order doesn't change the merkle hash, erases do
+	basic_ptree<Hash> a, b;
+	for(int i = 0; i < 500; i++)
+		a.set(digest_t(to_string(i)), digest_t("v" + to_string(i)));
+	for(int i = 499; i >= 0; i--)
+		b.set(digest_t(to_string(i)), digest_t("v" + to_string(i)));
+	assert(a.merkle() == b.merkle());
+	assert(a.get(digest_t("7")) == digest_t("v7"));
+	b.set(digest_t("7"), digest_t());
+	assert(!(a.merkle() == b.merkle()) && b.get(digest_t("7")) == digest_t());
+
+	basic_merkle_cow<16, Hash> mc, mc2;
+	for(int i = 0; i < 500; i++) {
+		mc.put(to_shared(to_string(i)), to_shared("v" + to_string(i)));
+		mc2.put(to_shared(to_string(i)), to_shared("v" + to_string(i)));
+	}
+	assert(mc.root_hash() == mc2.root_hash() && mc.get(slice("7")) == slice("v7"));
+	mc2.put(to_shared("7"), to_shared("w"));
+	assert(!(mc.root_hash() == mc2.root_hash()));
+}
+
+void check_hashes()
+{
+	assert(digest("abc").as_hex() == "BA7816BF8F01CFEA414140DE5DAE2223B00361A396177A9CB410FF61F20015AD");
+	// The official BLAKE3 test inputs, byte i is i % 251
+	const pair<size_t, const char*> blake3_known[] = {
+		{ 0, "AF1349B9F5F9A1A6A0404DEA36DCC9499BCB25C9ADC112B7CC9A93CAE41F3262" },
+		{ 1, "2D3ADEDFF11B61F14C886E35AFA036736DCD87A74D27B5C1510225D0F592E213" },
+		{ 1025, "D00278AE47EB27B34FAECF67B4FE263F82D5412916C1FFD97C8CB7FB814B8444" },
+		{ 4096, "015094013F57A5277B59D8475C0501042C0B642E531B0A1C8F58D2163229E969" },
+		{ 8193, "BAB6C09CB8CE8CF459261398D2E7AEF35700BF488116CEB94A36D0F5F1B7BC3B" },
+		{ 102400, "BC3E3D41A1146B069ABFFAD3C0D44860CF664390AFCE4D9661F7902E7943E085" },
+	};
+	for(const auto& known : blake3_known) {
+		string input(known.first, '\0');
+		for(size_t i = 0; i < input.size(); i++)
+			input[i] = char(i % 251);
+		assert(basic_digest<blake3_hash>(input).as_hex() == known.second);
+	}
+	check_hash_policy<sha256_hash>();
+	check_hash_policy<blake3_hash>();
+	check_hash_policy<cheap_hash>();
+	// Same keys, different hashes, different roots
+	basic_merkle_cow<16, cheap_hash> cheap;
+	merkle_cow sha;
+	cheap.put(to_shared("k"), to_shared("v"));
+	sha.put(to_shared("k"), to_shared("v"));
+	assert(!(cheap.root_hash() == sha.root_hash()));
+}
+
+void check_ptree_rehash()
+{
+	ptree a, b;
+	for(int i = 0; i < 1000; i++)
+		a.set(digest(to_string(i)), digest("v" + to_string(i)));
+	for(int i = 999; i >= 0; i--) {
+		b.set(digest(to_string(i)), digest("v" + to_string(i)));
+		b.merkle();
+	}
+	size_t slices = 0;
+	while(!a.rehash(7)) slices++;
+	assert(slices == 1999 / 7);
+	assert(a.merkle() == b.merkle());
+	a.set(digest(to_string(5)), k_empty);
+	assert(!(a.merkle() == b.merkle()));
+}
+
+// Keys with the first 'bits' bits of key
+static bool has_prefix(const digest& d, const digest& key, uint32_t bits)
+{
+	return d.first_diff(key) >= bits;
+}
+
+// Cursors walk the keys in order, and agree with a map
+void check_ptree_cursor()
+{
+	ptree pt;
+	assert(!pt.begin().valid() && !pt.lower_bound(digest("1")).valid());
+	assert(!pt.prefix(digest("1"), 0).valid() && pt.count(digest("1"), 0) == 0);
+	assert(pt.size() == 0 && pt.rank(digest("1")) == 0);
+	map<digest, digest> ref;
+	for(int i = 0; i < 3000; i++) {
+		pt.set(digest(to_string(i)), digest("v" + to_string(i)));
+		ref[digest(to_string(i))] = digest("v" + to_string(i));
+	}
+	for(int i = 0; i < 3000; i += 3) {
+		pt.set(digest(to_string(i)), k_empty);
+		ref.erase(digest(to_string(i)));
+	}
+	assert(pt.size() == ref.size());
+	ptree_cursor c = pt.begin();
+	for(const auto& kv : ref) {
+		assert(c.valid() && c.key() == kv.first && c.value() == kv.second);
+		c.next();
+	}
+	assert(!c.valid());
+
+	// Present and absent keys
+	for(int i = 0; i < 600; i++) {
+		digest key(to_string(i));
+		auto it = ref.lower_bound(key);
+		ptree_cursor lb = pt.lower_bound(key);
+		assert(pt.rank(key) == size_t(distance(ref.begin(), it)));
+		for(int j = 0; j < 3; j++) {
+			if (it == ref.end()) {
+				assert(!lb.valid());
+				break;
+			}
+			assert(lb.valid() && lb.key() == it->first);
+			lb.next();
+			++it;
+		}
+	}
+	assert(pt.rank(ref.rbegin()->first) == ref.size() - 1);
+
+	// Prefixes of the keys, and of keys that aren't there
+	for(uint32_t bits : { 0u, 1u, 3u, 8u, 11u, 17u, 255u, 256u }) {
+		for(int i = 0; i < 20; i++) {
+			digest key(to_string(i * 31));
+			size_t expect = 0;
+			ptree_cursor p = pt.prefix(key, bits);
+			for(const auto& kv : ref) {
+				if (!has_prefix(kv.first, key, bits))
+					continue;
+				expect++;
+				assert(p.valid() && p.key() == kv.first);
+				p.next();
+			}
+			assert(!p.valid());
+			assert(pt.count(key, bits) == expect);
+		}
+	}
+	assert(pt.count(digest("0"), 0) == ref.size());
+
+	// A cursor keeps walking the tree it started on
+	ptree_cursor snap = pt.begin();
+	digest first = snap.key();
+	for(int i = 0; i < 3000; i++)
+		pt.set(digest(to_string(i)), k_empty);
+	assert(pt.size() == 0 && !pt.begin().valid());
+	size_t n = 0;
+	for(; snap.valid(); snap.next())
+		n++;
+	assert(n == ref.size() && first == ref.begin()->first);
+}
+
+// Batched lookups give the same answers as one at a time
+void check_multi_get()
+{
+	merkle_cow mc;
+	ptree pt;
+	vector<slice> none = mc.multi_get(vector<slice>(3, slice("1")));
+	assert(none.size() == 3 && none[0].is_null());
+	assert(pt.multi_get(vector<digest>(2, digest("1")))[1] == k_empty);
+	for(int i = 0; i < 5000; i += 2) {
+		mc.put(to_shared(to_string(i)), to_shared("v" + to_string(i)));
+		pt.set(digest(to_string(i)), digest("v" + to_string(i)));
+	}
+	vector<string> strs;
+	for(int i = 0; i < 1003; i++)
+		strs.push_back(to_string((i * 7919) % 5100));
+	strs.push_back("");
+	vector<slice> keys(strs.begin(), strs.end());
+	vector<digest> dkeys;
+	for(const string& s : strs)
+		dkeys.push_back(digest(s));
+	vector<slice> vals = mc.multi_get(keys);
+	vector<digest> dvals = pt.multi_get(dkeys);
+	assert(vals.size() == keys.size() && dvals.size() == keys.size());
+	for(size_t i = 0; i < keys.size(); i++) {
+		slice v = mc.get(keys[i]);
+		assert(vals[i].is_null() == v.is_null() && vals[i] == v);
+		assert(dvals[i] == pt.get(dkeys[i]));
+	}
+}
+
+// Negative lookup filters never hide a key that's there
+void check_filter()
+{
+	bloom_filter f(10000);
+	std::mt19937_64 rng(3);
+	for(int i = 0; i < 10000; i++)
+		f.insert(rng());
+	rng.seed(3);
+	for(int i = 0; i < 10000; i++)
+		assert(f.may_contain(rng()));
+	size_t false_pos = 0;
+	for(int i = 0; i < 100000; i++)
+		false_pos += f.may_contain(rng());
+	assert(false_pos < 2000);  // About 1% expected
+	assert(!f.full());
+
+	// Random puts and erases against a map, through several rebuilds
+	merkle_cow mc;
+	mc.set_filter();
+	map<string, string> ref;
+	for(int i = 0; i < 20000; i++) {
+		string k = to_string(rng() % 5000);
+		if (rng() % 4 == 0) {
+			mc.put(to_shared(k), shared_ptr<string>());
+			ref.erase(k);
+		} else {
+			mc.put(to_shared(k), to_shared(to_string(i)));
+			ref[k] = to_string(i);
+		}
+	}
+	assert(mc.filter() && mc.filter()->capacity() > 1024);
+	size_t skipped = 0;
+	for(int i = 0; i < 6000; i++) {
+		string k = to_string(i);
+		auto it = ref.find(k);
+		slice v = mc.get(slice(k));
+		assert(it == ref.end() ? v.is_null() : v == slice(it->second));
+		assert((mc.find(slice(k)) == mc.end()) == (it == ref.end()));
+		skipped += !mc.filter()->may_contain(fast_hash(k.data(), k.size()));
+	}
+	assert(skipped > 900 * 8 / 10);  // Keys 5000 on were never put
+	vector<string> strs;
+	for(int i = 4900; i < 5100; i++)
+		strs.push_back(to_string(i));
+	vector<slice> keys(strs.begin(), strs.end());
+	vector<slice> vals = mc.multi_get(keys);
+	for(size_t i = 0; i < keys.size(); i++)
+		assert(vals[i] == mc.get(keys[i]) && vals[i].is_null() == mc.get(keys[i]).is_null());
+
+	// Copies share the filter, and a put to one doesn't hide keys of the other
+	merkle_cow copy = mc;
+	copy.put(to_shared("new"), to_shared("x"));
+	assert(copy.filter() == mc.filter());
+	assert(copy.get(slice("new")) == slice("x") && mc.get(slice("new")).is_null());
+	assert(mc.split_at(to_shared("3")).first.filter() == nullptr);
+	mc.set_filter(0);
+	assert(!mc.filter() && mc.get(slice("new")).is_null());
+
+	ptree pt;
+	pt.set_filter(8);
+	for(int i = 0; i < 3000; i++)
+		pt.set(digest(to_string(i)), digest("v" + to_string(i)));
+	for(int i = 0; i < 3000; i += 3)
+		pt.set(digest(to_string(i)), k_empty);
+	assert(pt.filter() && pt.filter()->capacity() > 1024);
+	vector<digest> dkeys;
+	for(int i = 0; i < 4000; i++) {
+		digest k(to_string(i));
+		bool there = i < 3000 && i % 3 != 0;
+		assert(pt.get(k) == (there ? digest("v" + to_string(i)) : k_empty));
+		dkeys.push_back(k);
+	}
+	vector<digest> dvals = pt.multi_get(dkeys);
+	for(size_t i = 0; i < dkeys.size(); i++)
+		assert(dvals[i] == pt.get(dkeys[i]));
+}
+
+// Memory accounting with snapshots sharing nodes
+void check_memory()
+{
+	merkle_cow a;
+	for(int i = 0; i < 2000; i++)
+		a.put(to_shared(to_string(i)), to_shared(string(100, 'x') + to_string(i)));
+	merkle_cow b = a;
+	for(int i = 0; i < 10; i++)
+		b.put(to_shared(to_string(i * 100)), to_shared("changed"));
+
+	mem_tracker ta;
+	ta.add(a);
+	mem_usage ua = ta.total();
+	assert(ua.nodes > 2000 / 32 && ua.key_bytes > 0);
+	// Values plus their leaf hashes, 6890 is the digits of 0 to 1999
+	assert(ua.value_bytes == 2000 * (100 + 32) + 6890);
+	assert(ua.heap_bytes >= 2000 * 100);  // Long values are out of line
+	assert(ua.total() == ua.node_bytes + ua.control_bytes + ua.heap_bytes);
+	assert(ta.unique(0).total() == ua.total());
+
+	mem_tracker tab;
+	tab.add(a);
+	tab.add(b);
+	mem_usage all = tab.total();
+	mem_usage only_a = tab.unique(0);
+	mem_usage only_b = tab.unique(1);
+	// b shares everything but the changed paths
+	assert(all.nodes < 2 * ua.nodes);
+	assert(only_a.nodes > 0 && only_a.nodes == only_b.nodes);
+	assert(only_a.heap_bytes >= 10 * 100 && only_b.heap_bytes < only_a.heap_bytes);
+	assert(all.total() == ua.total() + only_b.total());
+	// The same snapshot twice owns nothing alone
+	mem_tracker twice;
+	twice.add(a);
+	twice.add(a);
+	assert(twice.total().total() == ua.total() && twice.unique(0).nodes == 0 && twice.unique(1).nodes == 0);
+
+	ptree p;
+	for(int i = 0; i < 100; i++)
+		p.set(digest(to_string(i)), digest(to_string(i)));
+	ptree q = p;
+	q.set(digest("new"), digest("new"));
+	mem_tracker tp;
+	tp.add(p);
+	tp.add(q);
+	// q copied the path down to the new leaf, and added a branch and leaf
+	assert(tp.unique(0).nodes > 0 && tp.unique(1).nodes == tp.unique(0).nodes + 2);
+	assert(tp.total().nodes == 199 + tp.unique(1).nodes);
+	assert(tp.total().key_bytes == 101 * 32);
+}
+
+// Counters only move when built with MERKLE_STATS
+void check_stats()
+{
+	stats_snapshot before = get_stats();
+	merkle_cow mc;
+	for(int i = 0; i < 1000; i++)
+		mc.put(to_shared(to_string(i)), to_shared(to_string(i)));
+	for(int i = 0; i < 900; i++)
+		mc.put(to_shared(to_string(i)), shared_ptr<string>());
+	mc.root_hash();
+	// Threads that have exited still count
+	std::thread other([] {
+		ptree p;
+		for(int i = 0; i < 100; i++)
+			p.set(digest(to_string(i)), digest(to_string(i + 1)));
+		p.merkle();
+	});
+	other.join();
+	stats_snapshot d = get_stats() - before;
+#ifdef MERKLE_STATS
+	assert(d.counts[stat_update] == 1900);
+	assert(d.counts[stat_node_copy] > 0 && d.counts[stat_node_alloc] > d.counts[stat_node_copy]);
+	assert(d.counts[stat_split] > 0 && d.counts[stat_merge] > 0 && d.counts[stat_steal] > 0);
+	assert(d.counts[stat_node_hash] > 0 && d.counts[stat_leaf_hash] >= 100);
+	assert(d.counts[stat_ptree_alloc] >= 100 && d.counts[stat_ptree_set] > 0);
+	assert(d.counts[stat_digest] >= 200 + 99);
+#else
+	for(size_t i = 0; i < stat_counter_count; i++)
+		assert(d.counts[i] == 0);
+#endif
+#ifdef MERKLE_STATS_TIMERS
+	assert(d.timed[timer_update] == 1900 && d.cycles[timer_update] > 0);
+	assert(d.timed[timer_ptree_set] == 100);
+	assert(d.timed[timer_node_hash] == d.counts[stat_node_hash]);
+#else
+	for(size_t i = 0; i < stat_timer_count; i++)
+		assert(d.timed[i] == 0 && d.cycles[i] == 0);
+#endif
+	assert(d.as_string().find("node_copy ") != string::npos);
+}
+
+// Journal updates, checkpoint, and recover after a crash at various points
+void check_journal()
+{
+	merkle_cow mc;
+	string_writer log;
+	journal j(log);
+	for(int i = 0; i < 300; i++) {
+		string key = to_string(i % 100);
+		if (i % 7 == 0) {
+			j.log_erase(key);
+			mc.put(to_shared(key), shared_ptr<string>());
+		} else {
+			j.log_put(key, to_string(i));
+			mc.put(to_shared(key), to_shared(to_string(i)));
+		}
+		if (i == 149) {
+			// Group commit writes everything pending with one flush
+			assert(log.value().size() == 0);
+			j.sync();
+			assert(log.flushes() == 1 && j.durable_seq() == 150);
+		}
+	}
+	// Rehash, then checkpoint a copy on another thread while logging goes on
+	string_writer ckpt;
+	mc.rehash();
+	merkle_cow snap = mc;
+	uint64_t snap_seq = j.last_seq();
+	std::thread ckpt_thread([&]() { write_checkpoint(ckpt, snap, snap_seq); });
+	for(int i = 0; i < 50; i++) {
+		j.log_put("after" + to_string(i), "x");
+		mc.put(to_shared("after" + to_string(i)), to_shared("x"));
+	}
+	mc.root_hash();
+	ckpt_thread.join();
+	j.sync();
+	assert(log.flushes() == 2);
+
+	// Journal alone and checkpoint plus journal both get back to mc
+	merkle_cow r1, r2;
+	string_reader lr1(log.value());
+	recover_info info = recover(nullptr, lr1, r1);
+	assert(info.last_seq == 350 && info.records == 350 && info.valid_bytes == log.value().size());
+	assert(r1.root_hash() == mc.root_hash());
+	string_reader cr(ckpt.value()), lr2(log.value());
+	info = recover(&cr, lr2, r2);
+	assert(info.checkpoint_seq == 300 && info.records == 50);
+	assert(r2.root_hash() == mc.root_hash());
+
+	// A torn tail is dropped, and so is everything after a corrupt record
+	string torn = log.value().substr(0, log.value().size() - 3);
+	string_reader lr3(torn);
+	info = recover(nullptr, lr3, r1);
+	assert(info.last_seq == 349 && info.valid_bytes < torn.size());
+
+	// Through compression too, the synced records survive a torn chunk
+	string_writer zlog;
+	{
+		compress_writer zw(zlog);
+		journal zj(zw);
+		for(int i = 0; i < 100; i++) {
+			zj.log_put(to_string(i), "z");
+			if (i % 10 == 9)
+				zj.sync();
+		}
+	}
+	string ztorn = zlog.value().substr(0, zlog.value().size() - 3);
+	string_reader zr(ztorn);
+	decompress_reader zd(zr);
+	merkle_cow zt;
+	info = replay_journal(zd, zt, 0);
+	assert(info.records == 90 && info.last_seq == 90);
+
+	string bad = log.value();
+	bad[bad.size() / 2] ^= 1;
+	string_reader lr4(bad);
+	info = recover(nullptr, lr4, r1);
+	assert(info.last_seq < 350 && info.valid_bytes < bad.size() / 2);
+	string bad_ckpt = ckpt.value();
+	bad_ckpt[bad_ckpt.size() / 2] ^= 1;
+	string_reader cr2(bad_ckpt);
+	bool threw = false;
+	try { read_checkpoint(cr2, r1); } catch(const io_exception&) { threw = true; }
+	assert(threw);
+
+	// Concurrent writers share flushes
+	string_writer log2;
+	journal j2(log2);
+	vector<std::thread> threads;
+	for(int t = 0; t < 4; t++) {
+		threads.emplace_back([&j2, t]() {
+			for(int i = 0; i < 100; i++)
+				j2.sync(j2.log_put(to_string(t) + "/" + to_string(i), "v"));
+		});
+	}
+	for(auto& t : threads) t.join();
+	assert(j2.durable_seq() == 400 && log2.flushes() <= 400);
+	merkle_cow r3;
+	string_reader lr5(log2.value());
+	info = recover(nullptr, lr5, r3);
+	assert(info.records == 400);
+}
+
+// Counts the calls that reach the underlying 'file'
+class counting_wrapper : public write_wrapper
+{
+public:
+	counting_wrapper(size_t bufsize) : write_wrapper(bufsize), m_calls(0) {}
+	~counting_wrapper() { drain_quietly(); }
+	string value() { return m_value; }
+	size_t calls() const { return m_calls; }
+private:
+	int base_write(const char* buf, int len) { m_calls++; m_value.append(buf, len); return len; }
+	string m_value;
+	size_t m_calls;
+};
+
+// Write a tree through the buffered and gather writers and read it back
+void check_fd_io()
+{
+	merkle_cow mc;
+	for(int i = 0; i < 20000; i++)
+		mc.put(to_shared(to_string(i)), to_shared(string(i % 50, 'v')));
+	mc.rehash();
+	string_writer sw;
+	mc.serialize(sw);
+
+	counting_wrapper unbuffered(0), buffered(k_bufsize);
+	mc.serialize(unbuffered);
+	mc.serialize(buffered);
+	buffered.flush();
+	assert(unbuffered.value() == sw.value() && buffered.value() == sw.value());
+	assert(buffered.calls() <= sw.value().size() / k_bufsize + 1);
+	assert(unbuffered.calls() > 100 * buffered.calls());
+
+	int fd = temp_fd();
+	fd_writer fw(dup(fd), true, 4096);
+	mc.serialize(fw);
+	fw.close();
+	lseek(fd, 0, SEEK_SET);
+	merkle_cow mc2;
+	{
+		fd_reader fr(dup(fd), true, 1000);
+		mc2.deserialize(fr);
+		char c;
+		assert(fr.read(&c, 1) == 0);
+	}
+	assert(mc2.root_hash() == mc.root_hash());
+
+	// Dropped without a flush, what was buffered still gets written
+	assert(ftruncate(fd, 0) == 0);
+	lseek(fd, 0, SEEK_SET);
+	{
+		fd_writer unflushed(fd, false);
+		unflushed.write("abc", 3);
+	}
+	assert(lseek(fd, 0, SEEK_END) == 3);
+
+	assert(ftruncate(fd, 0) == 0);
+	lseek(fd, 0, SEEK_SET);
+	fd_gather_writer gw(fd, false);
+	string big(3 * k_bufsize, 'b');
+	mc.serialize(gw);
+	gw.write_ref("ref", 3);
+	gw.write(big.data(), big.size());
+	gw.flush();
+	assert(gw.syscalls() <= sw.value().size() / (64 * k_bufsize) + 2);
+	lseek(fd, 0, SEEK_SET);
+	fd_reader fr2(fd, true, 0);
+	string back(sw.value().size() + 3 + big.size() + 1, '\0');
+	assert(fr2.read(&back[0], back.size()) == back.size() - 1);
+	assert(back.substr(0, back.size() - 1) == sw.value() + "ref" + big);
+}
+
+// Write a tree through each async engine, with and without O_DIRECT, and read it back
+void check_async_io()
+{
+	merkle_cow mc;
+	for(int i = 0; i < 20000; i++)
+		mc.put(to_shared(to_string(i)), to_shared(string(i % 50, 'v')));
+	mc.rehash();
+	string_writer sw;
+	mc.serialize(sw);
+	for(int k = aio_engine::uring; k <= aio_engine::threads; k++) {
+		aio_engine::kind kind = aio_engine::kind(k);
+		if (!aio_engine::create(4, kind)) continue;
+		for(int direct = 0; direct < 2; direct++) {
+			int fd = direct ? temp_fd(O_DIRECT) : temp_fd();
+			if (fd < 0) continue;  // No O_DIRECT here
+			{
+				async_writer aw(fd, false, 2 * async_writer::k_align, 3, kind);
+				mc.serialize(aw);
+				aw.flush();
+				aw.write("tail", 4);  // Keeps going after a padded flush
+				aw.flush();
+			}
+			assert(lseek(fd, 0, SEEK_END) == off_t(sw.value().size() + 4));
+			lseek(fd, 0, SEEK_SET);
+			async_reader ar(fd, true, async_writer::k_align, 3, kind);
+			merkle_cow mc2;
+			mc2.deserialize(ar);
+			assert(mc2.root_hash() == mc.root_hash());
+			char buf[8];
+			assert(ar.read(buf, sizeof(buf)) == 4 && memcmp(buf, "tail", 4) == 0);
+			assert(ar.read(buf, sizeof(buf)) == 0);
+		}
+	}
+
+	// A pipe fails loudly rather than reading as a short file
+	int fds[2];
+	assert(pipe(fds) == 0);
+	assert(write(fds[1], "data", 4) == 4);
+	{
+		async_reader ar(fds[0], true, async_writer::k_align, 2, aio_engine::threads);
+		char buf[8];
+		bool threw = false;
+		try { ar.read(buf, sizeof(buf)); } catch(const io_exception&) { threw = true; }
+		assert(threw);
+	}
+	::close(fds[1]);
+}
+
+// Compress a serialized tree with each codec and read it back in various ways
+void check_compress()
+{
+	merkle_cow mc;
+	for(int i = 0; i < 20000; i++)
+		mc.put(to_shared(to_string(i)), to_shared(string(i % 50, 'v')));
+	mc.rehash();
+	string_writer sw;
+	mc.serialize(sw);
+	const string& raw = sw.value();
+	for(int c = codec_none; c <= codec_zstd; c++) {
+		compress_codec codec = compress_codec(c);
+		if (!codec_available(codec)) continue;
+		string_writer cw;
+		compress_writer z(cw, codec, 4096);
+		mc.serialize(z);
+		z.flush();
+		z.write("tail", 4);
+		z.close();
+		if (codec != codec_none)
+			assert(cw.value().size() < raw.size() * 3 / 4);
+
+		// Front to back
+		string_reader cr(cw.value());
+		decompress_reader dz(cr);
+		merkle_cow mc2;
+		mc2.deserialize(dz);
+		assert(mc2.root_hash() == mc.root_hash());
+		char buf[8];
+		assert(dz.read(buf, sizeof(buf)) == 4 && memcmp(buf, "tail", 4) == 0);
+
+		// Through the index, inline and with worker threads
+		int fd = temp_fd();
+		assert(::write(fd, cw.value().data(), cw.value().size()) == ssize_t(cw.value().size()));
+		for(size_t threads = 0; threads < 4; threads += 3) {
+			chunk_reader zr(dup(fd), true, threads);
+			assert(zr.size() == raw.size() + 4);
+			merkle_cow mc3;
+			mc3.deserialize(zr);
+			assert(mc3.root_hash() == mc.root_hash());
+			for(size_t pos : { size_t(0), size_t(4095), size_t(4096), raw.size() / 2, raw.size() }) {
+				zr.seek(pos);
+				string back(100, '\0');
+				size_t n = zr.read(&back[0], back.size());
+				back.resize(n);
+				assert(back == (raw + "tail").substr(pos, 100));
+			}
+		}
+		::close(fd);
+
+		// Damage is detected
+		string bad = cw.value();
+		bad[bad.size() / 3] ^= 0x10;
+		string_reader br(bad);
+		decompress_reader bz(br);
+		bool threw = false;
+		try { merkle_cow mc4; mc4.deserialize(bz); } catch(const io_exception&) { threw = true; }
+		assert(threw);
+	}
+}
+
+// A temp file holding a tree's nodes
+template<class Tree>
+int node_file(const Tree& tree)
+{
+	int fd = temp_fd();
+	fd_writer w(fd, false);
+	tree.write_nodes(w);
+	return fd;
+}
+
+// Node files read back through a small cache
+void check_paged()
+{
+	merkle_cow mc;
+	for(int i = 0; i < 20000; i++)
+		mc.put(to_shared(to_string(i)), to_shared(string(i % 40, 'v') + to_string(i)));
+	mc.rehash();
+	int fd = node_file(mc);
+	paged_merkle_cow pc(fd, true, 64 * 1024);
+	assert(pc.size() == 20000 && pc.root_hash() == mc.root_hash());
+	string v;
+	for(int i = 0; i < 21000; i += 7) {
+		string k = to_string(i);
+		slice expect = mc.get(slice(k));
+		assert(pc.get(slice(k), v) == !expect.is_null());
+		assert(expect.is_null() || slice(v) == expect);
+	}
+	assert(!pc.get(slice(""), v) && !pc.get(slice("99999"), v));
+
+	// Scans match the tree's own order
+	const char* starts[] = { "", "1", "15000", "9999", "99999" };
+	for(const char* from : starts) {
+		auto it = mc.lower_bound(slice(from));
+		size_t seen = 0;
+		pc.scan(slice(from), [&](const slice& k, const slice& val) {
+			assert(it != mc.end() && k == it.key() && val == it.value());
+			++it;
+			return ++seen < 3000;
+		});
+		assert(seen == 3000 || it == mc.end());
+	}
+
+	node_cache::counters c = pc.cache_stats();
+	assert(c.misses > 0 && c.evictions > 0 && c.bytes <= 64 * 1024 && c.pinned_bytes > 0);
+
+	// A hot set, once used a few times, survives a scan of everything
+	vector<string> hot;
+	for(int i = 0; i < 10; i++)
+		hot.push_back(to_string(i * 1997));
+	paged_merkle_cow pc2(dup(fd), true, 128 * 1024);
+	for(int round = 0; round < 3; round++) {
+		for(const string& k : hot)
+			assert(pc2.get(slice(k), v));
+	}
+	pc2.scan(slice(""), [&](const slice&, const slice&) { return true; });
+	size_t misses = pc2.cache_stats().misses;
+	for(const string& k : hot)
+		assert(pc2.get(slice(k), v));
+	assert(pc2.cache_stats().misses == misses);
+
+	// Damage is caught
+	int fd2 = node_file(mc);
+	char byte;
+	assert(pread(fd2, &byte, 1, 100) == 1);
+	byte ^= 1;
+	assert(pwrite(fd2, &byte, 1, 100) == 1);
+	paged_merkle_cow bad(fd2, true, 1 << 20);
+	bool threw = false;
+	try {
+		bad.scan(slice(""), [&](const slice&, const slice&) { return true; });
+	} catch(const io_exception&) {
+		threw = true;
+	}
+	assert(threw);
+
+	// And empty trees
+	paged_merkle_cow empty(node_file(merkle_cow()), true, 1024);
+	assert(empty.size() == 0 && !empty.get(slice("1"), v));
+
+	// Built up from an empty file by puts and erases, with a budget small
+	// enough that it commits on its own, it matches a merkle_cow given the same
+	int wfd = temp_fd();
+	merkle_cow same;
+	map<string, string> ref;
+	{
+		paged_merkle_cow pw(wfd, false, 32 * 1024);
+		srand(5);
+		for(int i = 0; i < 20000; i++) {
+			string k = to_string(rand() % 5000);
+			if (rand() % 4 == 0) {
+				assert(pw.erase(slice(k)) == (ref.erase(k) != 0));
+				same.put(to_shared(k), shared_ptr<string>());
+			} else {
+				string val = "w" + to_string(i % 300);
+				assert(pw.put(slice(k), slice(val)) == (ref[k] != val));
+				ref[k] = val;
+				same.put(to_shared(k), to_shared(val));
+			}
+			assert(pw.dirty_bytes() <= 32 * 1024);
+			if (i % 5000 == 4999)
+				assert(pw.size() == ref.size() && pw.root_hash() == same.root_hash());
+		}
+		auto it = ref.begin();
+		pw.scan(slice(""), [&](const slice& k, const slice& val) {
+			assert(it != ref.end() && k == it->first && val == it->second);
+			++it;
+			return true;
+		});
+		assert(it == ref.end());
+		assert(pw.cache_stats().bytes <= 32 * 1024);
+		// Already committed on its own
+		assert(paged_merkle_cow(dup(wfd), true, 1024).size() > 0);
+		pw.commit();
+	}
+	// Reopened, it's the committed tree, and it takes more updates
+	{
+		paged_merkle_cow pr(dup(wfd), true, 64 * 1024);
+		assert(pr.size() == ref.size() && pr.root_hash() == same.root_hash());
+		for(const auto& kvp : ref)
+			assert(pr.get(slice(kvp.first), v) && v == kvp.second);
+		// Emptied, through every merge down to the root
+		for(const auto& kvp : ref) {
+			assert(pr.erase(slice(kvp.first)));
+			same.put(to_shared(kvp.first), shared_ptr<string>());
+		}
+		assert(pr.size() == 0 && pr.root_hash() == same.root_hash() && !pr.get(slice("1"), v));
+		assert(pr.put(slice("1"), slice("one")));
+		pr.commit();
+	}
+	off_t good = lseek(wfd, 0, SEEK_END);
+	{
+		paged_merkle_cow pt(dup(wfd), true, 1 << 20);
+		for(int i = 0; i < 500; i++)
+			pt.put(slice(to_string(i)), slice("torn"));
+		pt.commit();
+	}
+	off_t full = lseek(wfd, 0, SEEK_END);
+	// A commit torn in its footer, or in its nodes, leaves the one before
+	for(off_t cut : { full - 3, (good + full) / 2 }) {
+		assert(ftruncate(wfd, cut) == 0);
+		paged_merkle_cow pt(dup(wfd), true, 1024);
+		assert(pt.size() == 1 && pt.get(slice("1"), v) && v == "one");
+	}
+	// And the next commit cuts the torn tail off
+	{
+		paged_merkle_cow pt(dup(wfd), true, 1024);
+		assert(pt.put(slice("2"), slice("two")));
+		pt.commit();
+	}
+	assert(lseek(wfd, 0, SEEK_END) < (good + full) / 2);
+	paged_merkle_cow last(wfd, true, 1024);
+	assert(last.size() == 2 && last.get(slice("1"), v) && v == "one");
+
+	// A file written from a merkle_cow takes updates too
+	paged_merkle_cow pu(node_file(mc), true, 64 * 1024);
+	for(int i = 0; i < 3000; i++) {
+		string k = to_string(i * 7);
+		if (i % 3 == 0) {
+			pu.erase(slice(k));
+			mc.put(to_shared(k), shared_ptr<string>());
+		} else {
+			pu.put(slice(k), slice("new"));
+			mc.put(to_shared(k), to_shared("new"));
+		}
+	}
+	assert(pu.root_hash() == mc.root_hash());
+	pu.commit();
+	for(int i = 0; i < 21000; i += 7) {
+		string k = to_string(i);
+		slice expect = mc.get(slice(k));
+		assert(pu.get(slice(k), v) == !expect.is_null());
+		assert(expect.is_null() || slice(v) == expect);
+	}
+
+	// Other kinds of tree open only as themselves
+	basic_merkle_cow<64> wide;
+	for(int i = 0; i < 5000; i++)
+		wide.put(to_shared(to_string(i)), to_shared("w"));
+	wide.rehash();
+	int wide_fd = node_file(wide);
+	threw = false;
+	try { paged_merkle_cow(dup(wide_fd), true, 1024); } catch(const io_exception&) { threw = true; }
+	assert(threw);
+	basic_paged_merkle_cow<basic_merkle_cow<64>> pwide(wide_fd, true, 64 * 1024);
+	for(int i = 0; i < 5000; i += 3) {
+		assert(pwide.put(slice(to_string(i)), slice("x")));
+		wide.put(to_shared(to_string(i)), to_shared("x"));
+	}
+	assert(pwide.root_hash() == wide.root_hash());
+	basic_merkle_cow<16, blake3_hash> b3;
+	b3.put(to_shared("1"), to_shared("one"));
+	b3.rehash();
+	threw = false;
+	try { paged_merkle_cow(node_file(b3), true, 1024); } catch(const io_exception&) { threw = true; }
+	assert(threw);
+
+	// Nodes bigger than the tree allows are refused
+	string_writer nodes;
+	node_file_writer nw(nodes, 4, 0);
+	hash_t zero = {};
+	nw.begin_node(0, zero);
+	for(int i = 0; i < 5; i++)
+		nw.add_leaf(slice(to_string(i)), slice("v"));
+	nw.end_node();
+	threw = false;
+	try { paged_node big(nw.payload(), 4); } catch(const io_exception&) { threw = true; }
+	assert(threw);
+
+	// Cached nodes are pinned or not by the pin height as it moves
+	node_cache nc(1 << 20);
+	nc.set_pin_height(1);
+	nc.insert(0, make_shared<const paged_node>(nw.payload(), 5));
+	nw.begin_node(1, zero);
+	nw.add_child(slice("0"), 0, 5, zero);
+	nw.end_node();
+	nc.insert(1, make_shared<const paged_node>(nw.payload(), 5));
+	node_cache::counters nc0 = nc.stats();
+	assert(nc0.pinned_bytes > 0 && nc0.bytes > 0);
+	nc.set_pin_height(0);
+	assert(nc.stats().bytes == 0 && nc.stats().pinned_bytes == nc0.pinned_bytes + nc0.bytes);
+	nc.set_pin_height(2);
+	assert(nc.stats().pinned_bytes == 0 && nc.stats().bytes == nc0.pinned_bytes + nc0.bytes);
+}
+
+// Transactions read their own writes and commit them in one batch
+void check_txn()
+{
+	merkle_cow mc;
+	map<string, string> ref;
+	for(int i = 0; i < 2000; i += 2) {
+		mc.put(to_shared(to_string(i)), to_shared("base" + to_string(i)));
+		ref[to_string(i)] = "base" + to_string(i);
+	}
+	mc.set_filter();
+	hash_t before = mc.root_hash();
+
+	std::mt19937 rng(7);
+	merkle_txn txn(mc);
+	map<string, string> mine = ref;
+	for(int i = 0; i < 3000; i++) {
+		string k = to_string(rng() % 2500);
+		switch(rng() % 3) {
+		case 0:
+			txn.put(slice(k), slice("txn" + to_string(i)));
+			mine[k] = "txn" + to_string(i);
+			break;
+		case 1:
+			txn.erase(slice(k));
+			mine.erase(k);
+			break;
+		default: {
+			slice v = txn.get(slice(k));
+			assert(mine.count(k) ? slice(mine[k]) == v : v.is_null());
+		}
+		}
+	}
+	txn.put(slice("empty"), slice(""));
+	mine["empty"] = "";
+
+	// Merged scans see both layers in order
+	auto expect = mine.lower_bound("15");
+	txn.scan(slice("15"), [&](const slice& k, const slice& v) {
+		assert(expect != mine.end() && k == slice(expect->first) && v == slice(expect->second));
+		++expect;
+		return true;
+	});
+	assert(expect == mine.end());
+
+	// Abort leaves the tree alone
+	txn.abort();
+	assert(txn.pending() == 0 && mc.root_hash() == before);
+	assert(txn.get(slice("2")) == slice("base2"));
+
+	// Commit matches doing the same puts one at a time in key order, and
+	// only changes the tree it was made on
+	map<string, shared_ptr<string>> writes;
+	for(const auto& kv : ref)
+		writes[kv.first] = nullptr;
+	for(const auto& kv : mine)
+		writes[kv.first] = to_shared(kv.second);
+	merkle_cow old = mc;
+	merkle_cow one = mc;
+	for(const auto& kv : writes) {
+		txn.put(slice(kv.first), kv.second ? slice(*kv.second) : slice());
+		one.put(to_shared(kv.first), kv.second);
+	}
+	txn.commit();
+	assert(txn.pending() == 0 && mc.root_hash() == one.root_hash());
+	assert(old.root_hash() == before);
+	auto it = mc.begin();
+	for(const auto& kv : mine) {
+		assert(it != mc.end() && it.key() == slice(kv.first) && it.value() == slice(kv.second));
+		++it;
+	}
+	assert(it == mc.end());
+	for(const auto& kv : mine)
+		assert(mc.filter()->may_contain(fast_hash(kv.first.data(), kv.first.size())));
+	assert(txn.get(slice("empty")) == slice("") && !txn.get(slice("empty")).is_null());
+}
+
+// The first leaf of an int tree, to watch whether it's been freed
+static weak_ptr<const bnode<int_policy>> first_leaf(const int_tree& tree)
+{
+	bnode<int_policy>::ptr_t n = tree.root();
+	for(size_t h = tree.height(); h > 1; h--)
+		n = n->ptr(0);
+	return n;
+}
+
+// Dropped trees are freed at once, a few nodes per node made, or on the
+// background thread, and the trees work the same in every mode
+void check_reclaim()
+{
+	assert(get_reclaim_mode() == reclaim_inline);
+	auto fill = [](int_tree& tree, map<int, int>& ref) {
+		for(int i = 0; i < 5000; i++) {
+			int k = (i * 7919) % 3000;
+			int_put(tree, k, i % 5);
+			if (i % 5) ref[k] = i % 5; else ref.erase(k);
+		}
+	};
+	int_tree tree;
+	map<int, int> ref;
+	fill(tree, ref);
+	weak_ptr<const bnode<int_policy>> leaf = first_leaf(tree);
+	tree = int_tree();
+	assert(leaf.expired() && reclaim_pending() == 0);
+
+	// Deferred, the tree made next pays for the old one a bit at a time
+	set_reclaim_mode(reclaim_deferred);
+	ref.clear();
+	fill(tree, ref);
+	int_tree snap = tree;
+	fill(tree, ref);
+	check_int_tree(tree, ref);
+	leaf = first_leaf(snap);
+	snap = int_tree();
+	assert(reclaim_pending() > 0 && !leaf.expired());
+	int puts = 0;
+	for(; !leaf.expired() && puts < 100000; puts++) {
+		int_put(tree, puts % 3000, 1);
+		ref[puts % 3000] = 1;
+	}
+	assert(leaf.expired() && puts > 10);
+	check_int_tree(tree, ref);
+	assert(reclaim_drain() > 0 && reclaim_pending() == 0);
+
+	ptree pt;
+	for(int i = 0; i < 2000; i++)
+		pt.set(digest(to_string(i)), digest("v" + to_string(i)));
+	digest root = pt.merkle();
+	pt = ptree();
+	assert(reclaim_pending() > 0);
+	for(int i = 0; i < 2000; i++)
+		pt.set(digest(to_string(i)), digest("v" + to_string(i)));
+	assert(pt.merkle() == root && pt.size() == 2000);
+
+	// Background, the thread frees it
+	set_reclaim_mode(reclaim_background);
+	leaf = first_leaf(tree);
+	tree = int_tree();
+	reclaim_flush();
+	assert(leaf.expired() && reclaim_pending() == 0);
+	set_reclaim_mode(reclaim_inline);
+	pt = ptree();
+	assert(reclaim_pending() == 0);
+}
+
 int main() 
 {
+	check_against_map();
+	check_int_tree();
+	check_root_hash();
+	check_digest();
+	check_hashes();
+	check_ptree_rehash();
+	check_ptree_cursor();
+	check_multi_get();
+	check_filter();
+	check_memory();
+	check_stats();
+	check_journal();
+	check_fd_io();
+	check_async_io();
+	check_compress();
+	check_paged();
+	check_txn();
+	check_reclaim();
 	merkle_cow mc;
 	for(size_t i = 0; i < 100; i++) {
 		mc.put(to_shared(to_string(i)), to_shared(to_string(i)));
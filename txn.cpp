@@ -0,0 +1,88 @@
+
+#include "txn.h"
+
+size_t merkle_txn::lower_bound(const slice& k) const
+{
+	return std::lower_bound(m_writes.begin(), m_writes.end(), k,
+		[this](const entry& e, const slice& s) { return key(e) < s; }) - m_writes.begin();
+}
+
+slice merkle_txn::get(const slice& k) const
+{
+	size_t i = lower_bound(k);
+	if (i < m_writes.size() && key(m_writes[i]) == k)
+		return value(m_writes[i]);
+	return m_base.get(k);
+}
+
+void merkle_txn::put(const slice& k, const slice& v)
+{
+	write(k, v, v.is_null());
+}
+
+void merkle_txn::erase(const slice& k)
+{
+	write(k, slice(), true);
+}
+
+uint32_t merkle_txn::append(const slice& s)
+{
+	assert(m_arena.size() + s.size() <= UINT32_MAX);
+	uint32_t off = uint32_t(m_arena.size());
+	m_arena.append(s.data(), s.size());
+	return off;
+}
+
+void merkle_txn::write(const slice& k, const slice& v, bool erased)
+{
+	size_t i = lower_bound(k);
+	if (i == m_writes.size() || !(key(m_writes[i]) == k)) {
+		entry e;
+		e.key_len = uint32_t(k.size());
+		e.key_off = append(k);
+		m_writes.insert(m_writes.begin() + i, e);
+	}
+	// A rewritten value leaves its old bytes behind, they go at commit
+	entry& e = m_writes[i];
+	e.erased = erased;
+	e.value_len = uint32_t(v.size());
+	e.value_off = append(v);
+}
+
+void merkle_txn::scan(const slice& from, const function<bool(const slice&, const slice&)>& fn) const
+{
+	size_t i = lower_bound(from);
+	auto it = m_base.lower_bound(from);
+	auto end = m_base.end();
+	while(i < m_writes.size() || it != end) {
+		// Take the smaller key, a write hides the tree's entry for its key
+		int c = i == m_writes.size() ? 1 : (it == end ? -1 : key(m_writes[i]).compare(it.key()));
+		if (c <= 0) {
+			const entry& e = m_writes[i++];
+			if (c == 0) ++it;
+			if (!e.erased && !fn(key(e), value(e)))
+				return;
+		} else {
+			if (!fn(it.key(), it.value()))
+				return;
+			++it;
+		}
+	}
+}
+
+void merkle_txn::commit()
+{
+	vector<pair<slice, slice>> batch;
+	batch.reserve(m_writes.size());
+	for(const entry& e : m_writes)
+		batch.emplace_back(key(e), value(e));
+	m_tree.write_batch(batch);
+	m_base = m_tree;
+	abort();
+}
+
+void merkle_txn::abort()
+{
+	m_writes.clear();
+	m_arena.clear();
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "merkle_cow.h"
+
+// A batch of writes over a merkle_cow that can be read back before it is
+// applied.  Reads see the tree as it was when the transaction started (or
+// last committed) with the transaction's own writes on top.  The writes sit
+// in one sorted array whose keys and values are packed into a single
+// string, so a block's worth of writes takes a couple of allocations.
+// commit() applies them all in key order with one merkle_cow::write_batch,
+// abort() just forgets them.  Not safe to share between threads.
+class merkle_txn
+{
+public:
+	explicit merkle_txn(merkle_cow& tree) : m_tree(tree), m_base(tree) {}
+
+	// Value of key, a null slice if it's absent or erased.  Values written
+	// by this transaction are good until the next put, values from the
+	// tree until commit(), which lets go of the snapshot they point into.
+	slice get(const slice& key) const;
+	// Set key to value, a null value erases it
+	void put(const slice& key, const slice& value);
+	void erase(const slice& key);
+
+	// Calls fn(key, value) in key order from the first key at or after
+	// 'from', until fn returns false or the keys run out.  Don't write to
+	// the transaction from fn.
+	void scan(const slice& from, const function<bool(const slice&, const slice&)>& fn) const;
+
+	// Keys written or erased so far
+	size_t pending() const { return m_writes.size(); }
+
+	// Apply the writes to the tree as it is now, and start again from the
+	// result
+	void commit();
+	// Drop the writes, keeping the buffers for reuse
+	void abort();
+
+private:
+	struct entry
+	{
+		uint32_t key_off;
+		uint32_t key_len;
+		uint32_t value_off;
+		uint32_t value_len;
+		bool erased;
+	};
+	slice key(const entry& e) const { return slice(m_arena.data() + e.key_off, e.key_len); }
+	slice value(const entry& e) const { return e.erased ? slice() : slice(m_arena.data() + e.value_off, e.value_len); }
+	// Index of the first write at or after key
+	size_t lower_bound(const slice& key) const;
+	void write(const slice& key, const slice& value, bool erased);
+	uint32_t append(const slice& s);
+
+	merkle_cow& m_tree;
+	merkle_cow m_base;  // What reads fall through to
+	string m_arena;  // Keys and values of m_writes
+	vector<entry> m_writes;  // Sorted by key, one per key
+};
@@ -16,9 +16,12 @@
 #include <tuple>
 #include <algorithm>
 #include <exception>
+#include <stdexcept>
+#include <functional>
 
 using std::shared_ptr;
 using std::unique_ptr;
+using std::weak_ptr;
 using std::make_shared;
 using std::enable_shared_from_this;
 using std::string;
@@ -1,5 +1,8 @@
 
 #include "types.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <sstream>
 #include <iomanip>
 
@@ -38,6 +41,23 @@ string hexify(const string& input) {
 	return out;
 }
 
+uint64_t fast_hash(const char* p, size_t len, uint64_t h)
+{
+	h ^= len * 0x9e3779b97f4a7c15ull;
+	while(len >= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		h = (h ^ v) * 0xff51afd7ed558ccdull;
+		h ^= h >> 32;
+		p += 8;
+		len -= 8;
+	}
+	uint64_t v = 0;
+	memcpy(&v, p, len);
+	h = (h ^ v) * 0xc4ceb9fe1a85ec53ull;
+	return h ^ (h >> 29);
+}
+
 // TODO: Where did I get this hexdump?
 string hexdump(const string& input)
 {
@@ -1,3 +1,6 @@
+#pragma once
+
+#include "types.h"
 
 
 // Helper to 'printf' to strings
@@ -8,4 +11,6 @@ string cleanify(const string& input);
 string hexify(const string& input);
 // Does long form hex dumps
 string hexdump(const string& input);
+// Cheap non-cryptographic hash, for placing things in tables and filters
+uint64_t fast_hash(const char* p, size_t len, uint64_t seed = 0);
 